@@ -0,0 +1,18 @@
+#!/bin/sh
+cd "$(dirname "$0")"
+
+# Build and run the benchmarks of the portable code
+mkdir -p bench/bin
+
+run () {
+  name=$1
+  shift
+  cc -O2 -std=gnu11 -Wall -Wextra "$@" -o "bench/bin/$name" && "./bench/bin/$name"
+}
+
+run chksum bench/chksum.c chksum.c
+run filter bench/filter.c relay.c chksum.c
+
+# The replay tool times the whole core, from parsing to rewriting
+cc -O2 -std=gnu11 -Wall -Wextra test/replay.c relay.c chksum.c -o bench/bin/replay \
+&& ./bench/bin/replay test/replay/routes.txt test/replay/input.pcap -n 100000
@@ -0,0 +1,92 @@
+/* =============================================================================
+// BROADcast
+//
+// Checksum kernel throughput, 8 bytes to 64 KiB.
+//
+// https://buymeacoff.ee/ubihazard
+// -------------------------------------------------------------------------- */
+
+#include "../chksum.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* -------------------------------------------------------------------------- */
+
+static double now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static const struct {
+  const char* name;
+  chksum_fn fn;
+  const char* feature;
+} kernels[] = {
+  {"scalar", chksum_scalar, NULL}
+, {"SSE2", chksum_sse2, "sse2"}
+, {"AVX2", chksum_avx2, "avx2"}
+};
+
+static int supported (const char* const feature)
+{
+  if (feature == NULL) return 1;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (strcmp (feature, "sse2") == 0) return __builtin_cpu_supports ("sse2");
+  if (strcmp (feature, "avx2") == 0) return __builtin_cpu_supports ("avx2");
+#endif
+  return 1;
+}
+
+/* Powers of two, plus the largest datagram in an Ethernet frame */
+static const size_t sizes[] = {8, 16, 32, 64, 128, 256, 512, 1024, 1472
+, 2048, 4096, 8192, 16384, 32768, 65536};
+
+/* Keeps the calls from being optimized away */
+static volatile uint16_t sink;
+
+/* GB/s over about a tenth of a second of calls */
+static double measure (chksum_fn const fn, const unsigned char* const buf, size_t const sz)
+{
+  size_t const batch = (1 << 22) / sz + 1;
+  size_t calls = 0;
+  double const start = now();
+  double elapsed;
+
+  do {
+    uint16_t acc = 0;
+    for (size_t i = 0; i < batch; ++i) acc += fn (buf, sz);
+    sink = acc;
+    calls += batch;
+    elapsed = now() - start;
+  } while (elapsed < 0.1);
+
+  return (double)calls * sz / elapsed / 1e9;
+}
+
+int main (void)
+{
+  static unsigned char buf[65536];
+  for (size_t i = 0; i < sizeof(buf); ++i) buf[i] = (unsigned char)rand();
+
+  printf ("%8s", "bytes");
+  for (size_t k = 0; k < sizeof(kernels) / sizeof(*kernels); ++k) {
+    if (supported (kernels[k].feature)) printf ("%10s", kernels[k].name);
+  }
+  printf ("    GB/s, using %s\n", chksum_name());
+
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); ++i) {
+    printf ("%8zu", sizes[i]);
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(*kernels); ++k) {
+      if (supported (kernels[k].feature)) printf ("%10.2f", measure (kernels[k].fn, buf, sizes[i]));
+    }
+    printf ("\n");
+  }
+
+  return 0;
+}
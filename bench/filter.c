@@ -0,0 +1,139 @@
+/* =============================================================================
+// BROADcast
+//
+// Filter rule evaluation cost with growing rule sets.
+//
+// https://buymeacoff.ee/ubihazard
+// -------------------------------------------------------------------------- */
+
+#include "../relay.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* -------------------------------------------------------------------------- */
+
+/* Packets looked up per pass: more than fits in the cache lines
+// the search touches, so that the branches can't be learned */
+#define PACKETS 4096
+
+static double now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint32_t random32 (void)
+{
+  return ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+}
+
+/* What the rules would cost without compiling them */
+static bool linear (const relay_filter_rule* const rules, size_t const rules_num
+, uint16_t const port, uint32_t const addr)
+{
+  unsigned char b[4];
+  memcpy (b, &addr, sizeof(b));
+  uint32_t const host = ((uint32_t)b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+  bool port_ok = !rules[0].allow, addr_ok = !rules[1].allow;
+
+  for (size_t i = 0; i < rules_num; ++i) {
+    const relay_filter_rule* const r = &rules[i];
+    uint32_t const v = r->kind == RELAY_FILTER_PORT ? port : host;
+    if (v < r->first || v > r->last) continue;
+    if (r->kind == RELAY_FILTER_PORT) port_ok = r->allow;
+    else addr_ok = r->allow;
+  }
+
+  return port_ok && addr_ok;
+}
+
+int main (void)
+{
+  static const size_t sizes[] = {2, 16, 256, 4096, 65536};
+  static uint16_t ports[PACKETS];
+  static uint32_t addrs[PACKETS];
+  volatile unsigned sink;
+
+  srand (1);
+
+  for (size_t i = 0; i < PACKETS; ++i) {
+    ports[i] = (uint16_t)rand();
+    addrs[i] = random32();
+  }
+
+  printf ("%8s %8s %12s %12s %12s\n", "rules", "ranges", "compile ms", "ns/packet", "linear ns");
+
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(*sizes); ++s) {
+    size_t const rules_num = sizes[s];
+    relay_filter_rule* const rules = malloc (rules_num * sizeof(*rules));
+    if (rules == NULL) return 1;
+
+    /* Half port ranges, half source subnets of /8 to /32,
+    // alternating so that both kinds start right away */
+    for (size_t i = 0; i < rules_num; ++i) {
+      rules[i].allow = rand() % 2;
+      if (i % 2 == 0) {
+        rules[i].kind = RELAY_FILTER_PORT;
+        rules[i].first = rand() % 65536;
+        rules[i].last = rules[i].first + rand() % 16;
+        if (rules[i].last > 65535) rules[i].last = 65535;
+      } else {
+        unsigned const bits = 8 + rand() % 25;
+        uint32_t const mask = UINT32_MAX << (32 - bits);
+        rules[i].kind = RELAY_FILTER_FROM;
+        rules[i].first = random32() & mask;
+        rules[i].last = rules[i].first | ~mask;
+      }
+    }
+
+    relay_filter filter;
+    memset (&filter, 0, sizeof(filter));
+    double const t0 = now();
+    if (!relay_filter_compile (&filter, rules, rules_num)) return 1;
+    double const compile = now() - t0;
+
+    /* About a tenth of a second of lookups */
+    size_t looked = 0;
+    unsigned pass = 0;
+    double const t1 = now();
+    double elapsed;
+
+    do {
+      for (size_t i = 0; i < PACKETS; ++i) {
+        pass += relay_filter_port (&filter, ports[i])
+        && relay_filter_addr (&filter.from, addrs[i]);
+      }
+      looked += PACKETS;
+      elapsed = now() - t1;
+    } while (elapsed < 0.1);
+
+    double const ns = elapsed * 1e9 / looked;
+
+    /* The linear scan gets slow, so fewer of those */
+    size_t scanned = 0;
+    double const t2 = now();
+
+    do {
+      for (size_t i = 0; i < PACKETS / 16; ++i) {
+        pass += linear (rules, rules_num, ports[i], addrs[i]);
+      }
+      scanned += PACKETS / 16;
+      elapsed = now() - t2;
+    } while (elapsed < 0.1);
+
+    sink = pass;
+    (void)sink;
+
+    printf ("%8zu %8zu %12.3f %12.1f %12.1f\n", rules_num, filter.from.ranges_num
+    , compile * 1e3, ns, elapsed * 1e9 / scanned);
+
+    relay_filter_release (&filter);
+    free (rules);
+  }
+
+  return 0;
+}
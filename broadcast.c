@@ -29,8 +29,13 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <signal.h>
+#include <stdio.h>
 #include <wchar.h>
 
+#include "chksum.h"
+#include "epoch.h"
+#include "relay.h"
+
 /* -------------------------------------------------------------------------- */
 
 #define APP_TITLE L"BROADcast"
@@ -49,15 +54,149 @@
 
 #define METRIC_CHANGE_TRIES_MAX 5
 
-/* -------------------------------------------------------------------------- */
+/* Maximum number of network interfaces to relay broadcast to
+// (the event loop waits on two more events besides theirs) */
+#define RELAY_IFACES_MAX (WSA_MAXIMUM_WAIT_EVENTS - 2)
+
+/* Sends waiting for their turn on each relay interface */
+#define RELAY_QUEUE_DEFAULT 64
+#define RELAY_QUEUE_MAX 256
+
+/* Sends in flight on each relay interface (I/O completion port) */
+#define RELAY_INFLIGHT_MAX 4
+
+/* How long the I/O completion port workers block
+// on a full queue before dropping the packet after all */
+#define RELAY_BLOCK_TIMEOUT 100
+
+/* Consecutive send errors after which a relay socket is retired */
+#define RELAY_ERRORS_MAX 8
+
+/* Receives kept posted on the listening socket by the I/O completion port */
+#define IOCP_DEPTH_DEFAULT 16
+#define IOCP_DEPTH_MAX 1024
+
+/* Worker threads processing I/O completions */
+#define IOCP_THREADS_MAX 64
+
+/* Packets waiting for each worker of the sharded engine (a power of two) */
+#define SHARD_RING_SIZE 64
+
+/* Microseconds the event loop may spin before blocking */
+#define POLL_BUDGET_MAX 100000
+
+/* Packet buffers allocated at startup (per receive kept posted) */
+#define POOL_SIZE_PER_RECV 4
+#define POOL_SIZE_MIN 2
+#define POOL_SIZE_MAX 4096
+
+/* Relay metrics are served in Prometheus text format on this pipe */
+#define METRICS_PIPE L"\\\\.\\pipe\\BROADcast"
+
+/* Room for the metrics of all relay interfaces and shard workers */
+#define METRICS_TEXT_MAX 65536
+
+/* Longest console summary interval (in seconds) */
+#define METRICS_INTERVAL_MAX 3600
+
+/* Trace records buffered by each thread (a power of two) */
+#define TRACE_RING_SIZE 1024
+
+/* How often trace records are written out (in milliseconds) */
+#define TRACE_FLUSH_INTERVAL 10
+
+/* Captured packets are handed to the writer thread
+// in chunks this big (a few per second at most) */
+#define CAPTURE_CHUNK_SIZE (1024 * 1024)
+#define CAPTURE_CHUNKS 8
+
+/* Partially filled chunks are written out after this long (in milliseconds) */
+#define CAPTURE_FLUSH_INTERVAL 1000
+
+/* Relay interfaces described in a capture file */
+#define CAPTURE_IFACES_MAX 256
+
+/* Capture file rotation limits */
+#define CAPTURE_SIZE_MAX 65536
+#define CAPTURE_FILES_MAX 1000
+
+/* Latency histograms are log-linear: every power of two (in nanoseconds)
+// is split into 16 linear buckets, which keeps the error within 6% */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_EXP_MAX 40
+#define HIST_BUCKETS (HIST_SUB + (HIST_EXP_MAX - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/* Rate limits are in packets per second */
+#define RATE_MAX 1000000
+
+/* Token buckets kept for sources and for ports */
+#define RATE_BUCKETS 1024
+
+/* Slots searched for a bucket before taking over the idlest one */
+#define RATE_PROBES_MAX 8
+
+/* Longest line in the filter rules file */
+#define FILTER_LINE_MAX 256
+
+/* Packets already relayed are remembered for a while
+// (in milliseconds) to break relay loops */
+#define DEDUP_WINDOW_DEFAULT 100
+#define DEDUP_WINDOW_MAX 60000
+
+/* Number of remembered packets (rounded up to a power of two) */
+#define DEDUP_SIZE_DEFAULT 4096
+#define DEDUP_SIZE_MAX (1u << 20)
+
+/* Slots searched for a fingerprint before giving up */
+#define DEDUP_PROBES_MAX 8
+
+/* Payload bytes hashed into the fingerprint besides the checksum */
+#define DEDUP_HASH_BYTES 64
+
+/* Ports with a beacon hold-down, and announcements remembered for them */
+#define BEACON_RULES_MAX 32
+#define BEACON_SIZE 4096
+#define BEACON_WINDOW_MAX 60000
+
+/* Peer instances to tunnel broadcasts to */
+#define TUNNEL_PEERS_MAX 16
+#define TUNNEL_PORT_DEFAULT 45454
+
+/* Milliseconds to wait for more packets to pack together */
+#define TUNNEL_WINDOW_DEFAULT 5
+#define TUNNEL_WINDOW_MAX 1000
 
-#define IP_HEADER_SIZE 20
-#define IP_ADDR_SRC_POS 12
-#define IP_ADDR_DST_POS 16
+/* Batches stay under this size (larger packets go alone) */
+#define TUNNEL_MTU 1400
+#define TUNNEL_BATCHES 8
 
-#define UDP_HEADER_SIZE 8
-#define UDP_LENGTH_POS 4
-#define UDP_CHECKSUM_POS 6
+/* Packets tunnelled and re-emitted are remembered this long (milliseconds) */
+#define TUNNEL_ECHOES 1024
+#define TUNNEL_ECHO_WINDOW 1000
+
+/* Peers each relay interface sends unicast copies to */
+#define UNICAST_PEERS_MAX 16
+#define UNICAST_FIXED_MAX 64
+
+/* Seconds a learned peer is kept after it was last heard from */
+#define UNICAST_AGE_DEFAULT 300
+#define UNICAST_AGE_MAX 86400
+
+/* Multicast groups to relay, and interfaces configured as their members */
+#define MCAST_GROUPS_MAX 32
+#define MCAST_FIXED_MAX 64
+
+/* IGMP timers (seconds): membership lasts for two query intervals
+// and a bit, and a host leaving gets the others one last chance */
+#define MCAST_QUERY_INTERVAL 125
+#define MCAST_MEMBER_TIMEOUT 260
+#define MCAST_LEAVE_TIMEOUT 2
+
+/* Milliseconds between looks at the relay interfaces */
+#define MCAST_SYNC_INTERVAL 1000
+
+#define MCAST_RECORDS_MAX 64
 
 /* -------------------------------------------------------------------------- */
 
@@ -65,12 +204,406 @@
 
 /* -------------------------------------------------------------------------- */
 
+/* Packets are received into buffers taken from a pool allocated
+// at startup. A buffer is referenced by the receive which fills it
+// and by every send which is relaying it, and goes back to the pool
+// only after the last of them completes. */
+typedef struct relay_packet relay_packet;
+
+/* Every interface gets its own copy of the UDP header
+// (with its own checksum), while the payload is shared
+// with all other interfaces */
+typedef struct relay_send {
+  OVERLAPPED ovlp;
+  relay_packet* packet;
+  SOCKET sock;
+  ULONG addr;
+  ULONG addr_dst;
+  DWORD slot;
+  DWORD gen;
+  LONGLONG time_queued;
+  WSABUF wsa_bufs[2];
+  BYTE udp_header[UDP_HEADER_SIZE];
+  /* Unicast copies go out one peer after another, each completion
+  // posting the next: Winsock has no `sendmmsg()`, so posting them
+  // all at once would take as many calls and an `OVERLAPPED`
+  // and header per peer in every send of every pooled packet */
+  DWORD chksum_base;
+  DWORD peers_num;
+  DWORD peer;
+  ULONG peers[UNICAST_PEERS_MAX];
+} relay_send;
+
+struct relay_packet {
+  SLIST_ENTRY entry;
+  OVERLAPPED ovlp;
+  WSABUF wsa_buf;
+  volatile LONG refs;
+  LONGLONG time_recv;
+  relay_send sends[RELAY_IFACES_MAX];
+  DECLSPEC_ALIGN(SYSTEM_CACHE_ALIGNMENT_SIZE) unsigned char buf[BUF_SIZE];
+};
+
+/* Why packets weren't relayed */
+typedef enum metrics_drop {
+  DROP_MALFORMED,
+  DROP_FILTER,
+  DROP_IGNORED,
+  DROP_DUPLICATE,
+  DROP_BEACON,
+  DROP_RATE,
+  DROP_SHARD,
+  DROP_REASONS
+} metrics_drop;
+
+/* Counters are kept per thread, each set in its own cache line,
+// and only added up when somebody asks for them */
+typedef struct DECLSPEC_ALIGN(SYSTEM_CACHE_ALIGNMENT_SIZE) metrics_shard {
+  ULONGLONG captured;
+  ULONGLONG captured_bytes;
+  ULONGLONG dropped[DROP_REASONS];
+  ULONGLONG route_refreshes;
+} metrics_shard;
+
+/* Trace records are written by the relay threads as they go
+// and only formatted later by the trace thread */
+typedef enum trace_kind {
+  TRACE_PACKET,
+  TRACE_RELAYED,
+  TRACE_DUPLICATE
+} trace_kind;
+
+typedef struct trace_record {
+  LONGLONG time;
+  ULONG addr_src;
+  ULONG addr_dst;
+  ULONG addr;
+  WORD port_src;
+  WORD port_dst;
+  DWORD size;
+  DWORD kind;
+} trace_record;
+
+/* Single producer, single consumer ring per relay thread */
+typedef struct trace_ring {
+  volatile LONG head;
+  DECLSPEC_ALIGN(SYSTEM_CACHE_ALIGNMENT_SIZE) volatile LONG tail;
+  DECLSPEC_ALIGN(SYSTEM_CACHE_ALIGNMENT_SIZE) LONG dropped;
+  trace_record records[TRACE_RING_SIZE];
+} trace_ring;
+
+/* Chunk of pcapng blocks on its way to disk */
+typedef struct capture_chunk {
+  BYTE* data;
+  DWORD len;
+  /* Starts a new file */
+  BOOL rotate;
+} capture_chunk;
+
+/* Stages a relayed packet goes through */
+typedef enum stage {
+  STAGE_PARSE,
+  STAGE_ROUTE_QUERY,
+  STAGE_FWD_TABLE,
+  STAGE_CHKSUM,
+  STAGE_SEND,
+  STAGE_TOTAL,
+  STAGES
+} stage;
+
+typedef struct stage_hist {
+  ULONGLONG counts[HIST_BUCKETS];
+  ULONGLONG max;
+} stage_hist;
+
+/* Token bucket (tokens are thousandths of a packet) */
+typedef struct rate_bucket {
+  ULONG key;
+  BOOL used;
+  DWORD tokens;
+  DWORD time;
+  DWORD passed;
+  DWORD dropped;
+} rate_bucket;
+
+typedef struct rate_limit {
+  DWORD rate;
+  DWORD burst;
+} rate_limit;
+
+typedef enum rate_level {
+  RATE_SOURCE,
+  RATE_PORT,
+  RATE_IFACE,
+  RATE_LEVELS
+} rate_level;
+
+/* Peer learned from the traffic it sends */
+typedef struct unicast_peer {
+  ULONG addr;
+  DWORD time;
+} unicast_peer;
+
+/* Each relay interface drains its own bounded queue of sends,
+// so a slow interface can't hold up all the others */
+typedef struct relay_iface {
+  ULONG addr;
+  /* Subnet peers are learned from */
+  ULONG net;
+  ULONG mask;
+  SOCKET sock;
+  DWORD gen;
+  DWORD errors;
+  SRWLOCK lock;
+  CONDITION_VARIABLE room;
+  /* Send in flight (event loop) */
+  HANDLE evnt;
+  relay_send* sending;
+  DWORD inflight;
+  /* Sends waiting for their turn */
+  relay_send* queue[RELAY_QUEUE_MAX];
+  DWORD queue_head;
+  DWORD queue_len;
+  DWORD queue_hwm;
+  DWORD drops;
+  /* Rate limit */
+  rate_bucket rate;
+  /* Unicast peers */
+  unicast_peer peers[UNICAST_PEERS_MAX];
+  DWORD peers_num;
+  /* When the last IGMP report for each group was heard (zero if never) */
+  DWORD mcast_time[MCAST_GROUPS_MAX];
+  /* Metrics */
+  ULONGLONG relayed;
+  ULONGLONG relayed_bytes;
+  ULONGLONG unicast;
+  ULONGLONG send_errors;
+} relay_iface;
+
+/* Time-stamped packet fingerprint */
+typedef struct dedup_entry {
+  ULONGLONG hash;
+  DWORD time;
+} dedup_entry;
+
+/* Hold-down for announcements to a range of ports */
+typedef struct beacon_rule {
+  WORD first;
+  WORD last;
+  DWORD window;
+  ULONGLONG packets;
+  ULONGLONG bytes;
+} beacon_rule;
+
+/* Multicast group member configured on the command line */
+typedef struct mcast_fixed {
+  ULONG group;
+  ULONG addr;
+} mcast_fixed;
+
+/* IGMP socket of a relay interface */
+typedef struct mcast_iface {
+  ULONG addr;
+  SOCKET sock;
+  HANDLE evnt;
+  DWORD query_time;
+} mcast_iface;
+
+/* Tunnel datagram being filled or on its way to the peers */
+typedef struct tunnel_batch {
+  BYTE* data;
+  DWORD len;
+  /* When the first packet went in */
+  DWORD time;
+} tunnel_batch;
+
+/* What to do with a packet when the queue is full */
+typedef enum relay_policy {
+  RELAY_DROP_OLDEST,
+  RELAY_DROP_NEWEST,
+  RELAY_BLOCK
+} relay_policy;
+
+enum {
+  IOCP_KEY_RECV,
+  IOCP_KEY_SEND,
+  IOCP_KEY_STOP
+};
+
+/* Relay targets as of one refresh of the routes. Never changed
+// once published: the relay threads read it without locks. */
+typedef struct route_snapshot {
+  epoch_node node;
+  ULONG addr_route;
+  uint32_t targets[RELAY_IFACES_MAX];
+  /* Subnet of each target (zero if there is none) */
+  uint32_t nets[RELAY_IFACES_MAX];
+  uint32_t masks[RELAY_IFACES_MAX];
+  /* Relay socket table slot of each target */
+  DWORD slots[RELAY_IFACES_MAX];
+  DWORD targets_num;
+  ULONGLONG version;
+} route_snapshot;
+
+/* Worker of the sharded engine. Only the dispatcher moves `tail`
+// and only the worker moves `head`, so the ring needs no lock. */
+typedef struct shard_worker {
+  DECLSPEC_ALIGN(SYSTEM_CACHE_ALIGNMENT_SIZE) volatile LONG head;
+  volatile LONG waiting;
+  HANDLE evnt;
+  HANDLE thread;
+  /* Relay sockets of its own, one per target of the snapshot last seen */
+  ULONGLONG version;
+  ULONG addrs[RELAY_IFACES_MAX];
+  SOCKET socks[RELAY_IFACES_MAX];
+  DWORD errors[RELAY_IFACES_MAX];
+  DWORD socks_num;
+  /* Load */
+  ULONGLONG packets;
+  ULONGLONG bytes;
+  LONGLONG busy;
+  /* Dispatcher side */
+  DECLSPEC_ALIGN(SYSTEM_CACHE_ALIGNMENT_SIZE) volatile LONG tail;
+  DWORD depth_max;
+  ULONGLONG dropped;
+  /* Console summary */
+  ULONGLONG packets_last;
+  relay_packet* ring[SHARD_RING_SIZE];
+} shard_worker;
+
+/* -------------------------------------------------------------------------- */
+
 static HANDLE evnt_stop;
 static HANDLE evnt_read;
-static HANDLE evnt_write;
 static OVERLAPPED ovlp_read;
-static OVERLAPPED ovlp_write;
 static SOCKET sock_listen;
+static relay_iface relay_ifaces[RELAY_IFACES_MAX];
+static DWORD relay_ifaces_num;
+static route_snapshot route_empty;
+/* A reader per relay thread */
+static epoch_reader route_readers[1 + IOCP_THREADS_MAX];
+static epoch_domain route_domain = EPOCH_DOMAIN_INIT (&route_empty.node
+, route_readers, numof(route_readers));
+static ULONGLONG route_version;
+static PMIB_IPFORWARDTABLE fwd_table;
+static ULONG fwd_table_sz;
+static HANDLE notify_route;
+static HANDLE notify_iface;
+static HANDLE notify_addr;
+static volatile LONG route_dirty;
+static BOOL route_notify;
+static SRWLOCK relay_lock = SRWLOCK_INIT;
+static DWORD relay_queue_len = RELAY_QUEUE_DEFAULT;
+static relay_policy relay_queue_policy = RELAY_DROP_OLDEST;
+static HANDLE iocp;
+static BOOL use_iocp = TRUE;
+static DWORD iocp_depth = IOCP_DEPTH_DEFAULT;
+static DWORD iocp_threads;
+static volatile LONG iocp_pending;
+static volatile LONG iocp_stopping;
+static volatile LONG iocp_missing;
+static BOOL use_shards;
+static shard_worker shard_workers[IOCP_THREADS_MAX];
+static DWORD shard_workers_num;
+static relay_packet* pool;
+static SLIST_HEADER pool_free;
+static DWORD pool_size;
+static volatile LONG pool_used;
+static volatile LONG pool_used_max;
+static volatile LONG pool_misses;
+static rate_limit rate_limits[RATE_LEVELS];
+static rate_bucket rate_sources[RATE_BUCKETS];
+static rate_bucket rate_ports[RATE_BUCKETS];
+static SRWLOCK rate_lock = SRWLOCK_INIT;
+static const wchar_t* filter_path;
+static relay_filter filter;
+static dedup_entry* dedup_table;
+static DWORD dedup_size = DEDUP_SIZE_DEFAULT;
+static DWORD dedup_window = DEDUP_WINDOW_DEFAULT;
+static SRWLOCK dedup_lock = SRWLOCK_INIT;
+static beacon_rule beacon_rules[BEACON_RULES_MAX];
+static DWORD beacon_rules_num;
+static dedup_entry* beacon_table;
+static SRWLOCK beacon_lock = SRWLOCK_INIT;
+static SOCKADDR_IN tunnel_peers[TUNNEL_PEERS_MAX];
+static DWORD tunnel_peers_num;
+static DWORD tunnel_port = TUNNEL_PORT_DEFAULT;
+static DWORD tunnel_window = TUNNEL_WINDOW_DEFAULT;
+static SOCKET tunnel_sock = INVALID_SOCKET;
+static SOCKET tunnel_emit_sock = INVALID_SOCKET;
+static ULONG tunnel_emit_addr;
+static SRWLOCK tunnel_lock = SRWLOCK_INIT;
+static HANDLE tunnel_evnt;
+static HANDLE tunnel_read_evnt;
+static HANDLE tunnel_thread;
+static BYTE* tunnel_recv_buf;
+static tunnel_batch tunnel_batches[TUNNEL_BATCHES];
+static tunnel_batch* tunnel_current;
+static tunnel_batch* tunnel_free[TUNNEL_BATCHES];
+static DWORD tunnel_free_num;
+static tunnel_batch* tunnel_full[TUNNEL_BATCHES];
+static DWORD tunnel_full_head;
+static DWORD tunnel_full_num;
+static dedup_entry tunnel_local[TUNNEL_ECHOES];
+static dedup_entry tunnel_remote[TUNNEL_ECHOES];
+static ULONGLONG tunnel_packets;
+static ULONGLONG tunnel_datagrams;
+static ULONGLONG tunnel_received;
+static ULONGLONG tunnel_emitted;
+static ULONGLONG tunnel_echoes;
+static ULONGLONG tunnel_rejected;
+static ULONGLONG tunnel_errors;
+static LONG tunnel_drops;
+static BOOL unicast_ports_on;
+static BYTE unicast_ports[65536 / 8];
+static ULONG unicast_fixed[UNICAST_FIXED_MAX];
+static DWORD unicast_fixed_num;
+static DWORD unicast_age = UNICAST_AGE_DEFAULT;
+static ULONG mcast_groups[MCAST_GROUPS_MAX];
+static DWORD mcast_groups_num;
+static mcast_fixed mcast_fixed_members[MCAST_FIXED_MAX];
+static DWORD mcast_fixed_num;
+static ULONG mcast_route;
+static mcast_iface mcast_ifaces[RELAY_IFACES_MAX];
+static DWORD mcast_ifaces_num;
+static HANDLE mcast_thread;
+static metrics_shard metrics_shards[1 + IOCP_THREADS_MAX];
+static __declspec(thread) metrics_shard* metrics_local;
+static DWORD metrics_interval;
+static trace_ring* trace_rings;
+static HANDLE trace_thread;
+static const wchar_t* trace_path;
+static FILE* trace_file;
+static LARGE_INTEGER trace_start_time;
+static LARGE_INTEGER qpc_freq;
+static const wchar_t* capture_path;
+static DWORD capture_size_max;
+static DWORD capture_files_max;
+static SRWLOCK capture_lock = SRWLOCK_INIT;
+static HANDLE capture_evnt;
+static HANDLE capture_thread;
+static capture_chunk capture_chunks[CAPTURE_CHUNKS];
+static capture_chunk* capture_current;
+static capture_chunk* capture_free[CAPTURE_CHUNKS];
+static DWORD capture_free_num;
+static capture_chunk* capture_full[CAPTURE_CHUNKS];
+static DWORD capture_full_head;
+static DWORD capture_full_num;
+static ULONG capture_ifaces[CAPTURE_IFACES_MAX];
+static DWORD capture_ifaces_num;
+static ULONGLONG capture_file_bytes;
+static BOOL capture_section;
+static HANDLE capture_file = INVALID_HANDLE_VALUE;
+static DWORD capture_index;
+static LONG capture_drops;
+static stage_hist stage_hists[1 + IOCP_THREADS_MAX][STAGES];
+static HANDLE metrics_thread;
+static DWORD poll_budget;
+static DWORD poll_cpu = MAXDWORD;
+static LONGLONG poll_spinning;
+static LONGLONG poll_blocked;
+static ULONGLONG poll_hits;
+static ULONGLONG poll_misses;
 static ULONG addr_localhost;
 static ULONG addr_broadcast;
 static DWORD service_status;
@@ -93,46 +626,6 @@ static void msg_error (const wchar_t* const msg)
   set_text_color (7);
 }
 
-/* -----------------------------------------------------------------------------
-// We need to recompute the UDP packet checksum
-// when we change its source address */
-static void udp_chksum (unsigned char* const payload, DWORD const payload_sz
-, DWORD const addr_src, DWORD const addr_dst)
-{
-  size_t sz = payload_sz;
-  WORD* p = (WORD*)payload;
-
-  /* Reset */
-  DWORD chksum = 0;
-
-  /* Compute data */
-  while (sz > 1) {
-    chksum += htons (*p++);
-    sz -= 2;
-  }
-
-  /* Last byte of data */
-  if (sz != 0) {
-    chksum += *(BYTE*)p << 8;
-  }
-
-  /* Source address */
-  chksum += addr_src >> 16;
-  chksum += addr_src & 0xFFFF;
-
-  /* Destination address */
-  chksum += addr_dst >> 16;
-  chksum += addr_dst & 0xFFFF;
-
-  /* Protocol and payload size */
-  chksum += htons (IPPROTO_UDP);
-  chksum += htons (payload_sz);
-
-  /* Write the new checksum */
-  chksum = (chksum & 0xFFFF) + (chksum >> 16);
-  *(WORD*)(payload + UDP_CHECKSUM_POS) = (WORD)~chksum;
-}
-
 /* -----------------------------------------------------------------------------
 // By manipulating interface metric we can change the preferred route */
 static int metric_update (const wchar_t* const iface, BOOL const manual)
@@ -186,343 +679,4081 @@ static int metric_update (const wchar_t* const iface, BOOL const manual)
         break;
       }
 
-      r = r->Next;
-    }
+      r = r->Next;
+    }
+
+    /* Couldn't find */
+    if (metric == 0) {
+      free (addresses);
+      return FALSE;
+    }
+  }
+
+  /* Update metric values */
+  r = addresses;
+
+  while (r != NULL) {
+    if ((r->IfType != IF_TYPE_ETHERNET_CSMACD)
+    &&  (r->IfType != IF_TYPE_IEEE80211)) {
+      r = r->Next;
+      continue;
+    }
+
+    if (_wcsicmp (iface, r->FriendlyName) != 0) {
+      MIB_IPINTERFACE_ROW iface_row;
+      InitializeIpInterfaceEntry (&iface_row);
+      iface_row.InterfaceLuid = r->Luid;
+      iface_row.Family = AF_INET;
+
+      if (manual) {
+        iface_row.UseAutomaticMetric = FALSE;
+        iface_row.Metric = r->Ipv4Metric + metric;
+      } else {
+        iface_row.UseAutomaticMetric = TRUE;
+      }
+
+      SetIpInterfaceEntry (&iface_row);
+    }
+
+    r = r->Next;
+  }
+
+  free (addresses);
+  return TRUE;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static void svc_report (DWORD, DWORD, DWORD);
+
+static BOOL already_stopped;
+
+static void signal_handler (int const signum)
+{
+  if (already_stopped) return;
+  already_stopped = TRUE;
+  if (trace) {
+    set_text_color (3);
+    wprintf (L"Exiting on signal: %d\n", signum);
+    set_text_color (7);
+  }
+  if (!SetEvent (evnt_stop)) {
+    if (trace) {
+      set_text_color (4);
+      wprintf (L"`SetEvent()` failed: %u\n", (unsigned)GetLastError());
+      set_text_color (7);
+    }
+    /* Calling `WSACleanup()` from signal handler causes deadlock */
+    ExitProcess (EXIT_FAILURE);
+  }
+}
+
+static void print_addr_to (FILE* const out, ULONG const addr)
+{
+  fwprintf (out, L"%u.%u.%u.%u"
+  ,  addr        & 0xFF
+  , (addr >> 8)  & 0xFF
+  , (addr >> 16) & 0xFF
+  , (addr >> 24) & 0xFF);
+}
+
+static void print_addr (ULONG const addr)
+{
+  print_addr_to (stdout, addr);
+}
+
+static void relay_error (ULONG const addr)
+{
+  set_text_color (4);
+  wprintf (L"Error relaying packet to ");
+  set_text_color (6);
+  print_addr (addr);
+  wprintf (L"\n");
+  set_text_color (7);
+}
+
+/* -----------------------------------------------------------------------------
+// Per stage latency. Each thread records into its own histograms,
+// which are only added up when dumped on exit or read from
+// the metrics pipe. Recording is a couple of performance counter
+// reads and an increment, cheap enough to be always on. */
+static inline LONGLONG qpc_now (void)
+{
+  LARGE_INTEGER now;
+  QueryPerformanceCounter (&now);
+  return now.QuadPart;
+}
+
+static DWORD hist_bucket (ULONGLONG const ns)
+{
+  if (ns < HIST_SUB) return (DWORD)ns;
+
+  DWORD exp = HIST_SUB_BITS;
+  while (exp < HIST_EXP_MAX && (ns >> (exp + 1)) != 0) exp++;
+  if ((ns >> (exp + 1)) != 0) return HIST_BUCKETS - 1;
+
+  DWORD const sub = (DWORD)(ns >> (exp - HIST_SUB_BITS)) - HIST_SUB;
+  return HIST_SUB + (exp - HIST_SUB_BITS) * HIST_SUB + sub;
+}
+
+/* Highest value which falls into the bucket */
+static ULONGLONG hist_bucket_max (DWORD const bucket)
+{
+  if (bucket < HIST_SUB) return bucket;
+
+  DWORD const exp = (bucket - HIST_SUB) / HIST_SUB + HIST_SUB_BITS;
+  DWORD const sub = (bucket - HIST_SUB) % HIST_SUB;
+  return (((ULONGLONG)(HIST_SUB + sub + 1)) << (exp - HIST_SUB_BITS)) - 1;
+}
+
+static void stage_record (stage const stg, LONGLONG const start, LONGLONG const end)
+{
+  if (metrics_local == NULL) return;
+
+  ULONGLONG const ticks = end > start ? (ULONGLONG)(end - start) : 0;
+  ULONGLONG const ns = ticks * 1000000000ull / (ULONGLONG)qpc_freq.QuadPart;
+  stage_hist* const hist = &stage_hists[metrics_local - metrics_shards][stg];
+
+  hist->counts[hist_bucket (ns)]++;
+  if (ns > hist->max) hist->max = ns;
+}
+
+static void stage_sum (stage const stg, stage_hist* const sum)
+{
+  memset (sum, 0, sizeof(*sum));
+
+  for (DWORD i = 0; i < numof(stage_hists); ++i) {
+    const stage_hist* const hist = &stage_hists[i][stg];
+    for (DWORD j = 0; j < HIST_BUCKETS; ++j) sum->counts[j] += hist->counts[j];
+    if (hist->max > sum->max) sum->max = hist->max;
+  }
+}
+
+static ULONGLONG stage_count (const stage_hist* const hist)
+{
+  ULONGLONG count = 0;
+  for (DWORD i = 0; i < HIST_BUCKETS; ++i) count += hist->counts[i];
+  return count;
+}
+
+/* Value (in nanoseconds) below which `per_mille` of the samples are */
+static ULONGLONG stage_quantile (const stage_hist* const hist
+, ULONGLONG const count, DWORD const per_mille)
+{
+  ULONGLONG const rank = (count * per_mille + 999) / 1000;
+  ULONGLONG seen = 0;
+
+  for (DWORD i = 0; i < HIST_BUCKETS; ++i) {
+    seen += hist->counts[i];
+    if (seen >= rank && seen != 0) {
+      ULONGLONG const value = hist_bucket_max (i);
+      return value < hist->max ? value : hist->max;
+    }
+  }
+
+  return hist->max;
+}
+
+static const char* const stage_names[STAGES] = {
+  "parse", "route_query", "fwd_table", "checksum", "send", "total"
+};
+
+static void stage_report (void)
+{
+  set_text_color (3);
+  wprintf (L"Latency (us)       count       p50       p99     p99.9       max\n");
+
+  for (DWORD i = 0; i < STAGES; ++i) {
+    stage_hist sum;
+    stage_sum (i, &sum);
+    ULONGLONG const count = stage_count (&sum);
+    if (count == 0) continue;
+
+    wprintf (L"  %-12hs %9llu %9.1f %9.1f %9.1f %9.1f\n", stage_names[i], count
+    , stage_quantile (&sum, count, 500) / 1000.0
+    , stage_quantile (&sum, count, 990) / 1000.0
+    , stage_quantile (&sum, count, 999) / 1000.0
+    , sum.max / 1000.0);
+  }
+
+  set_text_color (7);
+}
+
+/* -----------------------------------------------------------------------------
+// Per packet diagnostics. Writing to the console takes ages compared
+// to relaying a packet, so relay threads only put binary records
+// into their own ring, and a background thread formats them
+// to the console (or to a file). When a ring is full,
+// records are dropped and counted instead of blocking. */
+static void trace_put (trace_record* const record)
+{
+  /* Threads which don't relay have no ring */
+  if (trace_rings == NULL || metrics_local == NULL) return;
+
+  trace_ring* const ring = &trace_rings[metrics_local - metrics_shards];
+  LONG const head = ring->head;
+
+  if (head - ring->tail == TRACE_RING_SIZE) {
+    ring->dropped++;
+    return;
+  }
+
+  record->time = qpc_now();
+
+  ring->records[head & (TRACE_RING_SIZE - 1)] = *record;
+
+  /* Publish the record */
+  InterlockedExchange (&ring->head, head + 1);
+}
+
+static void trace_packet (const relay_hdr* const hdr, ULONG const addr_route)
+{
+  trace_record record;
+  record.kind = TRACE_PACKET;
+  record.addr_src = hdr->addr_src;
+  record.addr_dst = hdr->addr_dst;
+  record.addr = addr_route;
+  record.port_src = hdr->port_src;
+  record.port_dst = hdr->port_dst;
+  record.size = hdr->size;
+  trace_put (&record);
+}
+
+static void trace_relayed (ULONG const addr, DWORD const size)
+{
+  trace_record record = {0};
+  record.kind = TRACE_RELAYED;
+  record.addr = addr;
+  record.size = size;
+  trace_put (&record);
+}
+
+static void trace_duplicate (const unsigned char* const udp
+, DWORD const packet_size, ULONG const addr_src)
+{
+  trace_record record = {0};
+  record.kind = TRACE_DUPLICATE;
+  record.addr_src = addr_src;
+  record.port_src = ntohs(*(const WORD*)udp);
+  record.port_dst = ntohs(*(const WORD*)(udp + 2));
+  record.size = packet_size;
+  trace_put (&record);
+}
+
+/* Colors only make sense on the console */
+static inline void trace_color (int const color)
+{
+  if (trace_file == NULL) set_text_color (color);
+}
+
+static void trace_format (const trace_record* const record)
+{
+  FILE* const out = trace_file != NULL ? trace_file : stdout;
+  double const time = (double)(record->time - trace_start_time.QuadPart)
+  / (double)qpc_freq.QuadPart;
+
+  trace_color (8);
+  fwprintf (out, L"[%.6f] ", time);
+
+  if (record->kind == TRACE_PACKET) {
+    /* Packets which are going to be relayed stand out */
+    const int main_color = (record->addr_src == record->addr
+    && record->addr_dst == addr_broadcast) ? 2 : 8;
+    trace_color (main_color);
+    fwprintf (out, L"Source: ");
+    trace_color (6);
+    print_addr_to (out, record->addr_src);
+    fwprintf (out, L":%u", (unsigned)record->port_src);
+    trace_color (main_color);
+    fwprintf (out, L" | Destination: ");
+    trace_color (6);
+    print_addr_to (out, record->addr_dst);
+    fwprintf (out, L":%u", (unsigned)record->port_dst);
+    trace_color (main_color);
+    fwprintf (out, L" | Preferred: ");
+    trace_color (6);
+    print_addr_to (out, record->addr);
+    trace_color (main_color);
+    fwprintf (out, L" | Size: ");
+    trace_color (5);
+    fwprintf (out, L"%u\n", (unsigned)record->size);
+  } else if (record->kind == TRACE_RELAYED) {
+    trace_color (7);
+    fwprintf (out, L"Relayed ");
+    trace_color (5);
+    fwprintf (out, L"%u", (unsigned)record->size);
+    trace_color (7);
+    fwprintf (out, L" bytes to ");
+    trace_color (6);
+    print_addr_to (out, record->addr);
+    fwprintf (out, L"\n");
+  } else {
+    fwprintf (out, L"Dropped duplicate packet from ");
+    print_addr_to (out, record->addr_src);
+    fwprintf (out, L":%u to port %u (%u bytes)\n", (unsigned)record->port_src
+    , (unsigned)record->port_dst, (unsigned)record->size);
+  }
+
+  trace_color (7);
+}
+
+/* Returns the number of records written out */
+static DWORD trace_flush (void)
+{
+  DWORD num = 0;
+
+  for (DWORD i = 0; i < 1 + IOCP_THREADS_MAX; ++i) {
+    trace_ring* const ring = &trace_rings[i];
+    LONG const head = ring->head;
+    LONG tail = ring->tail;
+
+    for (; tail != head; ++tail, ++num) {
+      trace_format (&ring->records[tail & (TRACE_RING_SIZE - 1)]);
+    }
+
+    /* Give the room back */
+    InterlockedExchange (&ring->tail, tail);
+  }
+
+  if (num != 0) fflush (trace_file != NULL ? trace_file : stdout);
+  return num;
+}
+
+static DWORD WINAPI trace_writer (LPVOID const param)
+{
+  (void)param;
+
+  while (WaitForSingleObject (evnt_stop, TRACE_FLUSH_INTERVAL) == WAIT_TIMEOUT) {
+    trace_flush();
+  }
+
+  /* Whatever is left */
+  while (trace_flush() != 0);
+
+  return 0;
+}
+
+static BOOL trace_start (void)
+{
+  if (!trace) return TRUE;
+
+  QueryPerformanceCounter (&trace_start_time);
+
+  if (trace_path != NULL) {
+    trace_file = _wfopen (trace_path, L"w");
+    if (trace_file == NULL) {
+      msg_error (L"Couldn't open the trace file.");
+      return FALSE;
+    }
+  }
+
+  trace_rings = VirtualAlloc (NULL, (1 + IOCP_THREADS_MAX) * sizeof(*trace_rings)
+  , MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+
+  if (trace_rings != NULL) {
+    trace_thread = CreateThread (NULL, 0, trace_writer, NULL, 0, NULL);
+  }
+
+  if (trace_thread == NULL) {
+    msg_error (L"Error starting the trace thread.");
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* After the relay threads are gone */
+static void trace_stop (void)
+{
+  if (trace_thread != NULL) {
+    SetEvent (evnt_stop);
+    WaitForSingleObject (trace_thread, INFINITE);
+    CloseHandle (trace_thread);
+    trace_thread = NULL;
+  }
+
+  if (trace_rings != NULL) {
+    LONG dropped = 0;
+    for (DWORD i = 0; i < 1 + IOCP_THREADS_MAX; ++i) dropped += trace_rings[i].dropped;
+
+    if (dropped != 0) {
+      set_text_color (3);
+      wprintf (L"Trace: %ld records dropped\n", dropped);
+      set_text_color (7);
+    }
+
+    VirtualFree (trace_rings, 0, MEM_RELEASE);
+    trace_rings = NULL;
+  }
+
+  if (trace_file != NULL) {
+    fclose (trace_file);
+    trace_file = NULL;
+  }
+}
+
+/* Where a send is going right now */
+static inline ULONG relay_send_dst (const relay_send* const send)
+{
+  return send->peers_num != 0 ? send->peers[send->peer] : send->addr_dst;
+}
+
+/* -----------------------------------------------------------------------------
+// Packet capture. Datagrams as received, and as sent to every relay
+// interface, are written to a pcapng file with one interface per relay
+// target. Relay threads only format blocks into the current chunk
+// under a lock; whole chunks are written out by a background thread,
+// so disk I/O is large and sequential and never holds up relaying.
+// When no chunk is free, packets are dropped from the capture
+// and counted. Files can be rotated by size, keeping the last few. */
+static inline void capture_put32 (capture_chunk* const chunk, DWORD const v)
+{
+  memcpy (chunk->data + chunk->len, &v, sizeof(v));
+  chunk->len += sizeof(v);
+}
+
+static inline void capture_put16 (capture_chunk* const chunk, WORD const v)
+{
+  memcpy (chunk->data + chunk->len, &v, sizeof(v));
+  chunk->len += sizeof(v);
+}
+
+/* Section header block */
+static void capture_shb (capture_chunk* const chunk)
+{
+  capture_put32 (chunk, 0x0A0D0D0A);
+  capture_put32 (chunk, 28);
+  capture_put32 (chunk, 0x1A2B3C4D);
+  capture_put16 (chunk, 1);
+  capture_put16 (chunk, 0);
+  /* Section length isn't known */
+  capture_put32 (chunk, ULONG_MAX);
+  capture_put32 (chunk, ULONG_MAX);
+  capture_put32 (chunk, 28);
+}
+
+/* Interface description block, named after the interface address */
+static void capture_idb (capture_chunk* const chunk, ULONG const addr)
+{
+  char name[32];
+  int const name_len = addr == 0 ? snprintf (name, sizeof(name), "capture")
+  : snprintf (name, sizeof(name), "relay %u.%u.%u.%u"
+  , (unsigned)(addr & 0xFF), (unsigned)((addr >> 8) & 0xFF)
+  , (unsigned)((addr >> 16) & 0xFF), (unsigned)((addr >> 24) & 0xFF));
+  DWORD const name_pad = (name_len + 3) & ~3u;
+  DWORD const len = 20 + 4 + name_pad + 4;
+
+  capture_put32 (chunk, 1);
+  capture_put32 (chunk, len);
+  /* Raw IPv4 */
+  capture_put16 (chunk, 101);
+  capture_put16 (chunk, 0);
+  capture_put32 (chunk, 0);
+  /* `if_name` */
+  capture_put16 (chunk, 2);
+  capture_put16 (chunk, (WORD)name_len);
+  memset (chunk->data + chunk->len, 0, name_pad);
+  memcpy (chunk->data + chunk->len, name, name_len);
+  chunk->len += name_pad;
+  /* End of options */
+  capture_put32 (chunk, 0);
+  capture_put32 (chunk, len);
+}
+
+/* Hand the current chunk over to the writer */
+static BOOL capture_swap (void)
+{
+  if (capture_free_num == 0) return FALSE;
+
+  capture_full[(capture_full_head + capture_full_num) % CAPTURE_CHUNKS] = capture_current;
+  capture_full_num++;
+  capture_current = capture_free[--capture_free_num];
+  capture_current->len = 0;
+  capture_current->rotate = FALSE;
+  SetEvent (capture_evnt);
+  return TRUE;
+}
+
+/* Enhanced packet block with the datagram in two parts */
+static void capture_put (ULONG const addr, const void* const head, DWORD const head_sz
+, const void* const body, DWORD const body_sz)
+{
+  DWORD const data_len = head_sz + body_sz;
+  DWORD const epb_len = 28 + ((data_len + 3) & ~3u) + 4;
+  /* Room for the section header and a couple of interfaces too */
+  DWORD const room = epb_len + 28 + 2 * 64;
+
+  /* Microseconds since 1970 */
+  FILETIME ft;
+  GetSystemTimeAsFileTime (&ft);
+  ULONGLONG const time = ((((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime)
+  - 116444736000000000ull) / 10;
+
+  AcquireSRWLockExclusive (&capture_lock);
+
+  /* Next file */
+  if (capture_size_max != 0 && capture_section
+  && capture_file_bytes + epb_len > (ULONGLONG)capture_size_max * 1024 * 1024) {
+    if (capture_current->len != 0 && !capture_swap()) goto drop;
+    capture_current->rotate = TRUE;
+    capture_section = FALSE;
+  }
+
+  if (CAPTURE_CHUNK_SIZE - capture_current->len < room) {
+    if (!capture_swap()) goto drop;
+  }
+
+  capture_chunk* const chunk = capture_current;
+  DWORD const start = chunk->len;
+
+  if (!capture_section) {
+    capture_shb (chunk);
+    capture_idb (chunk, 0);
+    capture_ifaces[0] = 0;
+    capture_ifaces_num = 1;
+    capture_file_bytes = 0;
+    capture_section = TRUE;
+  }
+
+  DWORD id;
+  for (id = 0; id < capture_ifaces_num; ++id) {
+    if (capture_ifaces[id] == addr) break;
+  }
+
+  if (id == capture_ifaces_num) {
+    /* Out of interfaces: file it under the capture interface */
+    if (capture_ifaces_num == CAPTURE_IFACES_MAX) id = 0;
+    else {
+      capture_idb (chunk, addr);
+      capture_ifaces[capture_ifaces_num++] = addr;
+    }
+  }
+
+  capture_put32 (chunk, 6);
+  capture_put32 (chunk, epb_len);
+  capture_put32 (chunk, id);
+  capture_put32 (chunk, (DWORD)(time >> 32));
+  capture_put32 (chunk, (DWORD)time);
+  capture_put32 (chunk, data_len);
+  capture_put32 (chunk, data_len);
+  memcpy (chunk->data + chunk->len, head, head_sz);
+  memcpy (chunk->data + chunk->len + head_sz, body, body_sz);
+  memset (chunk->data + chunk->len + data_len, 0, ((data_len + 3) & ~3u) - data_len);
+  chunk->len += (data_len + 3) & ~3u;
+  capture_put32 (chunk, epb_len);
+
+  capture_file_bytes += chunk->len - start;
+  ReleaseSRWLockExclusive (&capture_lock);
+  return;
+
+drop:
+  capture_drops++;
+  ReleaseSRWLockExclusive (&capture_lock);
+}
+
+static void capture_inbound (const unsigned char* const buf, DWORD const len)
+{
+  if (capture_path == NULL) return;
+  capture_put (0, buf, len, NULL, 0);
+}
+
+/* The stack builds the IP header of relayed packets: make one up */
+static void capture_relayed (const relay_send* const send)
+{
+  if (capture_path == NULL) return;
+
+  BYTE head[IP_HEADER_SIZE + UDP_HEADER_SIZE] = {0};
+  WORD const total = htons ((WORD)(sizeof(head) + send->wsa_bufs[1].len));
+  WORD chksum;
+
+  head[0] = 0x45;
+  memcpy (head + 2, &total, sizeof(total));
+  head[8] = 64;
+  head[9] = IPPROTO_UDP;
+  ULONG const addr_dst = relay_send_dst (send);
+  memcpy (head + IP_ADDR_SRC_POS, &send->addr, sizeof(send->addr));
+  memcpy (head + IP_ADDR_DST_POS, &addr_dst, sizeof(addr_dst));
+  chksum = ~chksum_scalar (head, IP_HEADER_SIZE);
+  memcpy (head + 10, &chksum, sizeof(chksum));
+  memcpy (head + IP_HEADER_SIZE, send->udp_header, UDP_HEADER_SIZE);
+
+  capture_put (send->addr, head, sizeof(head)
+  , send->wsa_bufs[1].buf, send->wsa_bufs[1].len);
+}
+
+/* Name of the capture file number `index` */
+static void capture_name (wchar_t* const name, size_t const name_sz, DWORD const index)
+{
+  if (capture_size_max == 0) {
+    _snwprintf (name, name_sz, L"%s", capture_path);
+  } else {
+    /* "capture.pcapng" -> "capture_00001.pcapng" */
+    const wchar_t* const ext = PathFindExtensionW (capture_path);
+    _snwprintf (name, name_sz, L"%.*s_%05u%s"
+    , (int)(ext - capture_path), capture_path, (unsigned)index, ext);
+  }
+  name[name_sz - 1] = L'\0';
+}
+
+/* Write out all full chunks */
+static void capture_drain (void)
+{
+  while (TRUE) {
+    AcquireSRWLockExclusive (&capture_lock);
+    capture_chunk* const chunk = capture_full_num == 0 ? NULL
+    : capture_full[capture_full_head];
+    ReleaseSRWLockExclusive (&capture_lock);
+
+    if (chunk == NULL) break;
+
+    if (chunk->rotate || capture_index == 0) {
+      wchar_t name[MAX_PATH];
+
+      if (capture_file != INVALID_HANDLE_VALUE) CloseHandle (capture_file);
+
+      /* Keep only so many files around */
+      if (capture_size_max != 0 && capture_index >= capture_files_max) {
+        capture_name (name, numof(name), capture_index - capture_files_max);
+        DeleteFileW (name);
+      }
+
+      capture_name (name, numof(name), capture_index++);
+      capture_file = CreateFileW (name, GENERIC_WRITE, FILE_SHARE_READ, NULL
+      , CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+      if (capture_file == INVALID_HANDLE_VALUE) {
+        msg_error (L"Couldn't create the capture file.");
+      }
+    }
+
+    /* Chunks of a file which couldn't be created are lost */
+    DWORD write_num;
+    if (capture_file != INVALID_HANDLE_VALUE) {
+      WriteFile (capture_file, chunk->data, chunk->len, &write_num, NULL);
+    }
+
+    AcquireSRWLockExclusive (&capture_lock);
+    capture_full_head = (capture_full_head + 1) % CAPTURE_CHUNKS;
+    capture_full_num--;
+    capture_free[capture_free_num++] = chunk;
+    ReleaseSRWLockExclusive (&capture_lock);
+  }
+}
+
+/* Hand over the partially filled chunk */
+static void capture_flush (void)
+{
+  AcquireSRWLockExclusive (&capture_lock);
+  if (capture_current->len != 0) capture_swap();
+  ReleaseSRWLockExclusive (&capture_lock);
+}
+
+static DWORD WINAPI capture_writer (LPVOID const param)
+{
+  (void)param;
+
+  while (TRUE) {
+    HANDLE evnts[] = {evnt_stop, capture_evnt};
+    DWORD const wait = WaitForMultipleObjects (numof(evnts), evnts
+    , FALSE, CAPTURE_FLUSH_INTERVAL);
+    if (wait == WAIT_OBJECT_0) break;
+
+    /* Don't keep a partial chunk for too long */
+    if (wait == WAIT_TIMEOUT) capture_flush();
+    capture_drain();
+  }
+
+  return 0;
+}
+
+static BOOL capture_start (void)
+{
+  if (capture_path == NULL) return TRUE;
+
+  BYTE* const data = VirtualAlloc (NULL, CAPTURE_CHUNKS * CAPTURE_CHUNK_SIZE
+  , MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+
+  if (data == NULL) {
+    msg_error (L"Error allocating capture buffers.");
+    return FALSE;
+  }
+
+  for (DWORD i = 0; i < CAPTURE_CHUNKS; ++i) {
+    capture_chunks[i].data = data + i * CAPTURE_CHUNK_SIZE;
+    capture_chunks[i].len = 0;
+    capture_chunks[i].rotate = FALSE;
+    if (i != 0) capture_free[capture_free_num++] = &capture_chunks[i];
+  }
+
+  capture_current = &capture_chunks[0];
+  capture_section = FALSE;
+
+  capture_evnt = CreateEventW (NULL, FALSE, FALSE, NULL);
+  if (capture_evnt != NULL) {
+    capture_thread = CreateThread (NULL, 0, capture_writer, NULL, 0, NULL);
+  }
+
+  if (capture_thread == NULL) {
+    msg_error (L"Error starting the capture thread.");
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* After the relay threads are gone */
+static void capture_stop (void)
+{
+  if (capture_thread != NULL) {
+    SetEvent (evnt_stop);
+    WaitForSingleObject (capture_thread, INFINITE);
+    CloseHandle (capture_thread);
+    capture_thread = NULL;
+
+    /* Whatever came in before the relay threads were gone */
+    capture_drain();
+    capture_flush();
+    capture_drain();
+  }
+
+  if (capture_file != INVALID_HANDLE_VALUE) {
+    CloseHandle (capture_file);
+    capture_file = INVALID_HANDLE_VALUE;
+  }
+
+  if (capture_evnt != NULL) {
+    CloseHandle (capture_evnt);
+    capture_evnt = NULL;
+  }
+
+  if (capture_chunks[0].data != NULL) {
+    VirtualFree (capture_chunks[0].data, 0, MEM_RELEASE);
+    memset (capture_chunks, 0, sizeof(capture_chunks));
+    capture_free_num = capture_full_num = capture_full_head = 0;
+  }
+
+  if (trace && capture_drops != 0) {
+    set_text_color (3);
+    wprintf (L"Capture: %ld packets dropped\n", capture_drops);
+    set_text_color (7);
+  }
+}
+
+/* -----------------------------------------------------------------------------
+// Packet buffer pool */
+static BOOL pool_init (void)
+{
+  pool = VirtualAlloc (NULL, pool_size * sizeof(*pool)
+  , MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+  if (pool == NULL) return FALSE;
+
+  InitializeSListHead (&pool_free);
+  for (DWORD i = pool_size; i != 0; --i) {
+    InterlockedPushEntrySList (&pool_free, &pool[i - 1].entry);
+  }
+
+  pool_used = pool_used_max = pool_misses = 0;
+  return TRUE;
+}
+
+static void pool_release (void)
+{
+  if (pool == NULL) return;
+  VirtualFree (pool, 0, MEM_RELEASE);
+  pool = NULL;
+}
+
+static relay_packet* pool_get (void)
+{
+  PSLIST_ENTRY const entry = InterlockedPopEntrySList (&pool_free);
+
+  if (entry == NULL) {
+    InterlockedIncrement (&pool_misses);
+    return NULL;
+  }
+
+  /* Occupancy high-water mark */
+  LONG const used = InterlockedIncrement (&pool_used);
+  LONG used_max = pool_used_max;
+  while (used > used_max) {
+    LONG const prev = InterlockedCompareExchange (&pool_used_max, used, used_max);
+    if (prev == used_max) break;
+    used_max = prev;
+  }
+
+  relay_packet* const packet = CONTAINING_RECORD (entry, relay_packet, entry);
+  packet->refs = 1;
+  return packet;
+}
+
+static void pool_put (relay_packet* const packet)
+{
+  InterlockedDecrement (&pool_used);
+  InterlockedPushEntrySList (&pool_free, &packet->entry);
+}
+
+static BOOL iocp_refill (relay_packet*);
+static BOOL parse_num (const wchar_t*, DWORD, DWORD, DWORD*);
+
+static void packet_release (relay_packet* const packet)
+{
+  if (InterlockedDecrement (&packet->refs) != 0) return;
+  if (iocp_refill (packet)) return;
+  pool_put (packet);
+}
+
+/* -----------------------------------------------------------------------------
+// Filter rules. Each line of the rules file is one of:
+//
+//   allow|deny port <port>[-<port>]
+//   allow|deny from <address>[/<bits>]
+//   allow|deny to <address>[/<bits>]
+//
+// `port` matches the destination port, `from` the source address
+// and `to` the relay interface address. Later rules take precedence
+// over earlier ones, and if the first rule of a kind allows something,
+// everything else of that kind is denied. Rules are compiled at startup
+// into a port bitmap and sorted address range tables, so that packets
+// we don't care about are rejected before any routing work. */
+static BOOL filter_parse_addr (const wchar_t* const str
+, ULONG* const first, ULONG* const last)
+{
+  unsigned a, b, c, d, bits = 32;
+  wchar_t tail;
+
+  int const num = swscanf (str, L"%u.%u.%u.%u/%u%lc", &a, &b, &c, &d, &bits, &tail);
+  if (num != 4 && num != 5) return FALSE;
+  if (a > 255 || b > 255 || c > 255 || d > 255 || bits > 32) return FALSE;
+
+  ULONG const mask = bits == 0 ? 0 : ULONG_MAX << (32 - bits);
+  *first = ((a << 24) | (b << 16) | (c << 8) | d) & mask;
+  *last = *first | ~mask;
+  return TRUE;
+}
+
+static BOOL filter_parse_port (const wchar_t* const str
+, ULONG* const first, ULONG* const last)
+{
+  unsigned lo, hi;
+  wchar_t tail;
+
+  int const num = swscanf (str, L"%u-%u%lc", &lo, &hi, &tail);
+  if (num == 1) hi = lo;
+  else if (num != 2) return FALSE;
+  if (lo > hi || hi > 65535) return FALSE;
+
+  *first = lo;
+  *last = hi;
+  return TRUE;
+}
+
+static BOOL filter_parse_line (wchar_t* const line, relay_filter_rule* const rule
+, BOOL* const empty)
+{
+  ULONG first, last;
+  wchar_t* ctx;
+  wchar_t* const action = wcstok (line, L" \t\r\n", &ctx);
+
+  /* Blank lines and comments */
+  *empty = action == NULL || action[0] == L'#';
+  if (*empty) return TRUE;
+
+  wchar_t* const kind = wcstok (NULL, L" \t\r\n", &ctx);
+  wchar_t* const arg = wcstok (NULL, L" \t\r\n", &ctx);
+  if (kind == NULL || arg == NULL || wcstok (NULL, L" \t\r\n", &ctx) != NULL) return FALSE;
+
+  if (_wcsicmp (action, L"allow") == 0) rule->allow = TRUE;
+  else if (_wcsicmp (action, L"deny") == 0) rule->allow = FALSE;
+  else return FALSE;
+
+  if (_wcsicmp (kind, L"port") == 0) {
+    rule->kind = RELAY_FILTER_PORT;
+    if (!filter_parse_port (arg, &first, &last)) return FALSE;
+  } else {
+    if (_wcsicmp (kind, L"from") == 0) rule->kind = RELAY_FILTER_FROM;
+    else if (_wcsicmp (kind, L"to") == 0) rule->kind = RELAY_FILTER_TO;
+    else return FALSE;
+    if (!filter_parse_addr (arg, &first, &last)) return FALSE;
+  }
+
+  rule->first = first;
+  rule->last = last;
+  return TRUE;
+}
+
+static BOOL filter_load (void)
+{
+  if (filter_path == NULL) return TRUE;
+
+  FILE* const file = _wfopen (filter_path, L"r");
+
+  if (file == NULL) {
+    msg_error (L"Couldn't open the filter rules file.");
+    return FALSE;
+  }
+
+  relay_filter_rule* rules = NULL;
+  DWORD rules_num = 0, rules_max = 0, line_num = 0;
+  wchar_t line[FILTER_LINE_MAX];
+  BOOL ok = TRUE;
+
+  while (fgetws (line, numof(line), file) != NULL) {
+    relay_filter_rule rule;
+    BOOL empty;
+
+    line_num++;
+
+    if (!filter_parse_line (line, &rule, &empty)) {
+      if (!is_service) {
+        set_text_color (4);
+        wprintf (L"Invalid filter rule on line %u.\n", (unsigned)line_num);
+        set_text_color (7);
+      }
+      ok = FALSE;
+      break;
+    }
+
+    if (empty) continue;
+
+    if (rules_num == rules_max) {
+      rules_max = rules_max != 0 ? rules_max * 2 : 64;
+      relay_filter_rule* const rules_new = realloc (rules, rules_max * sizeof(*rules));
+      if (rules_new == NULL) {
+        msg_error (L"Error allocating filter rules.");
+        ok = FALSE;
+        break;
+      }
+      rules = rules_new;
+    }
+
+    rules[rules_num++] = rule;
+  }
+
+  fclose (file);
+
+  if (ok && !relay_filter_compile (&filter, rules, rules_num)) {
+    msg_error (L"Error allocating filter rules.");
+    ok = FALSE;
+  }
+
+  free (rules);
+  return ok;
+}
+
+/* Called for every packet before anything else is done with it */
+static inline BOOL filter_pass (const relay_hdr* const hdr)
+{
+  if (!relay_filter_port (&filter, hdr->port_dst)
+  || !relay_filter_addr (&filter.from, hdr->addr_src)) {
+    metrics_local->dropped[DROP_FILTER]++;
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* -----------------------------------------------------------------------------
+// Rate limiting with token buckets at three levels: every source address,
+// every destination port and every relay interface get their own bucket.
+// Sources and ports are looked up in fixed-size hash tables, where buckets
+// idle the longest make room for new ones. Packets over the limit
+// are dropped. */
+static void rate_refill (rate_bucket* const bucket, const rate_limit* const limit
+, DWORD const now)
+{
+  DWORD const full = limit->burst * 1000;
+
+  if (!bucket->used) {
+    bucket->used = TRUE;
+    bucket->tokens = full;
+  } else {
+    ULONGLONG const tokens = bucket->tokens
+    + (ULONGLONG)(now - bucket->time) * limit->rate;
+    bucket->tokens = tokens < full ? (DWORD)tokens : full;
+  }
+
+  bucket->time = now;
+}
+
+static rate_bucket* rate_lookup (rate_bucket* const table, ULONG const key)
+{
+  DWORD const hash = (DWORD)(key * 2654435761u);
+  DWORD const now = GetTickCount();
+  rate_bucket* victim = NULL;
+
+  for (DWORD i = 0; i < RATE_PROBES_MAX; ++i) {
+    rate_bucket* const bucket = &table[(hash + i) % RATE_BUCKETS];
+    if (bucket->used && bucket->key == key) return bucket;
+
+    /* Unused buckets are the idlest of all */
+    if (victim == NULL || (victim->used
+    && (!bucket->used || now - bucket->time > now - victim->time))) {
+      victim = bucket;
+    }
+  }
+
+  memset (victim, 0, sizeof(*victim));
+  victim->key = key;
+  return victim;
+}
+
+/* Check the source and the port limits and take a token from both,
+// only if neither of them is out */
+static BOOL rate_pass (ULONG const addr_src, WORD const port)
+{
+  const rate_limit* const limit_source = &rate_limits[RATE_SOURCE];
+  const rate_limit* const limit_port = &rate_limits[RATE_PORT];
+
+  if (limit_source->rate == 0 && limit_port->rate == 0) return TRUE;
+
+  DWORD const now = GetTickCount();
+  rate_bucket* source = NULL;
+  rate_bucket* port_bucket = NULL;
+  BOOL pass = TRUE;
+
+  AcquireSRWLockExclusive (&rate_lock);
+
+  if (limit_source->rate != 0) {
+    source = rate_lookup (rate_sources, addr_src);
+    rate_refill (source, limit_source, now);
+    pass = source->tokens >= 1000;
+  }
+
+  if (limit_port->rate != 0) {
+    port_bucket = rate_lookup (rate_ports, port);
+    rate_refill (port_bucket, limit_port, now);
+    pass = pass && port_bucket->tokens >= 1000;
+  }
+
+  if (source != NULL) {
+    if (pass) {
+      source->tokens -= 1000;
+      source->passed++;
+    } else {
+      source->dropped++;
+    }
+  }
+
+  if (port_bucket != NULL) {
+    if (pass) {
+      port_bucket->tokens -= 1000;
+      port_bucket->passed++;
+    } else {
+      port_bucket->dropped++;
+    }
+  }
+
+  ReleaseSRWLockExclusive (&rate_lock);
+
+  if (!pass) metrics_local->dropped[DROP_RATE]++;
+  return pass;
+}
+
+/* Relay interface limit, checked with the interface lock held */
+static BOOL rate_iface_pass (relay_iface* const iface)
+{
+  const rate_limit* const limit = &rate_limits[RATE_IFACE];
+  if (limit->rate == 0) return TRUE;
+
+  rate_refill (&iface->rate, limit, GetTickCount());
+
+  if (iface->rate.tokens < 1000) {
+    iface->rate.dropped++;
+    return FALSE;
+  }
+
+  iface->rate.tokens -= 1000;
+  iface->rate.passed++;
+  return TRUE;
+}
+
+/* Buckets which had to drop something, to help tuning the limits */
+static void rate_report (void)
+{
+  for (DWORD i = 0; i < RATE_BUCKETS; ++i) {
+    const rate_bucket* const bucket = &rate_sources[i];
+    if (!bucket->used || bucket->dropped == 0) continue;
+    set_text_color (3);
+    wprintf (L"Rate limited source ");
+    set_text_color (6);
+    print_addr (bucket->key);
+    set_text_color (3);
+    wprintf (L": %u passed, %u dropped\n"
+    , (unsigned)bucket->passed, (unsigned)bucket->dropped);
+    set_text_color (7);
+  }
+
+  for (DWORD i = 0; i < RATE_BUCKETS; ++i) {
+    const rate_bucket* const bucket = &rate_ports[i];
+    if (!bucket->used || bucket->dropped == 0) continue;
+    set_text_color (3);
+    wprintf (L"Rate limited port %u: %u passed, %u dropped\n"
+    , (unsigned)bucket->key, (unsigned)bucket->passed, (unsigned)bucket->dropped);
+    set_text_color (7);
+  }
+}
+
+/* Parse `<rate>[/<burst>]` (the burst defaults to one second worth) */
+static BOOL rate_parse (const wchar_t* const str, rate_limit* const limit)
+{
+  unsigned rate, burst;
+  wchar_t tail;
+
+  int const num = swscanf (str, L"%u/%u%lc", &rate, &burst, &tail);
+  if (num == 1) burst = rate;
+  else if (num != 2) return FALSE;
+  if (rate == 0 || rate > RATE_MAX || burst == 0 || burst > RATE_MAX) return FALSE;
+
+  limit->rate = rate;
+  limit->burst = burst;
+  return TRUE;
+}
+
+/* -----------------------------------------------------------------------------
+// Duplicate suppression. Raw sockets see the traffic we inject ourselves,
+// so a packet coming back through another interface (or from another
+// relay on the same segment) would bounce around forever. Fingerprints
+// of relayed packets are kept in a small open addressing hash table
+// for `dedup_window` milliseconds and matching packets are dropped. */
+static BOOL dedup_init (void)
+{
+  if (dedup_window == 0) return TRUE;
+
+  DWORD size = 1;
+  while (size < dedup_size) size <<= 1;
+  dedup_size = size;
+
+  dedup_table = calloc (dedup_size, sizeof(*dedup_table));
+  return dedup_table != NULL;
+}
+
+static void dedup_release (void)
+{
+  free (dedup_table);
+  dedup_table = NULL;
+}
+
+/* FNV-1a over the source, the UDP header (ports and length)
+// and the head of the payload, mixed with the payload sum */
+static ULONGLONG dedup_hash (const unsigned char* const udp
+, DWORD const packet_size, ULONG const addr_src)
+{
+  ULONGLONG hash = 0xCBF29CE484222325ull;
+  DWORD const head = packet_size < UDP_HEADER_SIZE + DEDUP_HASH_BYTES
+  ? packet_size : UDP_HEADER_SIZE + DEDUP_HASH_BYTES;
+
+  for (DWORD i = 0; i < sizeof(addr_src); ++i) {
+    hash = (hash ^ ((addr_src >> (i * 8)) & 0xFF)) * 0x100000001B3ull;
+  }
+
+  /* Skip the checksum: it can be disabled by the sender */
+  for (DWORD i = 0; i < UDP_CHECKSUM_POS; ++i) {
+    hash = (hash ^ udp[i]) * 0x100000001B3ull;
+  }
+
+  for (DWORD i = UDP_CHECKSUM_POS + 2; i < head; ++i) {
+    hash = (hash ^ udp[i]) * 0x100000001B3ull;
+  }
+
+  ULONGLONG const sum = chksum_fast (udp + UDP_HEADER_SIZE
+  , packet_size - UDP_HEADER_SIZE);
+  hash = (hash ^ sum) * 0x100000001B3ull;
+
+  /* Never zero: that's an empty slot */
+  return hash != 0 ? hash : 1;
+}
+
+/* Look the fingerprint up in a table of `size` (power of two) entries.
+// Returns `TRUE` if it's there and younger than `window` milliseconds,
+// otherwise remembers it if asked to. The caller holds the table lock. */
+static BOOL dedup_probe (dedup_entry* const table, DWORD const size
+, DWORD const window, ULONGLONG const hash, BOOL const remember)
+{
+  DWORD const now = GetTickCount();
+  DWORD const mask = size - 1;
+  dedup_entry* victim = NULL;
+  DWORD victim_age = 0;
+
+  for (DWORD i = 0; i < DEDUP_PROBES_MAX; ++i) {
+    dedup_entry* const entry = &table[(hash + i) & mask];
+    DWORD const age = entry->hash == 0 ? MAXDWORD : now - entry->time;
+
+    if (age < window && entry->hash == hash) return TRUE;
+
+    /* Replace the oldest entry: free slots are the oldest of all */
+    if (victim == NULL || age > victim_age) {
+      victim = entry;
+      victim_age = age;
+    }
+  }
+
+  if (remember) {
+    victim->hash = hash;
+    victim->time = now;
+  }
+
+  return FALSE;
+}
+
+/* Returns `TRUE` if the packet was seen within the window,
+// otherwise remembers it */
+static BOOL dedup_seen (const unsigned char* const udp
+, DWORD const packet_size, ULONG const addr_src)
+{
+  if (dedup_table == NULL) return FALSE;
+
+  ULONGLONG const hash = dedup_hash (udp, packet_size, addr_src);
+
+  AcquireSRWLockExclusive (&dedup_lock);
+  BOOL const seen = dedup_probe (dedup_table, dedup_size, dedup_window, hash, TRUE);
+  ReleaseSRWLockExclusive (&dedup_lock);
+
+  if (seen) {
+    metrics_local->dropped[DROP_DUPLICATE]++;
+
+    /* Diagnostics */
+    if (trace) trace_duplicate (udp, packet_size, addr_src);
+  }
+
+  return seen;
+}
+
+/* -----------------------------------------------------------------------------
+// Beacon hold-down. Game servers and chat clients repeat the very same
+// announcement every so often, and each copy would go out to every relay
+// interface. On selected ports, a packet with the same source and
+// contents as one relayed less than the hold-down window ago is not
+// relayed again. The first copy and any change still go through
+// right away. Unlike duplicates, fingerprints cover every byte: what
+// changes between announcements (a player count, a map name) can be
+// anywhere in them. */
+static BOOL beacon_parse (const wchar_t* const ports, const wchar_t* const window)
+{
+  ULONG first, last;
+  DWORD ms;
+
+  if (beacon_rules_num == BEACON_RULES_MAX
+  || !filter_parse_port (ports, &first, &last)
+  || !parse_num (window, 1, BEACON_WINDOW_MAX, &ms)) return FALSE;
+
+  beacon_rule* const rule = &beacon_rules[beacon_rules_num++];
+  rule->first = (WORD)first;
+  rule->last = (WORD)last;
+  rule->window = ms;
+  return TRUE;
+}
+
+static BOOL beacon_init (void)
+{
+  if (beacon_rules_num == 0) return TRUE;
+  beacon_table = calloc (BEACON_SIZE, sizeof(*beacon_table));
+  return beacon_table != NULL;
+}
+
+static void beacon_release (void)
+{
+  free (beacon_table);
+  beacon_table = NULL;
+}
+
+/* FNV-1a of the source address and the whole datagram
+// but the checksum, which the sender can leave out */
+static ULONGLONG beacon_hash (const relay_hdr* const hdr)
+{
+  ULONGLONG hash = 0xCBF29CE484222325ull;
+
+  for (DWORD i = 0; i < sizeof(hdr->addr_src); ++i) {
+    hash = (hash ^ ((hdr->addr_src >> (i * 8)) & 0xFF)) * 0x100000001B3ull;
+  }
+
+  for (DWORD i = 0; i < UDP_CHECKSUM_POS; ++i) {
+    hash = (hash ^ hdr->udp[i]) * 0x100000001B3ull;
+  }
+
+  for (DWORD i = UDP_CHECKSUM_POS + 2; i < hdr->size; ++i) {
+    hash = (hash ^ hdr->udp[i]) * 0x100000001B3ull;
+  }
+
+  /* Never zero: that's an empty slot */
+  return hash != 0 ? hash : 1;
+}
+
+/* Returns `TRUE` if the packet repeats an announcement
+// within its hold-down window, otherwise remembers it */
+static BOOL beacon_held (const relay_hdr* const hdr)
+{
+  if (beacon_table == NULL) return FALSE;
+
+  /* The first rule for the port wins */
+  beacon_rule* rule = NULL;
+  for (DWORD i = 0; i < beacon_rules_num; ++i) {
+    if (hdr->port_dst >= beacon_rules[i].first && hdr->port_dst <= beacon_rules[i].last) {
+      rule = &beacon_rules[i];
+      break;
+    }
+  }
+
+  if (rule == NULL) return FALSE;
+
+  ULONGLONG const hash = beacon_hash (hdr);
+
+  AcquireSRWLockExclusive (&beacon_lock);
+  BOOL const held = dedup_probe (beacon_table, BEACON_SIZE, rule->window, hash, TRUE);
+  if (held) {
+    rule->packets++;
+    rule->bytes += hdr->size;
+  }
+  ReleaseSRWLockExclusive (&beacon_lock);
+
+  if (held) metrics_local->dropped[DROP_BEACON]++;
+  return held;
+}
+
+static void beacon_report (void)
+{
+  for (DWORD i = 0; i < beacon_rules_num; ++i) {
+    const beacon_rule* const rule = &beacon_rules[i];
+    set_text_color (3);
+    if (rule->first == rule->last) wprintf (L"Beacons to port %u", (unsigned)rule->first);
+    else wprintf (L"Beacons to ports %u-%u", (unsigned)rule->first, (unsigned)rule->last);
+    wprintf (L": %llu held down (%llu bytes, %u ms window)\n"
+    , rule->packets, rule->bytes, (unsigned)rule->window);
+    set_text_color (7);
+  }
+}
+
+/* -----------------------------------------------------------------------------
+// Peer tunnel. Broadcast doesn't cross routed links, so relayed packets
+// are also sent over unicast UDP to every peer instance, which emits
+// them from its own preferred route for its local engine to relay
+// as usual. Packets coming in within `tunnel_window` milliseconds
+// of each other are packed into one tunnel datagram.
+//
+// Relay threads only append to the current batch under a lock; full
+// and expired batches are sent by the tunnel thread, which also
+// receives and emits the batches of the peers. Peers form a full mesh
+// and never pass on what they got from each other: packets a peer has
+// emitted aren't tunnelled back, and packets we have tunnelled
+// ourselves aren't emitted again when a peer on the same segment
+// (or the same machine) sends them over too. */
+static BOOL tunnel_parse_peer (const wchar_t* const str)
+{
+  unsigned a, b, c, d, port = 0;
+  wchar_t tail;
+
+  int const num = swscanf (str, L"%u.%u.%u.%u:%u%lc", &a, &b, &c, &d, &port, &tail);
+  if (num != 4 && num != 5) return FALSE;
+  if (a > 255 || b > 255 || c > 255 || d > 255 || port > 65535) return FALSE;
+  if (num == 5 && port == 0) return FALSE;
+  if (tunnel_peers_num == TUNNEL_PEERS_MAX) return FALSE;
+
+  /* Without a port, peers listen on the same one as we do */
+  SOCKADDR_IN* const peer = &tunnel_peers[tunnel_peers_num++];
+  peer->sin_family = AF_INET;
+  peer->sin_addr.s_addr = htonl ((a << 24) | (b << 16) | (c << 8) | d);
+  peer->sin_port = htons ((WORD)port);
+  return TRUE;
+}
+
+/* Hand the current batch over to the tunnel thread */
+static BOOL tunnel_swap (void)
+{
+  if (tunnel_free_num == 0) return FALSE;
+
+  tunnel_full[(tunnel_full_head + tunnel_full_num) % TUNNEL_BATCHES] = tunnel_current;
+  tunnel_full_num++;
+  tunnel_current = tunnel_free[--tunnel_free_num];
+  tunnel_current->len = (DWORD)relay_tunnel_begin (tunnel_current->data);
+  SetEvent (tunnel_evnt);
+  return TRUE;
+}
+
+/* Queue a relayed packet for the peers */
+static void tunnel_put (const relay_hdr* const hdr)
+{
+  /* Records don't say where they were going: broadcast only */
+  if (tunnel_thread == NULL || hdr->addr_dst != addr_broadcast) return;
+
+  ULONGLONG const hash = dedup_hash (hdr->udp, hdr->size, hdr->addr_src);
+
+  AcquireSRWLockExclusive (&tunnel_lock);
+
+  /* Came from a peer in the first place */
+  if (dedup_probe (tunnel_remote, TUNNEL_ECHOES, TUNNEL_ECHO_WINDOW, hash, FALSE)) {
+    tunnel_echoes++;
+    goto done;
+  }
+
+  dedup_probe (tunnel_local, TUNNEL_ECHOES, TUNNEL_ECHO_WINDOW, hash, TRUE);
+
+  /* Anything goes into an empty batch, the rest must fit in the MTU */
+  size_t len = relay_tunnel_add (tunnel_current->data, tunnel_current->len
+  , tunnel_current->len == TUNNEL_HEADER_SIZE ? TUNNEL_DATAGRAM_MAX : TUNNEL_MTU
+  , hdr->udp, hdr->size);
+
+  if (len == 0 && tunnel_current->len != TUNNEL_HEADER_SIZE) {
+    if (!tunnel_swap()) goto drop;
+    len = relay_tunnel_add (tunnel_current->data, tunnel_current->len
+    , TUNNEL_DATAGRAM_MAX, hdr->udp, hdr->size);
+  }
+
+  /* Too large for a tunnel datagram */
+  if (len == 0) goto drop;
+
+  /* The window starts with the first packet */
+  if (tunnel_current->len == TUNNEL_HEADER_SIZE) {
+    tunnel_current->time = GetTickCount();
+    SetEvent (tunnel_evnt);
+  }
+
+  tunnel_current->len = (DWORD)len;
+  tunnel_packets++;
+  goto done;
+
+drop:
+  tunnel_drops++;
+done:
+  ReleaseSRWLockExclusive (&tunnel_lock);
+}
+
+/* Send all full batches to every peer */
+static void tunnel_send (void)
+{
+  while (TRUE) {
+    AcquireSRWLockExclusive (&tunnel_lock);
+    tunnel_batch* const batch = tunnel_full_num == 0 ? NULL
+    : tunnel_full[tunnel_full_head];
+    ReleaseSRWLockExclusive (&tunnel_lock);
+
+    if (batch == NULL) break;
+
+    for (DWORD i = 0; i < tunnel_peers_num; ++i) {
+      if (sendto (tunnel_sock, (const char*)batch->data, batch->len, 0
+      , (const SOCKADDR*)&tunnel_peers[i], sizeof(tunnel_peers[i])) == SOCKET_ERROR) {
+        tunnel_errors++;
+      } else {
+        tunnel_datagrams++;
+      }
+    }
+
+    AcquireSRWLockExclusive (&tunnel_lock);
+    tunnel_full_head = (tunnel_full_head + 1) % TUNNEL_BATCHES;
+    tunnel_full_num--;
+    tunnel_free[tunnel_free_num++] = batch;
+    ReleaseSRWLockExclusive (&tunnel_lock);
+  }
+}
+
+/* Packets of the peers are sent from the preferred route,
+// with a socket that follows it around */
+static BOOL tunnel_emit_open (ULONG const addr_route)
+{
+  const char opt_broadcast = 1;
+
+  if (tunnel_emit_sock != INVALID_SOCKET && tunnel_emit_addr == addr_route) return TRUE;
+
+  if (tunnel_emit_sock != INVALID_SOCKET) {
+    closesocket (tunnel_emit_sock);
+    tunnel_emit_sock = INVALID_SOCKET;
+  }
+
+  SOCKET const sock = WSASocketW (AF_INET, SOCK_RAW, IPPROTO_UDP, NULL, 0, 0);
+  if (sock == INVALID_SOCKET) return FALSE;
+
+  SOCKADDR_IN sa_addr = {0};
+  sa_addr.sin_family = AF_INET;
+  sa_addr.sin_addr.s_addr = addr_route;
+
+  if (bind (sock, (SOCKADDR*)&sa_addr, sizeof(sa_addr)) == SOCKET_ERROR
+  || setsockopt (sock, SOL_SOCKET, SO_BROADCAST
+  , &opt_broadcast, sizeof(opt_broadcast)) == SOCKET_ERROR) {
+    closesocket (sock);
+    return FALSE;
+  }
+
+  tunnel_emit_sock = sock;
+  tunnel_emit_addr = addr_route;
+  return TRUE;
+}
+
+/* Emit the packets of a batch received from a peer */
+static void tunnel_emit (const BYTE* const buf, DWORD const len)
+{
+  uint32_t const count = relay_tunnel_count (buf, len);
+
+  if (count == 0) {
+    tunnel_rejected++;
+    return;
+  }
+
+  /* Snapshots are only retired under exclusive lock */
+  AcquireSRWLockShared (&relay_lock);
+  ULONG const addr_route = ((const route_snapshot*)epoch_current (&route_domain))->addr_route;
+  ReleaseSRWLockShared (&relay_lock);
+
+  /* Nowhere to send them from yet */
+  if (addr_route == 0 || !tunnel_emit_open (addr_route)) {
+    tunnel_errors += count;
+    return;
+  }
+
+  SOCKADDR_IN sa_addr_dst = {0};
+  sa_addr_dst.sin_family = AF_INET;
+  sa_addr_dst.sin_addr.s_addr = addr_broadcast;
+
+  size_t pos = TUNNEL_HEADER_SIZE;
+  const unsigned char* udp;
+  uint32_t size;
+
+  while (relay_tunnel_next (buf, len, &pos, &udp, &size)) {
+    ULONGLONG const hash = dedup_hash (udp, size, addr_route);
+    tunnel_received++;
+
+    /* We've seen it ourselves: the peer is on the same segment */
+    AcquireSRWLockExclusive (&tunnel_lock);
+    BOOL const echo = dedup_probe (tunnel_local, TUNNEL_ECHOES, TUNNEL_ECHO_WINDOW, hash, FALSE);
+    if (!echo) dedup_probe (tunnel_remote, TUNNEL_ECHOES, TUNNEL_ECHO_WINDOW, hash, TRUE);
+    else tunnel_echoes++;
+    ReleaseSRWLockExclusive (&tunnel_lock);
+
+    if (echo) continue;
+
+    /* Recompute UDP header checksum */
+    BYTE udp_header[UDP_HEADER_SIZE];
+    relay_rewrite (udp_header, udp, relay_chksum_base (udp, size, addr_broadcast), addr_route);
+
+    WSABUF wsa_bufs[2];
+    wsa_bufs[0].buf = (char*)udp_header;
+    wsa_bufs[0].len = UDP_HEADER_SIZE;
+    wsa_bufs[1].buf = (char*)(udp + UDP_HEADER_SIZE);
+    wsa_bufs[1].len = size - UDP_HEADER_SIZE;
+
+    DWORD write_num;
+
+    if (WSASendTo (tunnel_emit_sock, wsa_bufs, numof(wsa_bufs), &write_num, 0
+    , (SOCKADDR*)&sa_addr_dst, sizeof(sa_addr_dst), NULL, NULL) == SOCKET_ERROR) {
+      tunnel_errors++;
+    } else {
+      tunnel_emitted++;
+    }
+  }
+}
+
+/* Take in everything the peers have sent */
+static void tunnel_recv (void)
+{
+  WSAResetEvent (tunnel_read_evnt);
+
+  while (TRUE) {
+    SOCKADDR_IN sa_from;
+    int from_sz = sizeof(sa_from);
+
+    int const num = recvfrom (tunnel_sock, (char*)tunnel_recv_buf, TUNNEL_DATAGRAM_MAX
+    , 0, (SOCKADDR*)&sa_from, &from_sz);
+
+    if (num == SOCKET_ERROR) {
+      /* A peer which isn't there */
+      if (WSAGetLastError() == WSAECONNRESET) continue;
+      break;
+    }
+
+    /* Only from the peers */
+    DWORD i;
+    for (i = 0; i < tunnel_peers_num; ++i) {
+      if (tunnel_peers[i].sin_addr.s_addr == sa_from.sin_addr.s_addr
+      && tunnel_peers[i].sin_port == sa_from.sin_port) break;
+    }
+
+    if (i == tunnel_peers_num) tunnel_rejected++;
+    else tunnel_emit (tunnel_recv_buf, num);
+  }
+}
+
+static DWORD WINAPI tunnel_worker (LPVOID const param)
+{
+  (void)param;
+
+  while (TRUE) {
+    DWORD timeout = INFINITE;
+
+    /* Send the current batch once its window is over */
+    AcquireSRWLockExclusive (&tunnel_lock);
+    if (tunnel_current->len != TUNNEL_HEADER_SIZE) {
+      DWORD const age = GetTickCount() - tunnel_current->time;
+      if (age < tunnel_window) timeout = tunnel_window - age;
+      else if (!tunnel_swap()) timeout = 0;
+    }
+    ReleaseSRWLockExclusive (&tunnel_lock);
+
+    tunnel_send();
+
+    HANDLE evnts[] = {evnt_stop, tunnel_evnt, tunnel_read_evnt};
+    DWORD const wait = WaitForMultipleObjects (numof(evnts), evnts, FALSE, timeout);
+    if (wait == WAIT_OBJECT_0) break;
+    if (wait == WAIT_OBJECT_0 + 2) tunnel_recv();
+  }
+
+  return 0;
+}
+
+static BOOL tunnel_start (void)
+{
+  if (tunnel_peers_num == 0) return TRUE;
+
+  /* Batches and a receive buffer */
+  BYTE* const data = VirtualAlloc (NULL, (TUNNEL_BATCHES + 1) * TUNNEL_DATAGRAM_MAX
+  , MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+
+  if (data == NULL) {
+    msg_error (L"Error allocating tunnel buffers.");
+    return FALSE;
+  }
+
+  for (DWORD i = 0; i < TUNNEL_BATCHES; ++i) {
+    tunnel_batches[i].data = data + i * TUNNEL_DATAGRAM_MAX;
+    tunnel_batches[i].len = (DWORD)relay_tunnel_begin (tunnel_batches[i].data);
+    if (i != 0) tunnel_free[tunnel_free_num++] = &tunnel_batches[i];
+  }
+
+  tunnel_current = &tunnel_batches[0];
+  tunnel_recv_buf = data + TUNNEL_BATCHES * TUNNEL_DATAGRAM_MAX;
+
+  for (DWORD i = 0; i < tunnel_peers_num; ++i) {
+    if (tunnel_peers[i].sin_port == 0) tunnel_peers[i].sin_port = htons ((WORD)tunnel_port);
+  }
+
+  tunnel_sock = WSASocketW (AF_INET, SOCK_DGRAM, IPPROTO_UDP, NULL, 0, 0);
+
+  if (tunnel_sock == INVALID_SOCKET) {
+    msg_error (L"Error creating the tunnel socket.");
+    return FALSE;
+  }
+
+  SOCKADDR_IN sa_any = {0};
+  sa_any.sin_family = AF_INET;
+  sa_any.sin_addr.s_addr = htonl (INADDR_ANY);
+  sa_any.sin_port = htons ((WORD)tunnel_port);
+
+  if (bind (tunnel_sock, (SOCKADDR*)&sa_any, sizeof(sa_any)) == SOCKET_ERROR) {
+    msg_error (L"Error binding on the tunnel socket.");
+    return FALSE;
+  }
+
+  tunnel_evnt = CreateEventW (NULL, FALSE, FALSE, NULL);
+  tunnel_read_evnt = CreateEventW (NULL, TRUE, FALSE, NULL);
+
+  if (tunnel_evnt == NULL || tunnel_read_evnt == NULL
+  || WSAEventSelect (tunnel_sock, tunnel_read_evnt, FD_READ) == SOCKET_ERROR) {
+    msg_error (L"Error creating asynchronous events.");
+    return FALSE;
+  }
+
+  tunnel_thread = CreateThread (NULL, 0, tunnel_worker, NULL, 0, NULL);
+
+  if (tunnel_thread == NULL) {
+    msg_error (L"Error starting the tunnel thread.");
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* After the relay threads are gone */
+static void tunnel_stop (void)
+{
+  if (tunnel_thread != NULL) {
+    SetEvent (evnt_stop);
+    WaitForSingleObject (tunnel_thread, INFINITE);
+    CloseHandle (tunnel_thread);
+    tunnel_thread = NULL;
+  }
+
+  if (tunnel_sock != INVALID_SOCKET) {
+    closesocket (tunnel_sock);
+    tunnel_sock = INVALID_SOCKET;
+  }
+
+  if (tunnel_emit_sock != INVALID_SOCKET) {
+    closesocket (tunnel_emit_sock);
+    tunnel_emit_sock = INVALID_SOCKET;
+  }
+
+  if (tunnel_read_evnt != NULL) {
+    CloseHandle (tunnel_read_evnt);
+    tunnel_read_evnt = NULL;
+  }
+
+  if (tunnel_evnt != NULL) {
+    CloseHandle (tunnel_evnt);
+    tunnel_evnt = NULL;
+  }
+
+  if (tunnel_batches[0].data != NULL) {
+    VirtualFree (tunnel_batches[0].data, 0, MEM_RELEASE);
+    memset (tunnel_batches, 0, sizeof(tunnel_batches));
+    tunnel_free_num = tunnel_full_num = tunnel_full_head = 0;
+  }
+
+  if (trace && tunnel_peers_num != 0) {
+    set_text_color (3);
+    wprintf (L"Tunnel: %llu packets in %llu datagrams sent, %ld dropped\n"
+    , tunnel_packets, tunnel_datagrams, tunnel_drops);
+    wprintf (L"Tunnel: %llu packets received, %llu emitted, %llu echoes, %llu rejected, %llu errors\n"
+    , tunnel_received, tunnel_emitted, tunnel_echoes, tunnel_rejected, tunnel_errors);
+    set_text_color (7);
+  }
+}
+
+/* -----------------------------------------------------------------------------
+// Broadcast to unicast. Relaying broadcast to a VPN interface makes
+// the server flood it to every client, even to those which don't run
+// the application. Sources of traffic to or from selected ports are
+// learned as peers of the relay interface whose subnet they are on,
+// and forgotten after `unicast_age` seconds of silence. Broadcasts
+// to those ports are then sent as unicast copies to the peers of each
+// interface (and to configured peers on its subnet) instead. Interfaces
+// without any peers still get the broadcast. */
+static inline BOOL unicast_port (WORD const port)
+{
+  return unicast_ports_on && (unicast_ports[port >> 3] & (1u << (port & 7)));
+}
+
+static BOOL unicast_parse_ports (const wchar_t* const str)
+{
+  ULONG first, last;
+  if (!filter_parse_port (str, &first, &last)) return FALSE;
+
+  for (ULONG port = first; port <= last; ++port) {
+    unicast_ports[port >> 3] |= 1u << (port & 7);
+  }
+
+  unicast_ports_on = TRUE;
+  return TRUE;
+}
+
+static BOOL unicast_parse_peer (const wchar_t* const str)
+{
+  ULONG first, last;
+  if (!filter_parse_addr (str, &first, &last) || first != last) return FALSE;
+  if (unicast_fixed_num == UNICAST_FIXED_MAX) return FALSE;
+
+  unicast_fixed[unicast_fixed_num++] = htonl (first);
+  return TRUE;
+}
+
+/* Remember the source of a packet to or from one of the ports.
+// Called by the relay threads, with the snapshot they have entered. */
+static void unicast_learn (const route_snapshot* const snap, const relay_hdr* const hdr)
+{
+  if (!unicast_port (hdr->port_dst) && !unicast_port (hdr->port_src)) return;
+
+  for (DWORD k = 0; k < snap->targets_num; ++k) {
+    if (snap->masks[k] == 0) continue;
+    if ((hdr->addr_src & snap->masks[k]) != snap->nets[k]
+    || hdr->addr_src == snap->targets[k]) continue;
+
+    relay_iface* const iface = &relay_ifaces[snap->slots[k]];
+    DWORD const now = GetTickCount();
+    DWORD oldest = 0;
+
+    AcquireSRWLockExclusive (&iface->lock);
+
+    /* Closed or taken over by another interface since */
+    if (iface->addr != snap->targets[k]) {
+      ReleaseSRWLockExclusive (&iface->lock);
+      break;
+    }
+
+    DWORD j;
+    for (j = 0; j < iface->peers_num; ++j) {
+      if (iface->peers[j].addr == hdr->addr_src) break;
+      if (now - iface->peers[j].time > now - iface->peers[oldest].time) oldest = j;
+    }
+
+    /* Full: the one heard from the longest ago makes room */
+    if (j == iface->peers_num) {
+      if (iface->peers_num != UNICAST_PEERS_MAX) iface->peers_num++;
+      else j = oldest;
+      iface->peers[j].addr = hdr->addr_src;
+    }
+
+    iface->peers[j].time = now;
+
+    ReleaseSRWLockExclusive (&iface->lock);
+    break;
+  }
+}
+
+/* Peers of an interface to send a packet to.
+// The interface lock is held. */
+static void unicast_peers (relay_iface* const iface, relay_send* const send)
+{
+  DWORD const now = GetTickCount();
+  send->peers_num = 0;
+
+  for (DWORD i = 0; i < unicast_fixed_num; ++i) {
+    if (send->peers_num == UNICAST_PEERS_MAX) return;
+    if (iface->mask == 0 || (unicast_fixed[i] & iface->mask) != iface->net) continue;
+    send->peers[send->peers_num++] = unicast_fixed[i];
+  }
+
+  for (DWORD i = 0; i < iface->peers_num; ++i) {
+    /* Aged out */
+    if (now - iface->peers[i].time >= unicast_age * 1000) {
+      iface->peers[i--] = iface->peers[--iface->peers_num];
+      continue;
+    }
+
+    if (send->peers_num == UNICAST_PEERS_MAX) continue;
+
+    DWORD j;
+    for (j = 0; j < send->peers_num; ++j) {
+      if (send->peers[j] == iface->peers[i].addr) break;
+    }
+    if (j == send->peers_num) send->peers[send->peers_num++] = iface->peers[i].addr;
+  }
+}
+
+/* -----------------------------------------------------------------------------
+// Multicast relay. Packets to configured groups from the preferred
+// route are relayed like broadcast, but only to interfaces where some
+// host is a member of the group: as configured, or as heard from IGMP
+// reports. A background thread keeps an IGMP socket on every relay
+// interface, joined to the groups so that reports get to it, and acts
+// as the querier there so that hosts keep reporting. Interfaces
+// without members get nothing. */
+static BOOL mcast_parse_group (const wchar_t* const str)
+{
+  unsigned a, b, c, d, e, f, g, h;
+  wchar_t tail;
+
+  int const num = swscanf (str, L"%u.%u.%u.%u@%u.%u.%u.%u%lc"
+  , &a, &b, &c, &d, &e, &f, &g, &h, &tail);
+  if (num != 4 && num != 8) return FALSE;
+  if (a > 255 || b > 255 || c > 255 || d > 255) return FALSE;
+
+  ULONG const group = htonl ((a << 24) | (b << 16) | (c << 8) | d);
+  if (!relay_multicast (group)) return FALSE;
+
+  DWORD i;
+  for (i = 0; i < mcast_groups_num; ++i) {
+    if (mcast_groups[i] == group) break;
+  }
+  if (i == mcast_groups_num) {
+    if (mcast_groups_num == MCAST_GROUPS_MAX) return FALSE;
+    mcast_groups[mcast_groups_num++] = group;
+  }
+
+  /* With the address of an interface which always has members */
+  if (num == 8) {
+    if (e > 255 || f > 255 || g > 255 || h > 255) return FALSE;
+    if (mcast_fixed_num == MCAST_FIXED_MAX) return FALSE;
+    mcast_fixed_members[mcast_fixed_num].group = group;
+    mcast_fixed_members[mcast_fixed_num].addr = htonl ((e << 24) | (f << 16) | (g << 8) | h);
+    mcast_fixed_num++;
+  }
+
+  return TRUE;
+}
+
+static int mcast_group_index (ULONG const addr)
+{
+  for (DWORD i = 0; i < mcast_groups_num; ++i) {
+    if (mcast_groups[i] == addr) return (int)i;
+  }
+  return -1;
+}
+
+/* Multicast packet from the preferred route to one of the groups */
+static inline BOOL mcast_wanted (const relay_hdr* const hdr, ULONG const addr_route)
+{
+  return mcast_groups_num != 0 && hdr->addr_src == addr_route
+  && mcast_group_index (hdr->addr_dst) >= 0;
+}
+
+/* The interface lock is held */
+static BOOL mcast_member (const relay_iface* const iface, int const group)
+{
+  for (DWORD i = 0; i < mcast_fixed_num; ++i) {
+    if (mcast_fixed_members[i].group == mcast_groups[group]
+    && mcast_fixed_members[i].addr == iface->addr) return TRUE;
+  }
+
+  DWORD const time = iface->mcast_time[group];
+  return time != 0 && GetTickCount() - time < MCAST_MEMBER_TIMEOUT * 1000;
+}
+
+/* Receive the groups on the preferred route. Called on route refresh. */
+static void mcast_listen (ULONG const addr_route)
+{
+  if (mcast_groups_num == 0 || addr_route == mcast_route) return;
+
+  for (DWORD i = 0; i < mcast_groups_num; ++i) {
+    struct ip_mreq mreq = {0};
+    mreq.imr_multiaddr.s_addr = mcast_groups[i];
+
+    if (mcast_route != 0) {
+      mreq.imr_interface.s_addr = mcast_route;
+      setsockopt (sock_listen, IPPROTO_IP, IP_DROP_MEMBERSHIP
+      , (const char*)&mreq, sizeof(mreq));
+    }
+
+    if (addr_route != 0) {
+      mreq.imr_interface.s_addr = addr_route;
+      if (setsockopt (sock_listen, IPPROTO_IP, IP_ADD_MEMBERSHIP
+      , (const char*)&mreq, sizeof(mreq)) == SOCKET_ERROR) {
+        ULONG const g = mcast_groups[i];
+        wchar_t msg[96];
+        _snwprintf (msg, numof(msg), L"Error joining multicast group %u.%u.%u.%u"
+        L" on the preferred route: %d."
+        , g & 0xFF, (g >> 8) & 0xFF, (g >> 16) & 0xFF, (g >> 24) & 0xFF
+        , WSAGetLastError());
+        msg[numof(msg) - 1] = L'\0';
+        msg_error (msg);
+      }
+    }
+  }
+
+  mcast_route = addr_route;
+}
+
+/* Query for one group, or for all of them (zero) */
+static void mcast_query (const mcast_iface* const m, ULONG const group
+, BYTE const max_resp)
+{
+  BYTE msg[IGMP_QUERY_SIZE];
+  relay_igmp_query (msg, group, max_resp);
+
+  /* General queries go to all hosts (224.0.0.1) */
+  SOCKADDR_IN sa_addr_dst = {0};
+  sa_addr_dst.sin_family = AF_INET;
+  sa_addr_dst.sin_addr.s_addr = group != 0 ? group : htonl (0xE0000001);
+
+  sendto (m->sock, (const char*)msg, sizeof(msg), 0
+  , (const SOCKADDR*)&sa_addr_dst, sizeof(sa_addr_dst));
+}
+
+static void mcast_iface_close (mcast_iface* const m)
+{
+  if (m->sock != INVALID_SOCKET) closesocket (m->sock);
+  if (m->evnt != NULL) CloseHandle (m->evnt);
+  m->sock = INVALID_SOCKET;
+  m->evnt = NULL;
+  m->addr = 0;
+}
+
+static BOOL mcast_iface_open (mcast_iface* const m, ULONG const addr)
+{
+  /* Router Alert, as queries should have */
+  const char opt_ra[4] = {(char)0x94, 0x04, 0, 0};
+
+  m->addr = addr;
+  m->query_time = 0;
+  m->evnt = NULL;
+  m->sock = WSASocketW (AF_INET, SOCK_RAW, IPPROTO_IGMP, NULL, 0, 0);
+  if (m->sock == INVALID_SOCKET) return FALSE;
+
+  SOCKADDR_IN sa_addr = {0};
+  sa_addr.sin_family = AF_INET;
+  sa_addr.sin_addr.s_addr = addr;
+
+  if (bind (m->sock, (SOCKADDR*)&sa_addr, sizeof(sa_addr)) == SOCKET_ERROR
+  || setsockopt (m->sock, IPPROTO_IP, IP_MULTICAST_IF
+  , (const char*)&addr, sizeof(addr)) == SOCKET_ERROR) {
+    mcast_iface_close (m);
+    return FALSE;
+  }
+
+  setsockopt (m->sock, IPPROTO_IP, IP_OPTIONS, opt_ra, sizeof(opt_ra));
+
+  /* IGMPv1 and v2 reports go to the group itself, v3 ones to 224.0.0.22 */
+  for (DWORD i = 0; i <= mcast_groups_num; ++i) {
+    struct ip_mreq mreq = {0};
+    mreq.imr_multiaddr.s_addr = i < mcast_groups_num ? mcast_groups[i] : htonl (0xE0000016);
+    mreq.imr_interface.s_addr = addr;
+    setsockopt (m->sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char*)&mreq, sizeof(mreq));
+  }
+
+  m->evnt = CreateEventW (NULL, TRUE, FALSE, NULL);
+
+  if (m->evnt == NULL || WSAEventSelect (m->sock, m->evnt, FD_READ) == SOCKET_ERROR) {
+    mcast_iface_close (m);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Follow the relay interfaces around */
+static void mcast_sync (void)
+{
+  ULONG addrs[RELAY_IFACES_MAX];
+  DWORD addrs_num = 0;
+
+  AcquireSRWLockShared (&relay_lock);
+  for (DWORD i = 0; i < relay_ifaces_num; ++i) {
+    if (relay_ifaces[i].addr != 0) addrs[addrs_num++] = relay_ifaces[i].addr;
+  }
+  ReleaseSRWLockShared (&relay_lock);
+
+  /* Close the sockets of interfaces which are gone */
+  for (DWORD i = 0; i < mcast_ifaces_num; ++i) {
+    DWORD j;
+    for (j = 0; j < addrs_num; ++j) {
+      if (addrs[j] == mcast_ifaces[i].addr) break;
+    }
+    if (j != addrs_num) {
+      addrs[j] = addrs[--addrs_num];
+      continue;
+    }
+    mcast_iface_close (&mcast_ifaces[i]);
+    mcast_ifaces[i--] = mcast_ifaces[--mcast_ifaces_num];
+  }
+
+  /* And open them for new ones */
+  for (DWORD j = 0; j < addrs_num; ++j) {
+    if (mcast_iface_open (&mcast_ifaces[mcast_ifaces_num], addrs[j])) mcast_ifaces_num++;
+  }
+
+  /* Ask every host to report, every so often */
+  DWORD const now = GetTickCount();
+  for (DWORD i = 0; i < mcast_ifaces_num; ++i) {
+    mcast_iface* const m = &mcast_ifaces[i];
+    if (m->query_time != 0 && now - m->query_time < MCAST_QUERY_INTERVAL * 1000) continue;
+    mcast_query (m, 0, 100);
+    m->query_time = now | 1;
+  }
+}
+
+/* Take a report of a host on the interface into account */
+static void mcast_update (const mcast_iface* const m, const relay_igmp* const record)
+{
+  int const group = mcast_group_index (record->group);
+  if (group < 0) return;
+
+  BOOL query = FALSE;
+
+  AcquireSRWLockShared (&relay_lock);
+
+  for (DWORD i = 0; i < relay_ifaces_num; ++i) {
+    relay_iface* const iface = &relay_ifaces[i];
+    if (iface->addr != m->addr) continue;
+
+    DWORD const now = GetTickCount();
+    AcquireSRWLockExclusive (&iface->lock);
+
+    if (record->join) {
+      iface->mcast_time[group] = now | 1;
+    } else if (mcast_member (iface, group)) {
+      /* Others have until then to speak up */
+      iface->mcast_time[group] = (now - (MCAST_MEMBER_TIMEOUT - MCAST_LEAVE_TIMEOUT) * 1000) | 1;
+      query = TRUE;
+    }
+
+    ReleaseSRWLockExclusive (&iface->lock);
+    break;
+  }
+
+  ReleaseSRWLockShared (&relay_lock);
+
+  if (query) mcast_query (m, record->group, MCAST_LEAVE_TIMEOUT * 10 / 2);
+}
+
+static void mcast_recv (const mcast_iface* const m)
+{
+  BYTE buf[1500];
+  relay_igmp records[MCAST_RECORDS_MAX];
+
+  WSAResetEvent (m->evnt);
+
+  while (TRUE) {
+    int const num = recv (m->sock, (char*)buf, sizeof(buf), 0);
+    if (num == SOCKET_ERROR) break;
+
+    /* Our own reports for joining the groups */
+    if (num < IP_HEADER_SIZE || *(const ULONG*)(buf + IP_ADDR_SRC_POS) == m->addr) continue;
+
+    unsigned const records_num = relay_igmp_parse (buf, num, records, numof(records));
+    for (unsigned i = 0; i < records_num; ++i) mcast_update (m, &records[i]);
+  }
+}
+
+static DWORD WINAPI mcast_worker (LPVOID const param)
+{
+  (void)param;
+
+  while (TRUE) {
+    mcast_sync();
+
+    HANDLE evnts[1 + RELAY_IFACES_MAX];
+    evnts[0] = evnt_stop;
+    for (DWORD i = 0; i < mcast_ifaces_num; ++i) evnts[1 + i] = mcast_ifaces[i].evnt;
+
+    DWORD const wait = WaitForMultipleObjects (1 + mcast_ifaces_num, evnts
+    , FALSE, MCAST_SYNC_INTERVAL);
+    if (wait == WAIT_OBJECT_0) break;
+
+    for (DWORD i = 0; i < mcast_ifaces_num; ++i) mcast_recv (&mcast_ifaces[i]);
+  }
+
+  for (DWORD i = 0; i < mcast_ifaces_num; ++i) mcast_iface_close (&mcast_ifaces[i]);
+  mcast_ifaces_num = 0;
+  return 0;
+}
+
+static BOOL mcast_start (void)
+{
+  if (mcast_groups_num == 0) return TRUE;
+
+  mcast_thread = CreateThread (NULL, 0, mcast_worker, NULL, 0, NULL);
+
+  if (mcast_thread == NULL) {
+    msg_error (L"Error starting the multicast thread.");
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static void mcast_stop (void)
+{
+  if (mcast_thread != NULL) {
+    SetEvent (evnt_stop);
+    WaitForSingleObject (mcast_thread, INFINITE);
+    CloseHandle (mcast_thread);
+    mcast_thread = NULL;
+  }
+
+  mcast_route = 0;
+}
+
+/* -----------------------------------------------------------------------------
+// Relay sockets are kept open for as long as their interface address
+// stays in the forwarding table, instead of being created per packet.
+//
+// Interfaces keep their slot in the table for their whole life,
+// so that sends in flight can always find their way back. Functions
+// working on a single interface expect its lock to be held. */
+static SOCKET relay_socket_open (ULONG const addr)
+{
+  const char opt_broadcast = 1;
+
+  SOCKET const sock = WSASocketW (AF_INET, SOCK_RAW, IPPROTO_UDP
+  , NULL, 0, WSA_FLAG_OVERLAPPED);
+
+  if (sock == INVALID_SOCKET) {
+    msg_error (L"Couldn't create the new source socket.");
+    return INVALID_SOCKET;
+  }
+
+  /* Bind it to the interface to send broadcast packets from */
+  SOCKADDR_IN sa_addr = {0};
+  sa_addr.sin_family = AF_INET;
+  sa_addr.sin_addr.s_addr = addr;
+
+  if (bind (sock, (SOCKADDR*)&sa_addr, sizeof(sa_addr)) == SOCKET_ERROR) {
+    msg_error (L"Couldn't bind to the new source socket.");
+    closesocket (sock);
+    return INVALID_SOCKET;
+  }
+
+  if (setsockopt (sock, SOL_SOCKET, SO_BROADCAST
+  , &opt_broadcast, sizeof(opt_broadcast)) == SOCKET_ERROR) {
+    msg_error (L"`setsockopt()` failed on the new source socket.");
+    closesocket (sock);
+    return INVALID_SOCKET;
+  }
+
+  /* Multicast leaves through this interface too,
+  // and isn't looped back to local members */
+  if (mcast_groups_num != 0) {
+    const DWORD opt_loop = 0;
+
+    if (setsockopt (sock, IPPROTO_IP, IP_MULTICAST_IF
+    , (const char*)&addr, sizeof(addr)) == SOCKET_ERROR
+    || setsockopt (sock, IPPROTO_IP, IP_MULTICAST_LOOP
+    , (const char*)&opt_loop, sizeof(opt_loop)) == SOCKET_ERROR) {
+      msg_error (L"`setsockopt()` failed on the new source socket.");
+      closesocket (sock);
+      return INVALID_SOCKET;
+    }
+  }
+
+  return sock;
+}
+
+static BOOL relay_iface_open (relay_iface* const iface)
+{
+  iface->sock = INVALID_SOCKET;
+  iface->errors = 0;
+  iface->sending = NULL;
+  iface->inflight = 0;
+  iface->queue_head = iface->queue_len = 0;
+
+  /* Shard workers send on sockets of their own */
+  if (use_shards) return TRUE;
+
+  SOCKET const sock = relay_socket_open (iface->addr);
+  if (sock == INVALID_SOCKET) return FALSE;
+
+  if (iocp != NULL) {
+    /* Sends complete on the I/O completion port */
+    if (CreateIoCompletionPort ((HANDLE)sock, iocp, IOCP_KEY_SEND, 0) == NULL) {
+      msg_error (L"Error associating the new source socket.");
+      closesocket (sock);
+      return FALSE;
+    }
+  } else if (iface->evnt == NULL) {
+    iface->evnt = CreateEventW (NULL, TRUE, FALSE, NULL);
+
+    if (iface->evnt == NULL) {
+      msg_error (L"Error creating asynchronous events.");
+      closesocket (sock);
+      return FALSE;
+    }
+  }
+
+  iface->sock = sock;
+  return TRUE;
+}
+
+static void relay_iface_drop (relay_iface* const iface)
+{
+  relay_send* const send = iface->queue[iface->queue_head];
+  iface->queue_head = (iface->queue_head + 1) % RELAY_QUEUE_MAX;
+  iface->queue_len--;
+  iface->drops++;
+  packet_release (send->packet);
+}
+
+static void relay_iface_close (relay_iface* const iface)
+{
+  /* Sends waiting in the queue are dropped */
+  while (iface->queue_len != 0) relay_iface_drop (iface);
+
+  if (iface->sock != INVALID_SOCKET) {
+    /* This cancels the sends in flight */
+    closesocket (iface->sock);
+    iface->sock = INVALID_SOCKET;
+  }
+
+  if (iface->sending != NULL) {
+    WaitForSingleObject (iface->evnt, INFINITE);
+    packet_release (iface->sending->packet);
+    iface->sending = NULL;
+  }
+
+  /* Sends in flight on the I/O completion port are let go
+  // when they complete: they belong to the previous generation */
+  iface->inflight = 0;
+  iface->gen++;
+  WakeAllConditionVariable (&iface->room);
+}
+
+static void relay_iface_retire (relay_iface* const iface)
+{
+  if (iface->sock == INVALID_SOCKET) return;
+  relay_iface_close (iface);
+
+  if (trace) {
+    set_text_color (4);
+    wprintf (L"Retired relay socket for ");
+    set_text_color (6);
+    print_addr (iface->addr);
+    wprintf (L"\n");
+    set_text_color (7);
+  }
+}
+
+static void relay_ifaces_close (void)
+{
+  AcquireSRWLockExclusive (&relay_lock);
+  for (DWORD i = 0; i < relay_ifaces_num; ++i) {
+    relay_iface* const iface = &relay_ifaces[i];
+    AcquireSRWLockExclusive (&iface->lock);
+    relay_iface_close (iface);
+    iface->addr = 0;
+    if (iface->evnt != NULL) {
+      CloseHandle (iface->evnt);
+      iface->evnt = NULL;
+    }
+    ReleaseSRWLockExclusive (&iface->lock);
+  }
+  relay_ifaces_num = 0;
+  ReleaseSRWLockExclusive (&relay_lock);
+}
+
+/* Queue statistics, to help sizing the queues */
+static void relay_ifaces_report (void)
+{
+  for (DWORD i = 0; i < relay_ifaces_num; ++i) {
+    const relay_iface* const iface = &relay_ifaces[i];
+    if (iface->addr == 0) continue;
+    set_text_color (3);
+    wprintf (L"Relay queue ");
+    set_text_color (6);
+    print_addr (iface->addr);
+    set_text_color (3);
+    wprintf (L": %u queued, %u at most, %u dropped, %u rate limited\n"
+    , (unsigned)iface->queue_len, (unsigned)iface->queue_hwm
+    , (unsigned)iface->drops, (unsigned)iface->rate.dropped);
+    if (unicast_ports_on) {
+      wprintf (L"  %llu unicast copies, %u peers\n"
+      , iface->unicast, (unsigned)iface->peers_num);
+    }
+    for (DWORD j = 0; j < mcast_groups_num; ++j) {
+      if (!mcast_member (iface, (int)j)) continue;
+      wprintf (L"  member of ");
+      print_addr (mcast_groups[j]);
+      wprintf (L"\n");
+    }
+    set_text_color (7);
+  }
+}
+
+/* -----------------------------------------------------------------------------
+// Synchronize the relay socket table with the routing snapshot:
+// interfaces that remain keep their sockets and queues, interfaces
+// that went away are closed, and new interfaces get a fresh socket.
+// Interfaces retired after send errors are given another chance.
+// The slot of each target goes into the snapshot. */
+static void relay_ifaces_update (route_snapshot* const snap)
+{
+  /* Close interfaces which are gone */
+  for (DWORD i = 0; i < relay_ifaces_num; ++i) {
+    relay_iface* const iface = &relay_ifaces[i];
+    if (iface->addr == 0) continue;
+
+    DWORD j;
+    for (j = 0; j < snap->targets_num; ++j) {
+      if (snap->targets[j] == iface->addr) break;
+    }
+
+    AcquireSRWLockExclusive (&iface->lock);
+    if (j == snap->targets_num) {
+      relay_iface_close (iface);
+      iface->addr = 0;
+    } else {
+      snap->slots[j] = i;
+      iface->net = snap->nets[j];
+      iface->mask = snap->masks[j];
+      if (iface->sock == INVALID_SOCKET) relay_iface_open (iface);
+    }
+    ReleaseSRWLockExclusive (&iface->lock);
+  }
+
+  /* Open new ones in free slots */
+  for (DWORD j = 0; j < snap->targets_num; ++j) {
+    DWORD i, slot = RELAY_IFACES_MAX;
+
+    for (i = 0; i < relay_ifaces_num; ++i) {
+      if (relay_ifaces[i].addr == snap->targets[j]) break;
+      if (relay_ifaces[i].addr == 0 && slot == RELAY_IFACES_MAX) slot = i;
+    }
+
+    if (i != relay_ifaces_num) continue;
+    if (slot == RELAY_IFACES_MAX) {
+      if (relay_ifaces_num == RELAY_IFACES_MAX) {
+        snap->targets_num = j;
+        break;
+      }
+      slot = relay_ifaces_num++;
+    }
+
+    snap->slots[j] = slot;
+    relay_iface* const iface = &relay_ifaces[slot];
+    AcquireSRWLockExclusive (&iface->lock);
+    iface->addr = snap->targets[j];
+    iface->net = snap->nets[j];
+    iface->mask = snap->masks[j];
+    iface->queue_hwm = iface->drops = 0;
+    memset (&iface->rate, 0, sizeof(iface->rate));
+    iface->peers_num = 0;
+    memset (iface->mcast_time, 0, sizeof(iface->mcast_time));
+    iface->relayed = iface->relayed_bytes = iface->unicast = iface->send_errors = 0;
+    relay_iface_open (iface);
+    ReleaseSRWLockExclusive (&iface->lock);
+  }
+
+  /* Trim free slots at the end */
+  while (relay_ifaces_num != 0 && relay_ifaces[relay_ifaces_num - 1].addr == 0) {
+    relay_ifaces_num--;
+  }
+}
+
+/* -----------------------------------------------------------------------------
+// Account for a finished send. The buffer is no longer needed
+// by this interface. */
+static void relay_iface_post (relay_iface*, relay_send*);
+
+static void relay_iface_complete (relay_iface* const iface
+, relay_send* const send, BOOL const ok, DWORD const write_num)
+{
+  relay_packet* const packet = send->packet;
+
+  iface->inflight--;
+  if (iface->sending == send) iface->sending = NULL;
+
+  if (ok && write_num == send->wsa_bufs[0].len + send->wsa_bufs[1].len) {
+    LONGLONG const now = qpc_now();
+    stage_record (STAGE_SEND, send->time_queued, now);
+    stage_record (STAGE_TOTAL, packet->time_recv, now);
+
+    iface->errors = 0;
+    iface->relayed++;
+    iface->relayed_bytes += write_num;
+    if (send->peers_num != 0) iface->unicast++;
+    capture_relayed (send);
+
+    /* Diagnostics */
+    if (trace) trace_relayed (iface->addr, write_num);
+  } else {
+    relay_error (iface->addr);
+    iface->send_errors++;
+
+    /* Retire only the broken socket */
+    if (++iface->errors >= RELAY_ERRORS_MAX) relay_iface_retire (iface);
+  }
+
+  /* On to the next peer with the same send */
+  if (++send->peer < send->peers_num && iface->sock != INVALID_SOCKET) {
+    relay_iface_post (iface, send);
+    return;
+  }
+
+  /* The send lives in the packet: let go of it last */
+  packet_release (packet);
+}
+
+/* Post a send to its current destination */
+static void relay_iface_post (relay_iface* const iface, relay_send* const send)
+{
+  SOCKADDR_IN sa_addr_dst = {0};
+  sa_addr_dst.sin_family = AF_INET;
+  sa_addr_dst.sin_addr.s_addr = relay_send_dst (send);
+
+  /* The checksum covers the destination too */
+  if (send->peers_num != 0 && *(const WORD*)(send->udp_header + UDP_CHECKSUM_POS) != 0) {
+    *(WORD*)(send->udp_header + UDP_CHECKSUM_POS) = relay_chksum (relay_chksum_redirect
+    (send->chksum_base, send->addr_dst, sa_addr_dst.sin_addr.s_addr), send->addr);
+  }
+
+  memset (&send->ovlp, 0, sizeof(send->ovlp));
+  send->sock = iface->sock;
+  send->gen = iface->gen;
+
+  if (iocp == NULL) {
+    WSAResetEvent (iface->evnt);
+    send->ovlp.hEvent = iface->evnt;
+    iface->sending = send;
+  } else {
+    InterlockedIncrement (&iocp_pending);
+  }
+
+  iface->inflight++;
+
+  DWORD write_num;
+
+  if (WSASendTo (send->sock, send->wsa_bufs, numof(send->wsa_bufs)
+  , &write_num, 0, (SOCKADDR*)&sa_addr_dst, sizeof(sa_addr_dst)
+  , &send->ovlp, NULL) == SOCKET_ERROR) {
+    if (WSAGetLastError() != WSA_IO_PENDING) {
+      if (iocp != NULL) InterlockedDecrement (&iocp_pending);
+      relay_iface_complete (iface, send, FALSE, 0);
+    }
+  }
+
+  /* Even if it completed right away, the result is picked up later */
+}
+
+/* Post sends from the queue for as long as the interface takes them */
+static void relay_iface_kick (relay_iface* const iface)
+{
+  DWORD const window = iocp != NULL ? RELAY_INFLIGHT_MAX : 1;
+
+  while (iface->sock != INVALID_SOCKET && iface->queue_len != 0
+  && iface->inflight < window) {
+    relay_send* const send = iface->queue[iface->queue_head];
+    iface->queue_head = (iface->queue_head + 1) % RELAY_QUEUE_MAX;
+    iface->queue_len--;
+    relay_iface_post (iface, send);
+  }
+}
+
+/* -----------------------------------------------------------------------------
+// The event loop waits for the send in flight on a full queue */
+static BOOL relay_iface_wait (relay_iface* const iface)
+{
+  if (iocp != NULL) {
+    SleepConditionVariableSRW (&iface->room, &iface->lock, RELAY_BLOCK_TIMEOUT, 0);
+    return TRUE;
+  }
+
+  if (iface->sending == NULL) return TRUE;
+
+  HANDLE evnts_write[] = {iface->evnt, evnt_stop};
+  DWORD const wait = WSAWaitForMultipleEvents (numof(evnts_write), evnts_write
+  , FALSE, INFINITE, FALSE);
+
+  /* Ctrl+C */
+  if (wait - WAIT_OBJECT_0 == 1) return FALSE;
+
+  DWORD write_num, nul;
+  relay_send* const send = iface->sending;
+  BOOL const ok = WSAGetOverlappedResult (iface->sock, &send->ovlp
+  , &write_num, FALSE, &nul);
+  relay_iface_complete (iface, send, ok, write_num);
+  relay_iface_kick (iface);
+  return TRUE;
+}
+
+static BOOL relay_iface_enqueue (relay_iface* const iface, relay_send* const send)
+{
+  if (iface->queue_len == relay_queue_len) {
+    if (relay_queue_policy == RELAY_BLOCK) {
+      if (!relay_iface_wait (iface)) {
+        packet_release (send->packet);
+        return FALSE;
+      }
+    } else if (relay_queue_policy == RELAY_DROP_OLDEST) {
+      relay_iface_drop (iface);
+    }
+
+    /* Still no room: drop the newest */
+    if (iface->queue_len == relay_queue_len || iface->sock == INVALID_SOCKET) {
+      iface->drops++;
+      packet_release (send->packet);
+      return TRUE;
+    }
+  }
+
+  iface->queue[(iface->queue_head + iface->queue_len) % RELAY_QUEUE_MAX] = send;
+  iface->queue_len++;
+  if (iface->queue_len > iface->queue_hwm) iface->queue_hwm = iface->queue_len;
+
+  relay_iface_kick (iface);
+  return TRUE;
+}
+
+/* -----------------------------------------------------------------------------
+// Shard workers keep a relay socket for every target of the snapshot
+// they saw last, and send on it right away instead of queueing.
+// Sockets retired after send errors are given another chance
+// when the snapshot changes, as with the relay socket table. */
+static void shard_sync (shard_worker* const worker, const route_snapshot* const snap)
+{
+  SOCKET socks[RELAY_IFACES_MAX];
+
+  for (DWORD j = 0; j < snap->targets_num; ++j) {
+    socks[j] = INVALID_SOCKET;
+
+    /* Interfaces which remain keep their sockets */
+    for (DWORD k = 0; k < worker->socks_num; ++k) {
+      if (worker->addrs[k] != snap->targets[j] || worker->socks[k] == INVALID_SOCKET) continue;
+      socks[j] = worker->socks[k];
+      worker->socks[k] = INVALID_SOCKET;
+      break;
+    }
+
+    if (socks[j] == INVALID_SOCKET) socks[j] = relay_socket_open (snap->targets[j]);
+  }
+
+  /* Close the ones of interfaces which are gone */
+  for (DWORD k = 0; k < worker->socks_num; ++k) {
+    if (worker->socks[k] != INVALID_SOCKET) closesocket (worker->socks[k]);
+  }
+
+  for (DWORD j = 0; j < snap->targets_num; ++j) {
+    worker->addrs[j] = snap->targets[j];
+    worker->socks[j] = socks[j];
+    worker->errors[j] = 0;
+  }
+
+  worker->socks_num = snap->targets_num;
+  worker->version = snap->version;
+}
+
+static void shard_close (shard_worker* const worker)
+{
+  for (DWORD k = 0; k < worker->socks_num; ++k) {
+    if (worker->socks[k] != INVALID_SOCKET) closesocket (worker->socks[k]);
+  }
+
+  worker->socks_num = 0;
+  worker->version = 0;
+}
+
+/* Send to the interface, or to each of its peers in turn,
+// on the socket of the worker for target `j` */
+static void shard_send (shard_worker* const worker, DWORD const j
+, relay_iface* const iface, relay_send* const send)
+{
+  do {
+    SOCKADDR_IN sa_addr_dst = {0};
+    sa_addr_dst.sin_family = AF_INET;
+    sa_addr_dst.sin_addr.s_addr = relay_send_dst (send);
+
+    /* The checksum covers the destination too */
+    if (send->peers_num != 0 && *(const WORD*)(send->udp_header + UDP_CHECKSUM_POS) != 0) {
+      *(WORD*)(send->udp_header + UDP_CHECKSUM_POS) = relay_chksum (relay_chksum_redirect
+      (send->chksum_base, send->addr_dst, sa_addr_dst.sin_addr.s_addr), send->addr);
+    }
+
+    DWORD write_num = 0;
+    BOOL const ok = WSASendTo (worker->socks[j], send->wsa_bufs, numof(send->wsa_bufs)
+    , &write_num, 0, (SOCKADDR*)&sa_addr_dst, sizeof(sa_addr_dst), NULL, NULL) != SOCKET_ERROR
+    && write_num == send->wsa_bufs[0].len + send->wsa_bufs[1].len;
+
+    AcquireSRWLockExclusive (&iface->lock);
+    if (ok) {
+      iface->relayed++;
+      iface->relayed_bytes += write_num;
+      if (send->peers_num != 0) iface->unicast++;
+    } else {
+      iface->send_errors++;
+    }
+    ReleaseSRWLockExclusive (&iface->lock);
+
+    if (ok) {
+      LONGLONG const now = qpc_now();
+      stage_record (STAGE_SEND, send->time_queued, now);
+      stage_record (STAGE_TOTAL, send->packet->time_recv, now);
+
+      worker->errors[j] = 0;
+      capture_relayed (send);
+
+      /* Diagnostics */
+      if (trace) trace_relayed (send->addr, write_num);
+    } else {
+      relay_error (send->addr);
+
+      /* Retire only the broken socket */
+      if (++worker->errors[j] >= RELAY_ERRORS_MAX) {
+        closesocket (worker->socks[j]);
+        worker->socks[j] = INVALID_SOCKET;
+        return;
+      }
+    }
+  } while (++send->peer < send->peers_num);
+}
+
+/* -----------------------------------------------------------------------------
+// Relay the packet to all interfaces of the snapshot: queued, or right
+// away on the sockets of a shard worker. Returns `FALSE` if stopped
+// while waiting for room in one of the queues. */
+static BOOL relay_fanout (const route_snapshot* const snap, relay_packet* const packet
+, const unsigned char* const udp, DWORD const packet_size, ULONG const addr_dst
+, shard_worker* const worker)
+{
+  if (worker != NULL && worker->version != snap->version) shard_sync (worker, snap);
+
+  /* Sum the payload once for all relay interfaces,
+  // unless the sender didn't use the checksum at all */
+  LONGLONG const time_chksum = qpc_now();
+  BOOL const has_chksum = *(const WORD*)(udp + UDP_CHECKSUM_POS) != 0;
+  DWORD const chksum_base = has_chksum
+  ? relay_chksum_base (udp, packet_size, addr_dst) : 0;
+  LONGLONG const time_queued = qpc_now();
+  stage_record (STAGE_PARSE, packet->time_recv, time_chksum);
+  stage_record (STAGE_CHKSUM, time_chksum, time_queued);
+
+  BOOL const unicast = unicast_port (ntohs(*(const WORD*)(udp + UDP_PORT_DST_POS)));
+  int const group = mcast_group_index (addr_dst);
+
+  for (DWORD j = 0; j < snap->targets_num; ++j) {
+    DWORD const i = snap->slots[j];
+    relay_iface* const iface = &relay_ifaces[i];
+    relay_send* const send = &packet->sends[i];
+
+    AcquireSRWLockExclusive (&iface->lock);
+
+    /* The slot may have been closed, or reused, since the snapshot */
+    if (iface->addr != snap->targets[j]
+    || (worker != NULL ? worker->socks[j] : iface->sock) == INVALID_SOCKET
+    || (group >= 0 && !mcast_member (iface, group)) || !rate_iface_pass (iface)) {
+      ReleaseSRWLockExclusive (&iface->lock);
+      continue;
+    }
+
+    send->packet = packet;
+    send->addr = iface->addr;
+    send->addr_dst = addr_dst;
+    send->slot = i;
+    send->time_queued = time_queued;
+    send->chksum_base = chksum_base;
+    send->peer = 0;
+    send->peers_num = 0;
+    if (unicast) unicast_peers (iface, send);
+
+    /* Recompute UDP header checksum */
+    relay_rewrite (send->udp_header, udp, chksum_base, iface->addr);
+
+    send->wsa_bufs[0].buf = (char*)send->udp_header;
+    send->wsa_bufs[0].len = UDP_HEADER_SIZE;
+    send->wsa_bufs[1].buf = (char*)(udp + UDP_HEADER_SIZE);
+    send->wsa_bufs[1].len = packet_size - UDP_HEADER_SIZE;
+
+    if (worker != NULL) {
+      ReleaseSRWLockExclusive (&iface->lock);
+      shard_send (worker, j, iface, send);
+      continue;
+    }
+
+    /* The buffer is held until the send completes */
+    InterlockedIncrement (&packet->refs);
+    BOOL const ok = relay_iface_enqueue (iface, send);
+
+    ReleaseSRWLockExclusive (&iface->lock);
+    if (!ok) return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* -----------------------------------------------------------------------------
+// Event loop: pick up the results of sends which have completed */
+static void relay_ifaces_poll (void)
+{
+  for (DWORD i = 0; i < relay_ifaces_num; ++i) {
+    relay_iface* const iface = &relay_ifaces[i];
+    relay_send* const send = iface->sending;
+    if (send == NULL || !HasOverlappedIoCompleted (&send->ovlp)) continue;
+
+    DWORD write_num, nul;
+    BOOL const ok = WSAGetOverlappedResult (iface->sock, &send->ovlp
+    , &write_num, FALSE, &nul);
+    if (!ok && WSAGetLastError() == WSA_IO_INCOMPLETE) continue;
+
+    relay_iface_complete (iface, send, ok, write_num);
+    relay_iface_kick (iface);
+  }
+}
+
+/* Wait for the receive, or for any send in flight, to complete.
+// Returns the event which fired (0 for Ctrl+C, then the receive
+// if waited for), or `WAIT_FAILED` on error. */
+static DWORD relay_ifaces_wait (BOOL const with_read)
+{
+  HANDLE evnts[2 + RELAY_IFACES_MAX];
+  DWORD evnts_num = 0;
+
+  evnts[evnts_num++] = evnt_stop;
+  if (with_read) evnts[evnts_num++] = evnt_read;
+
+  for (DWORD i = 0; i < relay_ifaces_num; ++i) {
+    if (relay_ifaces[i].sending != NULL) evnts[evnts_num++] = relay_ifaces[i].evnt;
+  }
+
+  DWORD const wait = WSAWaitForMultipleEvents (evnts_num, evnts
+  , FALSE, INFINITE, FALSE);
+
+  if (wait == WSA_WAIT_FAILED) {
+    msg_error (L"Error waiting for network events.");
+    fail = TRUE;
+    return WAIT_FAILED;
+  }
+
+  relay_ifaces_poll();
+  return wait - WAIT_OBJECT_0;
+}
+
+/* -----------------------------------------------------------------------------
+// Busy polling. Waking up from a blocking wait adds latency (and jitter)
+// to every packet. Instead, the event loop can keep checking the receive
+// and the sends in flight for up to `poll_budget` microseconds, on a core
+// of its own and at a higher priority, before it falls back to blocking.
+// The time spent spinning and blocked is reported on exit. */
+static BOOL poll_parse (const wchar_t* const str)
+{
+  unsigned budget, cpu;
+  wchar_t tail;
+
+  int const num = swscanf (str, L"%u:%u%lc", &budget, &cpu, &tail);
+  if (num != 1 && num != 2) return FALSE;
+  if (budget == 0 || budget > POLL_BUDGET_MAX) return FALSE;
+  if (num == 2 && cpu >= sizeof(DWORD_PTR) * 8) return FALSE;
+
+  poll_budget = budget;
+  poll_cpu = num == 2 ? cpu : MAXDWORD;
+  return TRUE;
+}
+
+static void poll_setup (void)
+{
+  if (poll_cpu != MAXDWORD
+  && SetThreadAffinityMask (GetCurrentThread(), (DWORD_PTR)1 << poll_cpu) == 0) {
+    msg_error (L"Couldn't pin the relay thread to the processor.");
+  }
+
+  if (!SetThreadPriority (GetCurrentThread(), THREAD_PRIORITY_HIGHEST)) {
+    msg_error (L"Couldn't raise the relay thread priority.");
+  }
+}
+
+/* Wait for the receive to complete, picking up send completions
+// in the meantime. Returns `FALSE` on Ctrl+C. */
+static BOOL poll_wait (void)
+{
+  LONGLONG const start = qpc_now();
+
+  if (poll_budget != 0) {
+    LONGLONG const budget = (LONGLONG)poll_budget * qpc_freq.QuadPart / 1000000;
+    LONGLONG now = start;
+
+    do {
+      relay_ifaces_poll();
+      if (HasOverlappedIoCompleted (&ovlp_read)) {
+        poll_spinning += qpc_now() - start;
+        poll_hits++;
+        return TRUE;
+      }
+      YieldProcessor();
+      now = qpc_now();
+    } while (now - start < budget);
+
+    poll_spinning += now - start;
+    poll_misses++;
+  }
+
+  /* Sends complete in the meantime */
+  LONGLONG const block = qpc_now();
+  DWORD wait;
+  while ((wait = relay_ifaces_wait (TRUE)) > 1 && wait != WAIT_FAILED);
+  poll_blocked += qpc_now() - block;
+
+  /* Ctrl+C */
+  return wait == 1;
+}
+
+static void poll_report (LONGLONG const total)
+{
+  if (poll_budget == 0 || total <= 0) return;
+
+  set_text_color (3);
+  wprintf (L"Busy poll: %.1f%% spinning, %.1f%% blocked"
+  L" (%llu receives caught spinning, %llu missed)\n"
+  , 100.0 * poll_spinning / total, 100.0 * poll_blocked / total
+  , poll_hits, poll_misses);
+  set_text_color (7);
+}
+
+/* -----------------------------------------------------------------------------
+// Relay metrics. Per thread counters are added up on demand and served
+// in Prometheus text format on a local named pipe (`type \\.\pipe\BROADcast`
+// prints them), and optionally summarized on the console every so often.
+// Readers may see counters a few packets behind. */
+static void metrics_sum (metrics_shard* const sum)
+{
+  memset (sum, 0, sizeof(*sum));
+
+  for (DWORD i = 0; i < numof(metrics_shards); ++i) {
+    const metrics_shard* const shard = &metrics_shards[i];
+    sum->captured += shard->captured;
+    sum->captured_bytes += shard->captured_bytes;
+    sum->route_refreshes += shard->route_refreshes;
+    for (DWORD j = 0; j < DROP_REASONS; ++j) sum->dropped[j] += shard->dropped[j];
+  }
+}
+
+static int metrics_format (char* const text, size_t const text_sz)
+{
+  static const char* const drop_reasons[DROP_REASONS] = {
+    "malformed", "filter", "ignored", "duplicate", "beacon", "rate", "shard"
+  };
+
+  metrics_shard sum;
+  metrics_sum (&sum);
+
+  int len = snprintf (text, text_sz
+  , "# HELP broadcast_captured_packets_total Packets seen by the listening socket.\n"
+    "# TYPE broadcast_captured_packets_total counter\n"
+    "broadcast_captured_packets_total %llu\n"
+    "# HELP broadcast_captured_bytes_total Bytes seen by the listening socket.\n"
+    "# TYPE broadcast_captured_bytes_total counter\n"
+    "broadcast_captured_bytes_total %llu\n"
+    "# HELP broadcast_route_refreshes_total Routing snapshot refreshes.\n"
+    "# TYPE broadcast_route_refreshes_total counter\n"
+    "broadcast_route_refreshes_total %llu\n"
+    "# HELP broadcast_pool_buffers_used Packet buffers in use.\n"
+    "# TYPE broadcast_pool_buffers_used gauge\n"
+    "broadcast_pool_buffers_used %ld\n"
+    "# HELP broadcast_dropped_packets_total Packets not relayed, by reason.\n"
+    "# TYPE broadcast_dropped_packets_total counter\n"
+  , sum.captured, sum.captured_bytes, sum.route_refreshes, pool_used);
+
+  for (DWORD i = 0; i < DROP_REASONS && len > 0 && (size_t)len < text_sz; ++i) {
+    len += snprintf (text + len, text_sz - len
+    , "broadcast_dropped_packets_total{reason=\"%s\"} %llu\n"
+    , drop_reasons[i], sum.dropped[i]);
+  }
+
+  if (len > 0 && (size_t)len < text_sz) {
+    len += snprintf (text + len, text_sz - len
+    , "# HELP broadcast_relayed_packets_total Packets relayed to an interface.\n"
+      "# TYPE broadcast_relayed_packets_total counter\n"
+      "# HELP broadcast_relayed_bytes_total Bytes relayed to an interface.\n"
+      "# TYPE broadcast_relayed_bytes_total counter\n"
+      "# HELP broadcast_relay_dropped_packets_total Packets not relayed to an interface, by reason.\n"
+      "# TYPE broadcast_relay_dropped_packets_total counter\n"
+      "# HELP broadcast_send_errors_total Failed sends to an interface.\n"
+      "# TYPE broadcast_send_errors_total counter\n"
+      "# HELP broadcast_relay_queue_depth Packets queued for an interface.\n"
+      "# TYPE broadcast_relay_queue_depth gauge\n"
+      "# HELP broadcast_unicast_packets_total Unicast copies sent to peers on an interface.\n"
+      "# TYPE broadcast_unicast_packets_total counter\n"
+      "# HELP broadcast_unicast_peers Peers learned on an interface.\n"
+      "# TYPE broadcast_unicast_peers gauge\n");
+  }
+
+  if (len > 0 && (size_t)len < text_sz && beacon_rules_num != 0) {
+    len += snprintf (text + len, text_sz - len
+    , "# HELP broadcast_beacon_held_packets_total Repeated announcements not relayed, by port.\n"
+      "# TYPE broadcast_beacon_held_packets_total counter\n"
+      "# HELP broadcast_beacon_held_bytes_total Bytes of repeated announcements not relayed, by port.\n"
+      "# TYPE broadcast_beacon_held_bytes_total counter\n");
+  }
+
+  AcquireSRWLockShared (&beacon_lock);
+
+  for (DWORD i = 0; i < beacon_rules_num && len > 0 && (size_t)len < text_sz; ++i) {
+    const beacon_rule* const rule = &beacon_rules[i];
+    char ports[16];
+    if (rule->first == rule->last) snprintf (ports, sizeof(ports), "%u", (unsigned)rule->first);
+    else snprintf (ports, sizeof(ports), "%u-%u", (unsigned)rule->first, (unsigned)rule->last);
+
+    len += snprintf (text + len, text_sz - len
+    , "broadcast_beacon_held_packets_total{port=\"%s\"} %llu\n"
+      "broadcast_beacon_held_bytes_total{port=\"%s\"} %llu\n"
+    , ports, rule->packets, ports, rule->bytes);
+  }
+
+  ReleaseSRWLockShared (&beacon_lock);
+
+  if (len > 0 && (size_t)len < text_sz) {
+    len += snprintf (text + len, text_sz - len
+    , "# HELP broadcast_stage_latency_seconds Time spent in each relay stage.\n"
+      "# TYPE broadcast_stage_latency_seconds summary\n");
+  }
+
+  for (DWORD i = 0; i < STAGES && len > 0 && (size_t)len < text_sz; ++i) {
+    stage_hist hist;
+    stage_sum (i, &hist);
+    ULONGLONG const count = stage_count (&hist);
+
+    len += snprintf (text + len, text_sz - len
+    , "broadcast_stage_latency_seconds{stage=\"%s\",quantile=\"0.5\"} %.9f\n"
+      "broadcast_stage_latency_seconds{stage=\"%s\",quantile=\"0.99\"} %.9f\n"
+      "broadcast_stage_latency_seconds{stage=\"%s\",quantile=\"0.999\"} %.9f\n"
+      "broadcast_stage_latency_seconds_count{stage=\"%s\"} %llu\n"
+    , stage_names[i], stage_quantile (&hist, count, 500) / 1e9
+    , stage_names[i], stage_quantile (&hist, count, 990) / 1e9
+    , stage_names[i], stage_quantile (&hist, count, 999) / 1e9
+    , stage_names[i], count);
+  }
+
+  AcquireSRWLockShared (&relay_lock);
+
+  for (DWORD i = 0; i < relay_ifaces_num && len > 0 && (size_t)len < text_sz; ++i) {
+    relay_iface* const iface = &relay_ifaces[i];
+
+    AcquireSRWLockShared (&iface->lock);
+
+    if (iface->addr != 0) {
+      char addr[16];
+      snprintf (addr, sizeof(addr), "%u.%u.%u.%u"
+      , (unsigned)(iface->addr & 0xFF), (unsigned)((iface->addr >> 8) & 0xFF)
+      , (unsigned)((iface->addr >> 16) & 0xFF), (unsigned)((iface->addr >> 24) & 0xFF));
+
+      len += snprintf (text + len, text_sz - len
+      , "broadcast_relayed_packets_total{iface=\"%s\"} %llu\n"
+        "broadcast_relayed_bytes_total{iface=\"%s\"} %llu\n"
+        "broadcast_relay_dropped_packets_total{iface=\"%s\",reason=\"queue\"} %lu\n"
+        "broadcast_relay_dropped_packets_total{iface=\"%s\",reason=\"rate\"} %lu\n"
+        "broadcast_send_errors_total{iface=\"%s\"} %llu\n"
+        "broadcast_relay_queue_depth{iface=\"%s\"} %lu\n"
+        "broadcast_unicast_packets_total{iface=\"%s\"} %llu\n"
+        "broadcast_unicast_peers{iface=\"%s\"} %lu\n"
+      , addr, iface->relayed, addr, iface->relayed_bytes
+      , addr, iface->drops, addr, iface->rate.dropped
+      , addr, iface->send_errors, addr, iface->queue_len
+      , addr, iface->unicast, addr, iface->peers_num);
+    }
+
+    ReleaseSRWLockShared (&iface->lock);
+  }
+
+  ReleaseSRWLockShared (&relay_lock);
+
+  if (len > 0 && (size_t)len < text_sz && use_shards) {
+    len += snprintf (text + len, text_sz - len
+    , "# HELP broadcast_worker_packets_total Packets handled by a shard worker.\n"
+      "# TYPE broadcast_worker_packets_total counter\n"
+      "# HELP broadcast_worker_bytes_total Bytes handled by a shard worker.\n"
+      "# TYPE broadcast_worker_bytes_total counter\n"
+      "# HELP broadcast_worker_busy_seconds_total Time a shard worker spent relaying.\n"
+      "# TYPE broadcast_worker_busy_seconds_total counter\n"
+      "# HELP broadcast_worker_dropped_packets_total Packets dropped on a full shard ring.\n"
+      "# TYPE broadcast_worker_dropped_packets_total counter\n"
+      "# HELP broadcast_worker_ring_depth Packets waiting for a shard worker.\n"
+      "# TYPE broadcast_worker_ring_depth gauge\n");
+  }
+
+  for (DWORD i = 0; use_shards && i < shard_workers_num
+  && len > 0 && (size_t)len < text_sz; ++i) {
+    const shard_worker* const worker = &shard_workers[i];
+
+    len += snprintf (text + len, text_sz - len
+    , "broadcast_worker_packets_total{worker=\"%u\"} %llu\n"
+      "broadcast_worker_bytes_total{worker=\"%u\"} %llu\n"
+      "broadcast_worker_busy_seconds_total{worker=\"%u\"} %.6f\n"
+      "broadcast_worker_dropped_packets_total{worker=\"%u\"} %llu\n"
+      "broadcast_worker_ring_depth{worker=\"%u\"} %ld\n"
+    , (unsigned)i, worker->packets, (unsigned)i, worker->bytes
+    , (unsigned)i, (double)worker->busy / qpc_freq.QuadPart
+    , (unsigned)i, worker->dropped, (unsigned)i, worker->tail - worker->head);
+  }
+
+  /* Truncated */
+  if (len < 0 || (size_t)len >= text_sz) return -1;
+  return len;
+}
+
+static void metrics_summary (metrics_shard* const last)
+{
+  metrics_shard sum;
+  metrics_sum (&sum);
+
+  ULONGLONG relayed = 0, errors = 0, dropped = 0;
+
+  AcquireSRWLockShared (&relay_lock);
+  for (DWORD i = 0; i < relay_ifaces_num; ++i) {
+    relayed += relay_ifaces[i].relayed;
+    errors += relay_ifaces[i].send_errors;
+    dropped += relay_ifaces[i].drops + relay_ifaces[i].rate.dropped;
+  }
+  ReleaseSRWLockShared (&relay_lock);
+
+  for (DWORD i = 0; i < DROP_REASONS; ++i) dropped += sum.dropped[i];
+
+  set_text_color (3);
+  wprintf (L"Captured %llu (%llu/s) | Relayed %llu | Dropped %llu"
+  L" | Errors %llu | Refreshes %llu | Pool %ld\n"
+  , sum.captured, (sum.captured - last->captured) / metrics_interval
+  , relayed, dropped, errors, sum.route_refreshes, pool_used);
+
+  /* Load of the shard workers */
+  if (use_shards && shard_workers_num != 0) {
+    wprintf (L"Workers");
+    for (DWORD i = 0; i < shard_workers_num; ++i) {
+      shard_worker* const worker = &shard_workers[i];
+      ULONGLONG const packets = worker->packets;
+      wprintf (L" | %llu/s", (packets - worker->packets_last) / metrics_interval);
+      worker->packets_last = packets;
+    }
+    wprintf (L"\n");
+  }
+
+  set_text_color (7);
+
+  *last = sum;
+}
+
+static DWORD WINAPI metrics_server (LPVOID const param)
+{
+  static char text[METRICS_TEXT_MAX];
+  metrics_shard last = {0};
+  OVERLAPPED ovlp = {0};
+
+  (void)param;
+
+  /* Only local clients */
+  HANDLE const pipe = CreateNamedPipeW (METRICS_PIPE
+  , PIPE_ACCESS_OUTBOUND | FILE_FLAG_OVERLAPPED
+  , PIPE_TYPE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS
+  , 1, METRICS_TEXT_MAX, 0, 0, NULL);
+
+  if (pipe == INVALID_HANDLE_VALUE) {
+    msg_error (L"Couldn't create the metrics pipe.");
+  } else {
+    ovlp.hEvent = CreateEventW (NULL, TRUE, FALSE, NULL);
+  }
+
+  DWORD const timeout = metrics_interval != 0 && !is_service
+  ? metrics_interval * 1000 : INFINITE;
+  BOOL connecting = FALSE;
+
+  while (TRUE) {
+    /* Wait for the next client */
+    if (ovlp.hEvent != NULL && !connecting) {
+      ResetEvent (ovlp.hEvent);
+      if (ConnectNamedPipe (pipe, &ovlp)) SetEvent (ovlp.hEvent);
+      else if (GetLastError() == ERROR_PIPE_CONNECTED) SetEvent (ovlp.hEvent);
+      else if (GetLastError() != ERROR_IO_PENDING) {
+        /* Keep the console summary going */
+        msg_error (L"Error serving the metrics pipe.");
+        CloseHandle (ovlp.hEvent);
+        ovlp.hEvent = NULL;
+        continue;
+      }
+      connecting = TRUE;
+    }
+
+    HANDLE evnts[] = {evnt_stop, ovlp.hEvent};
+    DWORD const wait = WaitForMultipleObjects (ovlp.hEvent != NULL ? 2 : 1
+    , evnts, FALSE, timeout);
+
+    /* Ctrl+C */
+    if (wait == WAIT_OBJECT_0) break;
+
+    if (wait == WAIT_TIMEOUT) {
+      metrics_summary (&last);
+      continue;
+    }
+
+    /* Client connected: give it everything and hang up */
+    connecting = FALSE;
+    int const len = metrics_format (text, sizeof(text));
+
+    if (len > 0) {
+      DWORD write_num;
+      ResetEvent (ovlp.hEvent);
+      if (WriteFile (pipe, text, (DWORD)len, &write_num, &ovlp)
+      || GetLastError() == ERROR_IO_PENDING) {
+        GetOverlappedResult (pipe, &ovlp, &write_num, TRUE);
+        FlushFileBuffers (pipe);
+      }
+    }
+
+    DisconnectNamedPipe (pipe);
+  }
+
+  if (pipe != INVALID_HANDLE_VALUE) {
+    CancelIoEx (pipe, NULL);
+    CloseHandle (pipe);
+  }
+  if (ovlp.hEvent != NULL) CloseHandle (ovlp.hEvent);
+
+  return 0;
+}
+
+/* Local address must be allowed by the filter rules */
+static bool route_target_pass (uint32_t const addr, void* const ctx)
+{
+  (void)ctx;
+  return relay_filter_addr (&filter.to, addr);
+}
+
+/* -----------------------------------------------------------------------------
+// Build the list of interfaces to relay to out of the forwarding table.
+// This only depends on its arguments (and the filter rules, which
+// never change), so the per-packet code never has to look
+// at the forwarding table itself */
+static BOOL route_snapshot_build (route_snapshot* const snap
+, const MIB_IPFORWARDROW* const rows, DWORD const rows_num
+, ULONG const addr_route)
+{
+  relay_route* const routes = malloc ((rows_num + 1) * sizeof(*routes));
+  if (routes == NULL) return FALSE;
+
+  for (DWORD i = 0; i < rows_num; ++i) {
+    routes[i].dest = rows[i].dwForwardDest;
+    routes[i].mask = rows[i].dwForwardMask;
+    routes[i].next_hop = rows[i].dwForwardNextHop;
+    routes[i].direct = rows[i].dwForwardType == MIB_IPROUTE_TYPE_DIRECT;
+  }
+
+  snap->addr_route = addr_route;
+  snap->targets_num = relay_targets (routes, rows_num, addr_route
+  , route_target_pass, NULL, snap->targets, snap->nets, snap->masks
+  , numof(snap->targets));
+
+  free (routes);
+  return TRUE;
+}
+
+/* -----------------------------------------------------------------------------
+// The snapshot is swapped in whole, so the relay threads never see
+// a half-updated one, and never wait for a refresh (see `epoch.h`). */
+static const route_snapshot* route_enter (void)
+{
+  return (const route_snapshot*)epoch_enter (&route_domain, metrics_local - metrics_shards);
+}
+
+static void route_leave (void)
+{
+  epoch_leave (&route_domain, metrics_local - metrics_shards);
+}
+
+/* The relay lock is held */
+static void route_publish (route_snapshot* const snap)
+{
+  snap->version = ++route_version;
+  epoch_publish (&route_domain, &snap->node);
+}
+
+/* The relay threads are gone */
+static void route_release (void)
+{
+  AcquireSRWLockExclusive (&relay_lock);
+  epoch_release (&route_domain);
+  ReleaseSRWLockExclusive (&relay_lock);
+}
+
+/* -----------------------------------------------------------------------------
+// Query the preferred route and the forwarding table,
+// and bring the relay sockets up to date */
+static BOOL route_refresh (void)
+{
+  DWORD code, nul;
+
+  /* Find out the preferred broadcast route */
+  sockaddr_gen sa_addr_broadcast = {0};
+  sa_addr_broadcast.Address.sa_family = AF_INET;
+  sa_addr_broadcast.AddressIn.sin_addr.s_addr = addr_broadcast;
+
+  sockaddr_gen sa_addr_route = {0};
+  LONGLONG const time_query = qpc_now();
+
+  if (WSAIoctl (sock_listen, SIO_ROUTING_INTERFACE_QUERY, &sa_addr_broadcast
+  , sizeof(sa_addr_broadcast), &sa_addr_route, sizeof(sa_addr_route)
+  , &nul, NULL, NULL) == SOCKET_ERROR) {
+    if (!((WSAGetLastError() == WSAENETUNREACH) || (WSAGetLastError() == WSAEHOSTUNREACH)
+    ||    (WSAGetLastError() == WSAENETDOWN))) {
+      msg_error (L"Couldn't get the preferred broadcast route.");
+      return FALSE;
+    }
+  }
+
+  /* Get the forwarding table */
+  LONGLONG const time_fetch = qpc_now();
+  stage_record (STAGE_ROUTE_QUERY, time_query, time_fetch);
+  int i = 0;
+
+  while ((code = GetIpForwardTable (fwd_table, &fwd_table_sz
+  , FALSE)) != NO_ERROR) {
+    ++i;
+
+    if (code == ERROR_INSUFFICIENT_BUFFER && i < METRIC_CHANGE_TRIES_MAX) {
+      PMIB_IPFORWARDTABLE const fwd_table_new = realloc (fwd_table, fwd_table_sz);
+      if (fwd_table_new == NULL) break;
+      fwd_table = fwd_table_new;
+      continue;
+    }
+
+    break;
+  }
+
+  if (code != NO_ERROR) {
+    msg_error (L"Error getting the forwarding table.");
+    return FALSE;
+  }
+
+  stage_record (STAGE_FWD_TABLE, time_fetch, qpc_now());
+
+  route_snapshot* const snap = malloc (sizeof(route_snapshot));
+
+  if (snap == NULL || !route_snapshot_build (snap, fwd_table->table
+  , fwd_table->dwNumEntries, sa_addr_route.AddressIn.sin_addr.s_addr)) {
+    msg_error (L"Error allocating the routing snapshot.");
+    free (snap);
+    return FALSE;
+  }
+
+  relay_ifaces_update (snap);
+  route_publish (snap);
+  mcast_listen (snap->addr_route);
+  metrics_local->route_refreshes++;
+
+  if (trace) {
+    set_text_color (3);
+    wprintf (L"Routes refreshed: %u relay interface(s), version %llu\n"
+    , (unsigned)snap->targets_num, snap->version);
+    set_text_color (7);
+  }
+
+  return TRUE;
+}
+
+/* Relay threads bring the snapshot up to date on their way.
+// If another thread (or the metrics pipe) is holding the relay table,
+// the current snapshot is used for now and the refresh is left
+// to the next packet. */
+static BOOL route_update (void)
+{
+  if (!TryAcquireSRWLockExclusive (&relay_lock)) {
+    InterlockedExchange (&route_dirty, TRUE);
+    return TRUE;
+  }
+
+  BOOL const ok = route_refresh();
+  ReleaseSRWLockExclusive (&relay_lock);
+  return ok;
+}
+
+/* -----------------------------------------------------------------------------
+// Change notifications are delivered on a system thread:
+// they only mark the snapshot as stale */
+static void WINAPI route_changed (PVOID const ctx
+, PMIB_IPFORWARD_ROW2 const row, MIB_NOTIFICATION_TYPE const type)
+{
+  (void)ctx;
+  (void)row;
+  (void)type;
+
+  InterlockedExchange (&route_dirty, TRUE);
+}
+
+static void WINAPI iface_changed (PVOID const ctx
+, PMIB_IPINTERFACE_ROW const row, MIB_NOTIFICATION_TYPE const type)
+{
+  (void)ctx;
+  (void)row;
+  (void)type;
+
+  InterlockedExchange (&route_dirty, TRUE);
+}
+
+static void WINAPI addr_changed (PVOID const ctx
+, PMIB_UNICASTIPADDRESS_ROW const row, MIB_NOTIFICATION_TYPE const type)
+{
+  (void)ctx;
+  (void)row;
+  (void)type;
+
+  InterlockedExchange (&route_dirty, TRUE);
+}
+
+static void route_notify_stop (void)
+{
+  if (notify_route != NULL) CancelMibChangeNotify2 (notify_route);
+  if (notify_iface != NULL) CancelMibChangeNotify2 (notify_iface);
+  if (notify_addr  != NULL) CancelMibChangeNotify2 (notify_addr);
+  notify_route = notify_iface = notify_addr = NULL;
+}
+
+static void route_notify_start (void)
+{
+  route_dirty = TRUE;
+  route_notify = NotifyRouteChange2 (AF_INET, route_changed
+  , NULL, FALSE, &notify_route) == NO_ERROR
+  && NotifyIpInterfaceChange (AF_INET, iface_changed
+  , NULL, FALSE, &notify_iface) == NO_ERROR
+  && NotifyUnicastIpAddressChange (AF_INET, addr_changed
+  , NULL, FALSE, &notify_addr) == NO_ERROR;
+
+  /* Fall back to querying routes for every packet */
+  if (!route_notify) {
+    route_notify_stop();
+    msg_error (L"Couldn't subscribe to route change notifications.");
+  }
+}
+
+/* -----------------------------------------------------------------------------
+// Get a buffer to receive into, waiting for the sends in flight
+// to give one back if the pool has run dry */
+static relay_packet* loop_packet_get (void)
+{
+  relay_packet* packet;
+
+  while ((packet = pool_get()) == NULL) {
+    /* Ctrl+C */
+    DWORD const wait = relay_ifaces_wait (FALSE);
+    if (wait == 0 || wait == WAIT_FAILED) return NULL;
+  }
+
+  return packet;
+}
+
+static void broadcast_loop (void)
+{
+  metrics_local = &metrics_shards[0];
+  LONGLONG const time_start = qpc_now();
+  if (poll_budget != 0) poll_setup();
+
+  /* Datagrams are parsed and relayed right where they were received:
+  // `offset` is where the current datagram starts in the buffer */
+  relay_packet* packet = loop_packet_get();
+  if (packet == NULL) goto done;
+
+  packet->wsa_buf.buf = (char*)packet->buf;
+  packet->wsa_buf.len = BUF_SIZE;
+
+  DWORD code, flags;
+  DWORD read_num, read_total, to_read, offset;
+
+  offset = 0;
+  read_total = 0;
+  to_read = IP_HEADER_SIZE + UDP_HEADER_SIZE;
+
+  while (TRUE) {
+    flags = 0;
+    code = WSARecv (sock_listen, &packet->wsa_buf, 1u, &read_num, &flags
+    , &ovlp_read, NULL);
+
+    if (code == SOCKET_ERROR) {
+      if (WSAGetLastError() != WSA_IO_PENDING) {
+        msg_error (L"Error listening on the broadcast socket.");
+        fail = TRUE;
+        goto done;
+      }
+
+      if (!poll_wait()) goto done;
+
+      DWORD nul;
+      WSAGetOverlappedResult (sock_listen, &ovlp_read, &read_num, FALSE, &nul);
+    }
+
+    packet->time_recv = qpc_now();
+
+    /* Wait until we have a complete UDP datagram */
+    read_total += read_num;
+
+next_packet:
+    if (read_total < to_read) {
+      packet->wsa_buf.buf += read_num;
+      packet->wsa_buf.len -= read_num;
+      continue;
+    }
+
+    unsigned char* const buf = packet->buf + offset;
+
+#ifndef NDEBUG
+    wprintf (L"[DEBUG] Source address: %.8X\n", (unsigned)ntohl(*(ULONG*)(buf + IP_ADDR_SRC_POS)));
+    wprintf (L"[DEBUG] Destination address: %.8X\n", (unsigned)ntohl(*(ULONG*)(buf + IP_ADDR_DST_POS)));
+    wprintf (L"[DEBUG] Source port: %u\n", (unsigned)ntohs(*(WORD*)(buf + IP_HEADER_SIZE)));
+    wprintf (L"[DEBUG] Destination port: %u\n", (unsigned)ntohs(*(WORD*)(buf + IP_HEADER_SIZE + 2)));
+    wprintf (L"[DEBUG] Size: %u\n", (unsigned)ntohs(*(WORD*)(buf + IP_HEADER_SIZE + UDP_LENGTH_POS)));
+    wprintf (L"[DEBUG] Checksum: %x\n", (unsigned)ntohs(*(WORD*)(buf + IP_HEADER_SIZE + UDP_CHECKSUM_POS)));
+#endif
+
+    DWORD const packet_size = relay_udp_size (buf);
+    to_read = IP_HEADER_SIZE + packet_size;
+
+    if (read_total < to_read) {
+      /* Can't ever fit: drop what we have */
+      if (to_read > BUF_SIZE) {
+        metrics_local->captured++;
+        metrics_local->dropped[DROP_MALFORMED]++;
+        read_total = 0;
+        to_read = IP_HEADER_SIZE + UDP_HEADER_SIZE;
+      }
+
+      /* Not enough room left for the rest of the datagram */
+      if (offset + to_read > BUF_SIZE) {
+        if (packet->refs == 1) {
+          memmove (packet->buf, buf, read_total);
+        } else {
+          relay_packet* const packet_next = loop_packet_get();
+          if (packet_next == NULL) goto done;
+          memcpy (packet_next->buf, buf, read_total);
+          packet_next->time_recv = packet->time_recv;
+          packet_release (packet);
+          packet = packet_next;
+        }
+        offset = 0;
+      }
+
+      packet->wsa_buf.buf = (char*)packet->buf + offset + read_total;
+      packet->wsa_buf.len = BUF_SIZE - offset - read_total;
+      read_num = 0;
+      continue;
+    }
+
+    metrics_local->captured++;
+    metrics_local->captured_bytes += to_read;
+
+    relay_hdr hdr;
+
+    if (!relay_parse (buf, to_read, &hdr)) {
+      metrics_local->dropped[DROP_MALFORMED]++;
+      goto next_datagram;
+    }
+
+    capture_inbound (buf, to_read);
+
+    /* Packets we don't care about don't get any further */
+    if (!filter_pass (&hdr)) goto next_datagram;
+
+    /* Refresh the routing snapshot only when something has changed */
+    if (!route_notify || InterlockedExchange (&route_dirty, FALSE)) {
+      if (!route_update()) {
+        fail = TRUE;
+        goto done;
+      }
+    }
+
+    const route_snapshot* const snap = route_enter();
+    ULONG const addr_route = snap->addr_route;
+
+    /* Diagnostics */
+    if (trace) trace_packet (&hdr, addr_route);
+    if (unicast_ports_on) unicast_learn (snap, &hdr);
+
+    /* Got broadcast packet from the preferred route
+    // which we haven't relayed already? */
+    if (!relay_wanted (&hdr, addr_route, addr_broadcast)
+    && !mcast_wanted (&hdr, addr_route)) {
+      metrics_local->dropped[DROP_IGNORED]++;
+    } else if (!dedup_seen (hdr.udp, hdr.size, hdr.addr_src) && !beacon_held (&hdr)
+    && rate_pass (hdr.addr_src, hdr.port_dst)) {
+      /* Queue the packet on all interfaces at once */
+      relay_ifaces_poll();
+      if (!relay_fanout (snap, packet, hdr.udp, hdr.size, hdr.addr_dst, NULL)) goto done;
+      tunnel_put (&hdr);
+    }
+
+    route_leave();
+
+next_datagram:
+    /* Move on to the next datagram in the buffer */
+    offset += to_read;
+    read_total -= to_read;
+    to_read = IP_HEADER_SIZE + UDP_HEADER_SIZE;
+
+    if (packet->refs != 1) {
+      /* Sends of this buffer are queued: carry on in another one */
+      relay_packet* const packet_next = loop_packet_get();
+      if (packet_next == NULL) goto done;
+      memcpy (packet_next->buf, packet->buf + offset, read_total);
+      packet_next->time_recv = packet->time_recv;
+      packet_release (packet);
+      packet = packet_next;
+      offset = 0;
+    } else if (read_total == 0) {
+      offset = 0;
+    }
+
+    packet->wsa_buf.buf = (char*)packet->buf + offset + read_total;
+    packet->wsa_buf.len = BUF_SIZE - offset - read_total;
+    read_num = 0;
+    goto next_packet;
+  }
+
+done:
+  if (trace) {
+    relay_ifaces_report();
+    poll_report (qpc_now() - time_start);
+  }
+  relay_ifaces_close();
+  route_release();
+  if (packet != NULL) packet_release (packet);
+  free (fwd_table);
+  fwd_table = NULL;
+  fwd_table_sz = 0;
+}
+
+/* -----------------------------------------------------------------------------
+// I/O completion port engine.
+//
+// Several receives are kept posted on the listening socket, so bursts
+// are not dropped while previous packets are relayed, and completions
+// are processed by a pool of worker threads. The workers take the relay
+// targets from the routing snapshot, without locking anything but
+// the queues of the interfaces they relay to. */
+static BOOL iocp_recv (relay_packet* const packet)
+{
+  DWORD read_num, flags = 0;
+
+  memset (&packet->ovlp, 0, sizeof(packet->ovlp));
+  packet->wsa_buf.buf = (char*)packet->buf;
+  packet->wsa_buf.len = BUF_SIZE;
+  packet->refs = 1;
+
+  InterlockedIncrement (&iocp_pending);
+
+  if (WSARecv (sock_listen, &packet->wsa_buf, 1u, &read_num, &flags
+  , &packet->ovlp, NULL) == SOCKET_ERROR) {
+    if (WSAGetLastError() != WSA_IO_PENDING) {
+      InterlockedDecrement (&iocp_pending);
+      pool_put (packet);
+      if (!iocp_stopping) {
+        msg_error (L"Error listening on the broadcast socket.");
+        fail = TRUE;
+        SetEvent (evnt_stop);
+      }
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+/* Keep the receive depth: every completed receive is replaced
+// with a new one right away if the pool has a buffer to spare,
+// otherwise as soon as some buffer is released */
+static void iocp_recv_next (void)
+{
+  relay_packet* const packet = pool_get();
+  if (packet != NULL) iocp_recv (packet);
+  else InterlockedIncrement (&iocp_missing);
+}
+
+static BOOL iocp_refill (relay_packet* const packet)
+{
+  LONG missing = iocp_missing;
+
+  while (missing > 0 && !iocp_stopping) {
+    LONG const prev = InterlockedCompareExchange (&iocp_missing
+    , missing - 1, missing);
+    if (prev == missing) {
+      /* Reuse the buffer straight away */
+      iocp_recv (packet);
+      return TRUE;
+    }
+    missing = prev;
+  }
+
+  return FALSE;
+}
+
+/* Relay a datagram received by the I/O completion port
+// or handed over to a shard worker */
+static void relay_process (relay_packet* const packet, DWORD const read_num
+, shard_worker* const worker)
+{
+  const unsigned char* const buf = packet->buf;
+
+  metrics_local->captured++;
+  metrics_local->captured_bytes += read_num;
+
+  /* Raw socket delivers a whole datagram at a time */
+  relay_hdr hdr;
+
+  if (!relay_parse (buf, read_num, &hdr)) {
+    metrics_local->dropped[DROP_MALFORMED]++;
+    return;
+  }
+
+  capture_inbound (buf, read_num);
+
+  /* Packets we don't care about don't get any further */
+  if (!filter_pass (&hdr)) return;
+
+  /* Refresh the routing snapshot only when something has changed */
+  if (!route_notify || InterlockedExchange (&route_dirty, FALSE)) {
+    if (!route_update()) {
+      fail = TRUE;
+      SetEvent (evnt_stop);
+      return;
+    }
+  }
+
+  const route_snapshot* const snap = route_enter();
+  ULONG const addr_route = snap->addr_route;
+
+  /* Diagnostics */
+  if (trace) trace_packet (&hdr, addr_route);
+  if (unicast_ports_on) unicast_learn (snap, &hdr);
+
+  /* Got broadcast packet from the preferred route
+  // which we haven't relayed already? */
+  if (!relay_wanted (&hdr, addr_route, addr_broadcast)
+  && !mcast_wanted (&hdr, addr_route)) {
+    metrics_local->dropped[DROP_IGNORED]++;
+  } else if (!dedup_seen (hdr.udp, hdr.size, hdr.addr_src) && !beacon_held (&hdr)
+  && rate_pass (hdr.addr_src, hdr.port_dst)) {
+    /* Queue the packet on all interfaces at once */
+    relay_fanout (snap, packet, hdr.udp, hdr.size, hdr.addr_dst, worker);
+    tunnel_put (&hdr);
+  }
+
+  route_leave();
+}
 
-    /* Couldn't find */
-    if (metric == 0) {
-      free (addresses);
-      return FALSE;
-    }
+/* Send completions go back to the interface they were queued on,
+// unless it has been closed since */
+static void iocp_sent (relay_send* const send, BOOL const ok, DWORD const num)
+{
+  relay_iface* const iface = &relay_ifaces[send->slot];
+
+  AcquireSRWLockExclusive (&iface->lock);
+
+  if (iocp_stopping || iface->gen != send->gen) {
+    packet_release (send->packet);
+  } else {
+    relay_iface_complete (iface, send, ok, num);
+    relay_iface_kick (iface);
+    WakeAllConditionVariable (&iface->room);
   }
 
-  /* Update metric values */
-  r = addresses;
+  ReleaseSRWLockExclusive (&iface->lock);
+}
 
-  while (r != NULL) {
-    if ((r->IfType != IF_TYPE_ETHERNET_CSMACD)
-    &&  (r->IfType != IF_TYPE_IEEE80211)) {
-      r = r->Next;
+static DWORD WINAPI iocp_worker (LPVOID const param)
+{
+  metrics_local = &metrics_shards[1 + (DWORD)(ULONG_PTR)param];
+
+  while (TRUE) {
+    DWORD num;
+    ULONG_PTR key;
+    LPOVERLAPPED ovlp;
+
+    BOOL const ok = GetQueuedCompletionStatus (iocp, &num, &key, &ovlp, INFINITE);
+
+    if (ovlp == NULL) {
+      if (!ok || key == IOCP_KEY_STOP) break;
       continue;
     }
 
-    if (_wcsicmp (iface, r->FriendlyName) != 0) {
-      MIB_IPINTERFACE_ROW iface_row;
-      InitializeIpInterfaceEntry (&iface_row);
-      iface_row.InterfaceLuid = r->Luid;
-      iface_row.Family = AF_INET;
+    InterlockedDecrement (&iocp_pending);
 
-      if (manual) {
-        iface_row.UseAutomaticMetric = FALSE;
-        iface_row.Metric = r->Ipv4Metric + metric;
-      } else {
-        iface_row.UseAutomaticMetric = TRUE;
-      }
+    if (key == IOCP_KEY_RECV) {
+      relay_packet* const packet = CONTAINING_RECORD (ovlp, relay_packet, ovlp);
+      packet->time_recv = qpc_now();
 
-      SetIpInterfaceEntry (&iface_row);
+      /* The receive reference is held until all sends are posted */
+      if (!iocp_stopping) {
+        iocp_recv_next();
+        if (ok) relay_process (packet, num, NULL);
+      }
+      packet_release (packet);
+    } else if (key == IOCP_KEY_SEND) {
+      iocp_sent (CONTAINING_RECORD (ovlp, relay_send, ovlp), ok, num);
     }
-
-    r = r->Next;
   }
 
-  free (addresses);
-  return TRUE;
+  return 0;
 }
 
-/* -------------------------------------------------------------------------- */
+static void broadcast_iocp (void)
+{
+  HANDLE threads[IOCP_THREADS_MAX];
+  DWORD threads_num = 0;
+
+  iocp_stopping = FALSE;
+  iocp_pending = 0;
+  iocp_missing = 0;
+
+  /* One worker per processor by default */
+  if (iocp_threads == 0) {
+    SYSTEM_INFO sys_info;
+    GetSystemInfo (&sys_info);
+    iocp_threads = sys_info.dwNumberOfProcessors;
+    if (iocp_threads > IOCP_THREADS_MAX) iocp_threads = IOCP_THREADS_MAX;
+    if (iocp_threads == 0) iocp_threads = 1;
+  }
 
-static void svc_report (DWORD, DWORD, DWORD);
+  iocp = CreateIoCompletionPort (INVALID_HANDLE_VALUE, NULL, 0, iocp_threads);
 
-static BOOL already_stopped;
+  if (iocp == NULL
+  || CreateIoCompletionPort ((HANDLE)sock_listen, iocp, IOCP_KEY_RECV, 0) == NULL) {
+    msg_error (L"Error creating the I/O completion port.");
+    fail = TRUE;
+    goto done;
+  }
 
-static void signal_handler (int const signum)
-{
-  if (already_stopped) return;
-  already_stopped = TRUE;
-  if (trace) {
-    set_text_color (3);
-    wprintf (L"Exiting on signal: %d\n", signum);
-    set_text_color (7);
+  /* Start the workers */
+  for (; threads_num < iocp_threads; ++threads_num) {
+    threads[threads_num] = CreateThread (NULL, 0, iocp_worker
+    , (LPVOID)(ULONG_PTR)threads_num, 0, NULL);
+
+    if (threads[threads_num] == NULL) {
+      msg_error (L"Error creating worker threads.");
+      fail = TRUE;
+      goto done;
+    }
   }
-  if (!SetEvent (evnt_stop)) {
-    if (trace) {
-      set_text_color (4);
-      wprintf (L"`SetEvent()` failed: %u\n", (unsigned)GetLastError());
-      set_text_color (7);
+
+  /* Keep a number of receives posted at all times */
+  for (DWORD i = 0; i < iocp_depth; ++i) {
+    relay_packet* const packet = pool_get();
+    if (packet == NULL) {
+      InterlockedIncrement (&iocp_missing);
+      continue;
     }
-    /* Calling `WSACleanup()` from signal handler causes deadlock */
-    ExitProcess (EXIT_FAILURE);
+    if (!iocp_recv (packet)) goto done;
+  }
+
+  /* Ctrl+C */
+  WaitForSingleObject (evnt_stop, INFINITE);
+
+done:
+  iocp_stopping = TRUE;
+
+  /* Stop the workers */
+  for (DWORD i = 0; i < threads_num; ++i) {
+    PostQueuedCompletionStatus (iocp, 0, IOCP_KEY_STOP, NULL);
+  }
+  if (threads_num != 0) {
+    WaitForMultipleObjects (threads_num, threads, TRUE, INFINITE);
+  }
+  for (DWORD i = 0; i < threads_num; ++i) {
+    CloseHandle (threads[i]);
+  }
+
+  /* Cancel everything in flight and wait for it to come back
+  // before the buffers are released */
+  CancelIoEx ((HANDLE)sock_listen, NULL);
+  if (trace) relay_ifaces_report();
+  relay_ifaces_close();
+  route_release();
+
+  while (iocp != NULL && iocp_pending > 0) {
+    DWORD num;
+    ULONG_PTR key;
+    LPOVERLAPPED ovlp;
+
+    if (!GetQueuedCompletionStatus (iocp, &num, &key, &ovlp, 1000)
+    && ovlp == NULL) break;
+    if (ovlp != NULL) InterlockedDecrement (&iocp_pending);
+  }
+
+  free (fwd_table);
+  fwd_table = NULL;
+  fwd_table_sz = 0;
+
+  if (iocp != NULL) {
+    CloseHandle (iocp);
+    iocp = NULL;
   }
 }
 
-static void broadcast_loop (void)
+/* -----------------------------------------------------------------------------
+// Sharded engine.
+//
+// A dispatcher thread receives the datagrams and hands each one over
+// to a worker by the hash of its flow (source address, source port
+// and destination port), so packets of a flow are relayed in order
+// while different flows are relayed on different processors. Every
+// worker has a ring of its own, with a single producer and a single
+// consumer, and sends on relay sockets of its own. When the ring
+// of a worker is full, packets for it are dropped. */
+static DWORD WINAPI shard_run (LPVOID const param)
 {
-  unsigned char buf[BUF_SIZE];
-  const char opt_broadcast = 1;
+  DWORD const index = (DWORD)(ULONG_PTR)param;
+  shard_worker* const worker = &shard_workers[index];
+  HANDLE const evnts[] = {evnt_stop, worker->evnt};
 
-  SOCKADDR_IN sa_addr_dst = {0};
-  sa_addr_dst.sin_family = AF_INET;
-  sa_addr_dst.sin_addr.s_addr = addr_broadcast;
+  metrics_local = &metrics_shards[1 + index];
 
-  sockaddr_gen sa_addr_broadcast = {0};
-  sa_addr_broadcast.Address.sa_family = AF_INET;
-  sa_addr_broadcast.AddressIn.sin_addr.s_addr = addr_broadcast;
+  while (TRUE) {
+    LONG const head = worker->head;
+
+    if (head == worker->tail) {
+      /* Tell the dispatcher before going to sleep, then look again */
+      InterlockedExchange (&worker->waiting, TRUE);
+      if (head == worker->tail
+      && WaitForMultipleObjects (numof(evnts), evnts, FALSE, INFINITE) == WAIT_OBJECT_0) break;
+      InterlockedExchange (&worker->waiting, FALSE);
+      continue;
+    }
 
-  ULONG fwd_table_sz = 0;
-  PMIB_IPFORWARDTABLE fwd_table = NULL;
+    MemoryBarrier();
+    relay_packet* const packet = worker->ring[head & (SHARD_RING_SIZE - 1)];
+    InterlockedExchange (&worker->head, head + 1);
 
-  WSABUF wsa_buf = {0};
-  wsa_buf.buf = (char*)buf;
-  wsa_buf.len = sizeof(buf);
+    /* The dispatcher leaves the datagram size in the buffer descriptor */
+    DWORD const read_num = packet->wsa_buf.len;
+    LONGLONG const time_start = qpc_now();
 
-  DWORD code, flags;
-  DWORD read_num, read_total, to_read;
-  DWORD write_num, write_total;
-  ULONG addr_src, addr_dst;
+    relay_process (packet, read_num, worker);
+    packet_release (packet);
 
-  read_total = 0;
-  to_read = IP_HEADER_SIZE + UDP_HEADER_SIZE;
+    worker->packets++;
+    worker->bytes += read_num;
+    worker->busy += qpc_now() - time_start;
+  }
 
-  while (TRUE) {
-    flags = 0;
-    code = WSARecv (sock_listen, &wsa_buf, 1u, &read_num, &flags
-    , &ovlp_read, NULL);
+  shard_close (worker);
+  return 0;
+}
 
-    if (code == SOCKET_ERROR) {
-      if (WSAGetLastError() != WSA_IO_PENDING) {
-        msg_error (L"Error listening on the broadcast socket.");
-        fail = TRUE;
-        goto done;
-      }
+/* Hand a datagram over to the worker of its flow */
+static void shard_dispatch (relay_packet* const packet, DWORD const read_num)
+{
+  relay_hdr hdr;
+  DWORD hash = 0;
 
-      HANDLE evnts_read[] = {evnt_read, evnt_stop};
-      DWORD const wait = WSAWaitForMultipleEvents (numof(evnts_read), evnts_read
-      , FALSE, INFINITE, FALSE);
+  /* Malformed ones are counted by whichever worker gets them */
+  if (relay_parse (packet->buf, read_num, &hdr)) {
+    hash = (DWORD)((hdr.addr_src ^ ((ULONG)hdr.port_src << 16 | hdr.port_dst)) * 2654435761u);
+  }
 
-      /* Ctrl+C */
-      if (wait - WAIT_OBJECT_0 == 1) goto done;
+  shard_worker* const worker = &shard_workers[((ULONGLONG)hash * shard_workers_num) >> 32];
+  LONG const tail = worker->tail;
+  DWORD const depth = (DWORD)(tail - worker->head);
 
-      DWORD nul;
-      WSAGetOverlappedResult (sock_listen, &ovlp_read, &read_num, FALSE, &nul);
-    }
+  if (depth == SHARD_RING_SIZE) {
+    worker->dropped++;
+    metrics_local->captured++;
+    metrics_local->captured_bytes += read_num;
+    metrics_local->dropped[DROP_SHARD]++;
+    packet_release (packet);
+    return;
+  }
 
-    /* Wait until we have a complete UDP datagram */
-    read_total += read_num;
+  if (depth + 1 > worker->depth_max) worker->depth_max = depth + 1;
 
-next_packet:
-    if (read_total < to_read) {
-      wsa_buf.buf += read_num;
-      wsa_buf.len -= read_num;
-      continue;
-    }
+  packet->wsa_buf.len = read_num;
+  worker->ring[tail & (SHARD_RING_SIZE - 1)] = packet;
+  InterlockedExchange (&worker->tail, tail + 1);
 
-#ifndef NDEBUG
-    wprintf (L"[DEBUG] Source address: %.8X\n", (unsigned)ntohl(*(ULONG*)(buf + IP_ADDR_SRC_POS)));
-    wprintf (L"[DEBUG] Destination address: %.8X\n", (unsigned)ntohl(*(ULONG*)(buf + IP_ADDR_DST_POS)));
-    wprintf (L"[DEBUG] Source port: %u\n", (unsigned)ntohs(*(WORD*)(buf + IP_HEADER_SIZE)));
-    wprintf (L"[DEBUG] Destination port: %u\n", (unsigned)ntohs(*(WORD*)(buf + IP_HEADER_SIZE + 2)));
-    wprintf (L"[DEBUG] Size: %u\n", (unsigned)ntohs(*(WORD*)(buf + IP_HEADER_SIZE + UDP_LENGTH_POS)));
-    wprintf (L"[DEBUG] Checksum: %x\n", (unsigned)ntohs(*(WORD*)(buf + IP_HEADER_SIZE + UDP_CHECKSUM_POS)));
-#endif
+  if (worker->waiting) SetEvent (worker->evnt);
+}
 
-    DWORD const packet_size = ntohs(*(WORD*)(buf + IP_HEADER_SIZE + UDP_LENGTH_POS));
-    to_read = IP_HEADER_SIZE + packet_size;
+/* The dispatcher waits for the workers to let go of some buffer */
+static relay_packet* shard_packet_get (void)
+{
+  relay_packet* packet;
 
-    if (read_total < to_read) {
-      wsa_buf.buf = (char*)buf + read_total;
-      wsa_buf.len = sizeof(buf) - read_total;
-      continue;
-    }
+  while ((packet = pool_get()) == NULL) {
+    /* Ctrl+C */
+    if (WaitForSingleObject (evnt_stop, 1) == WAIT_OBJECT_0) return NULL;
+  }
 
-    /* Get the packet addresses */
-    addr_src = *(ULONG*)(buf + IP_ADDR_SRC_POS);
-    addr_dst = *(ULONG*)(buf + IP_ADDR_DST_POS);
+  return packet;
+}
 
-    /* Find out the preferred broadcast route */
-    sockaddr_gen sa_addr_route = {0};
+static BOOL shard_recv (relay_packet* const packet)
+{
+  DWORD read_num, flags = 0;
 
-    if (WSAIoctl (sock_listen, SIO_ROUTING_INTERFACE_QUERY, &sa_addr_broadcast
-    , sizeof(sa_addr_broadcast), &sa_addr_route, sizeof(sa_addr_route)
-    , &flags, NULL, NULL) == SOCKET_ERROR) {
-      if (!((WSAGetLastError() == WSAENETUNREACH) || (WSAGetLastError() == WSAEHOSTUNREACH)
-      ||    (WSAGetLastError() == WSAENETDOWN))) {
-        msg_error (L"Couldn't get the preferred broadcast route.");
-        fail = TRUE;
-        goto done;
-      }
-    }
+  packet->wsa_buf.buf = (char*)packet->buf;
+  packet->wsa_buf.len = BUF_SIZE;
+  WSAResetEvent (evnt_read);
 
-    ULONG const addr_route = sa_addr_route.AddressIn.sin_addr.s_addr;
+  if (WSARecv (sock_listen, &packet->wsa_buf, 1u, &read_num, &flags
+  , &ovlp_read, NULL) == SOCKET_ERROR && WSAGetLastError() != WSA_IO_PENDING) {
+    msg_error (L"Error listening on the broadcast socket.");
+    return FALSE;
+  }
 
-    /* Diagnostics */
-    if (trace) {
-      const int main_color = (addr_src == addr_route && addr_dst == addr_broadcast) ? 2 : 8;
-      set_text_color (main_color);
-      wprintf (L"Source: ");
-      set_text_color (6);
-      wprintf (L"%u.%u.%u.%u", addr_src & 0xFF, (addr_src >> 8) & 0xFF
-      , (addr_src >> 16) & 0xFF, (addr_src >> 24) & 0xFF);
-      set_text_color (main_color);
-      wprintf (L" | Destination: ");
-      set_text_color (6);
-      wprintf (L"%u.%u.%u.%u", addr_dst & 0xFF, (addr_dst >> 8) & 0xFF
-      , (addr_dst >> 16) & 0xFF, (addr_dst >> 24) & 0xFF);
-      set_text_color (main_color);
-      wprintf (L" | Preferred: ");
-      set_text_color (6);
-      wprintf (L"%u.%u.%u.%u", addr_route & 0xFF, (addr_route >> 8) & 0xFF
-      , (addr_route >> 16) & 0xFF, (addr_route >> 24) & 0xFF);
-      set_text_color (main_color);
-      wprintf (L" | Size: ");
-      set_text_color (5);
-      wprintf (L"%u\n", packet_size);
-      set_text_color (7);
-    }
+  /* Even if it completed right away, the result is picked up later */
+  return TRUE;
+}
 
-    /* Got broadcast packet from the preferred route? */
-    if (addr_src == addr_route && addr_dst == addr_broadcast) {
-      /* Get the forwarding table */
-      int i = 0;
+/* Load of every worker, to help sizing them */
+static void shard_report (void)
+{
+  ULONGLONG total = 0;
+  for (DWORD i = 0; i < shard_workers_num; ++i) total += shard_workers[i].packets;
 
-      while ((code = GetIpForwardTable (fwd_table, &fwd_table_sz
-      , FALSE)) != NO_ERROR) {
-        ++i;
+  for (DWORD i = 0; i < shard_workers_num; ++i) {
+    const shard_worker* const worker = &shard_workers[i];
+    set_text_color (3);
+    wprintf (L"Worker %u: %llu packets (%.1f%%), %llu bytes, %.3f s busy"
+    L", %u queued at most, %llu dropped\n"
+    , (unsigned)i, worker->packets
+    , total != 0 ? worker->packets * 100.0 / total : 0.0
+    , worker->bytes, (double)worker->busy / qpc_freq.QuadPart
+    , (unsigned)worker->depth_max, worker->dropped);
+    set_text_color (7);
+  }
+}
 
-        if (code == ERROR_INSUFFICIENT_BUFFER && i < METRIC_CHANGE_TRIES_MAX) {
-          fwd_table = realloc (fwd_table, fwd_table_sz);
-          continue;
-        }
+static void broadcast_shards (void)
+{
+  metrics_local = &metrics_shards[0];
+
+  DWORD threads_num = 0;
+  relay_packet* packet = NULL;
+
+  /* One worker per processor by default */
+  if (shard_workers_num == 0) {
+    SYSTEM_INFO sys_info;
+    GetSystemInfo (&sys_info);
+    shard_workers_num = sys_info.dwNumberOfProcessors;
+    if (shard_workers_num > IOCP_THREADS_MAX) shard_workers_num = IOCP_THREADS_MAX;
+    if (shard_workers_num == 0) shard_workers_num = 1;
+  }
 
-        msg_error (L"Error getting the forwarding table.");
-        fail = TRUE;
-        goto done;
-      }
+  /* Start the workers */
+  for (; threads_num < shard_workers_num; ++threads_num) {
+    shard_worker* const worker = &shard_workers[threads_num];
+    worker->evnt = CreateEventW (NULL, FALSE, FALSE, NULL);
+    worker->thread = worker->evnt == NULL ? NULL
+    : CreateThread (NULL, 0, shard_run, (LPVOID)(ULONG_PTR)threads_num, 0, NULL);
 
-      /* Find other network interfaces to relay from */
-      for (i = 0; i < fwd_table->dwNumEntries; ++i) {
-        /* Only local routes with final destination */
-        if (fwd_table->table[i].dwForwardType != MIB_IPROUTE_TYPE_DIRECT) continue;
-        /* Netmask must be 255.255.255.255 */
-        if (fwd_table->table[i].dwForwardMask != ULONG_MAX) continue;
-        /* Destination must be 255.255.255.255 */
-        if (fwd_table->table[i].dwForwardDest != addr_broadcast) continue;
-        /* Local address must not be 0.0.0.0 */
-        if (fwd_table->table[i].dwForwardNextHop == 0) continue;
-        /* Local address must not be 127.0.0.1 */
-        if (fwd_table->table[i].dwForwardNextHop == addr_localhost) continue;
-        /* Local address must not be preferred route */
-        if (fwd_table->table[i].dwForwardNextHop == addr_src) continue;
-
-        /* Create the new source socket (not the preferred route) */
-        ULONG const addr_src_new = fwd_table->table[i].dwForwardNextHop;
-        SOCKET const sock_src_new = WSASocketW (AF_INET, SOCK_RAW, IPPROTO_UDP
-        , NULL, 0, WSA_FLAG_OVERLAPPED);
-
-        if (sock_src_new == INVALID_SOCKET) {
-          msg_error (L"Couldn't create the new source socket.");
-          goto skip_failed_iface;
-        }
+    if (worker->thread == NULL) {
+      msg_error (L"Error creating worker threads.");
+      fail = TRUE;
+      goto done;
+    }
+  }
 
-        /* Bind it to the next interface and send broadcast packet from it */
-        SOCKADDR_IN sa_addr_src_new = {0};
-        sa_addr_src_new.sin_family = AF_INET;
-        sa_addr_src_new.sin_addr.s_addr = addr_src_new;
+  packet = shard_packet_get();
+  if (packet == NULL) goto done;
 
-        if (bind (sock_src_new, (SOCKADDR*)&sa_addr_src_new
-        , sizeof(sa_addr_src_new)) == SOCKET_ERROR) {
-          msg_error (L"Couldn't bind to the new source socket.");
-          goto skip_failed_iface;
-        }
+  if (!shard_recv (packet)) {
+    fail = TRUE;
+    goto done;
+  }
 
-        if (setsockopt (sock_src_new, SOL_SOCKET, SO_BROADCAST
-        , &opt_broadcast, sizeof(opt_broadcast)) == SOCKET_ERROR) {
-          msg_error (L"`setsockopt()` failed on the new source socket.");
-          goto skip_failed_iface;
-        }
+  while (TRUE) {
+    HANDLE evnts[] = {evnt_stop, evnt_read};
+    DWORD const wait = WSAWaitForMultipleEvents (numof(evnts), evnts
+    , FALSE, INFINITE, FALSE);
 
-        /* Send the packet */
-        wsa_buf.buf = (char*)(buf + IP_HEADER_SIZE);
-        write_total = wsa_buf.len = packet_size;
-
-        /* Recompute UDP header checksum */
-        udp_chksum ((unsigned char*)wsa_buf.buf, packet_size
-        , sa_addr_src_new.sin_addr.s_addr, sa_addr_dst.sin_addr.s_addr);
-
-        while (TRUE) {
-          code = WSASendTo (sock_src_new, &wsa_buf, 1u, &write_num, 0
-          , (SOCKADDR*)&sa_addr_dst, sizeof(sa_addr_dst)
-          , &ovlp_write, NULL);
-
-          if (code == SOCKET_ERROR) {
-            if (WSAGetLastError() != WSA_IO_PENDING) {
-              set_text_color (4);
-              wprintf (L"Error relaying packet to ");
-              set_text_color (6);
-              wprintf (L"%u.%u.%u.%u\n"
-              ,  addr_src_new        & 0xFF
-              , (addr_src_new >> 8)  & 0xFF
-              , (addr_src_new >> 16) & 0xFF
-              , (addr_src_new >> 24) & 0xFF);
-              set_text_color (7);
-              goto skip_failed_iface;
-            }
-
-            HANDLE evnts_write[] = {evnt_write, evnt_stop};
-            DWORD const wait = WSAWaitForMultipleEvents (numof(evnts_write), evnts_write
-            , FALSE, INFINITE, FALSE);
-
-            /* Ctrl+C */
-            if (wait - WAIT_OBJECT_0 == 1) {
-              closesocket (sock_src_new);
-              goto done;
-            }
-
-            DWORD nul;
-            WSAGetOverlappedResult (sock_src_new, &ovlp_write, &write_num, FALSE, &nul);
-          }
+    /* Ctrl+C */
+    if (wait == WAIT_OBJECT_0) break;
 
-          write_total -= write_num;
-          if (write_total == 0) break;
-          wsa_buf.buf += write_num;
-          wsa_buf.len -= write_num;
-        }
+    DWORD read_num, nul;
+    BOOL const ok = WSAGetOverlappedResult (sock_listen, &ovlp_read
+    , &read_num, FALSE, &nul);
+    relay_packet* const packet_recv = packet;
+    packet_recv->time_recv = qpc_now();
 
-        /* Diagnostics */
-        if (trace) {
-          wprintf (L"Relayed ");
-          set_text_color (5);
-          wprintf (L"%u", packet_size);
-          set_text_color (7);
-          wprintf (L" bytes to ");
-          set_text_color (6);
-          wprintf (L"%u.%u.%u.%u\n"
-          ,  addr_src_new        & 0xFF
-          , (addr_src_new >> 8)  & 0xFF
-          , (addr_src_new >> 16) & 0xFF
-          , (addr_src_new >> 24) & 0xFF);
-          set_text_color (7);
-        }
+    /* Get the next receive going before handing this one over */
+    packet = shard_packet_get();
 
-skip_failed_iface:
-        closesocket (sock_src_new);
-      }
+    if (packet == NULL || !shard_recv (packet)) {
+      packet_release (packet_recv);
+      if (packet != NULL) fail = TRUE;
+      goto done;
     }
 
-    read_total -= IP_HEADER_SIZE + packet_size;
-    to_read = IP_HEADER_SIZE + UDP_HEADER_SIZE;
-    memmove (buf, buf + IP_HEADER_SIZE + packet_size, read_total);
-    wsa_buf.buf = (char*)buf;
-    wsa_buf.len = sizeof(buf);
-    read_num = read_total;
-    goto next_packet;
+    if (ok) shard_dispatch (packet_recv, read_num);
+    else packet_release (packet_recv);
   }
 
 done:
-  HeapFree (GetProcessHeap(), 0, fwd_table);
+  /* Stop the workers */
+  SetEvent (evnt_stop);
+  for (DWORD i = 0; i < threads_num; ++i) {
+    WaitForSingleObject (shard_workers[i].thread, INFINITE);
+    CloseHandle (shard_workers[i].thread);
+    shard_workers[i].thread = NULL;
+  }
+
+  /* Let go of what they didn't get to */
+  for (DWORD i = 0; i < shard_workers_num; ++i) {
+    shard_worker* const worker = &shard_workers[i];
+    while (worker->head != worker->tail) {
+      packet_release (worker->ring[worker->head++ & (SHARD_RING_SIZE - 1)]);
+    }
+    if (worker->evnt != NULL) {
+      CloseHandle (worker->evnt);
+      worker->evnt = NULL;
+    }
+  }
+
+  if (packet != NULL) {
+    CancelIoEx ((HANDLE)sock_listen, &ovlp_read);
+    WSAWaitForMultipleEvents (1, &evnt_read, FALSE, 1000, FALSE);
+    packet_release (packet);
+  }
+
+  if (trace) {
+    relay_ifaces_report();
+    shard_report();
+  }
+  relay_ifaces_close();
+  route_release();
+  free (fwd_table);
+  fwd_table = NULL;
+  fwd_table_sz = 0;
 }
 
 static void broadcast_start (void)
 {
+  QueryPerformanceFrequency (&qpc_freq);
+
+  /* Compile filter rules */
+  if (!filter_load()) {
+    fail = TRUE;
+    return;
+  }
+
   /* Initialize Winsock */
   WORD const wsa_ver = MAKEWORD (2, 2);
   WSADATA wsa_data = {0};
@@ -569,9 +4800,8 @@ static void broadcast_start (void)
   /* Create structures for overlapped I/O */
   evnt_stop = CreateEventW (NULL, TRUE, FALSE, NULL);
   evnt_read = CreateEventW (NULL, TRUE, FALSE, NULL);
-  evnt_write = CreateEventW (NULL, TRUE, FALSE, NULL);
 
-  if (evnt_stop == NULL || evnt_read == NULL || evnt_write == NULL) {
+  if (evnt_stop == NULL || evnt_read == NULL) {
     msg_error (L"Error creating asynchronous events.");
     closesocket (sock_listen);
     WSACleanup();
@@ -580,26 +4810,84 @@ static void broadcast_start (void)
   }
 
   ovlp_read.hEvent = evnt_read;
-  ovlp_write.hEvent = evnt_write;
+
+  /* Allocate packet buffers up front */
+  if (pool_size == 0) {
+    pool_size = use_iocp ? iocp_depth * POOL_SIZE_PER_RECV : POOL_SIZE_MIN * 2;
+    /* Full queues hold on to buffers too, as do the rings of shard workers */
+    pool_size += use_shards ? SHARD_RING_SIZE * 4 : relay_queue_len;
+    if (pool_size > POOL_SIZE_MAX) pool_size = POOL_SIZE_MAX;
+  }
+
+  if (!pool_init() || !dedup_init() || !beacon_init()) {
+    msg_error (L"Error allocating packet buffers.");
+    dedup_release();
+    pool_release();
+    CloseHandle (evnt_stop);
+    CloseHandle (evnt_read);
+    closesocket (sock_listen);
+    WSACleanup();
+    fail = TRUE;
+    return;
+  }
 
   /* Enter the broadcast loop */
   if (trace) {
     set_text_color (3);
     wprintf (APP_TITLE L" " APP_VERSION);
     set_text_color (7);
-    wprintf (L" is ready.\n");
+    wprintf (L" is ready (%hs checksum).\n", chksum_name());
     set_text_color (6);
     _putws (L"https://buymeacoff.ee/ubihazard\n");
     set_text_color (7);
   }
   service_status = SERVICE_RUNNING;
   svc_report (SERVICE_RUNNING, NO_ERROR, 0);
-  broadcast_loop();
+  route_notify_start();
+  metrics_thread = CreateThread (NULL, 0, metrics_server, NULL, 0, NULL);
+  if (!trace_start() || !capture_start() || !tunnel_start() || !mcast_start()) fail = TRUE;
+  else if (use_shards) broadcast_shards();
+  else if (use_iocp) broadcast_iocp();
+  else broadcast_loop();
+  if (metrics_thread != NULL) {
+    SetEvent (evnt_stop);
+    WaitForSingleObject (metrics_thread, INFINITE);
+    CloseHandle (metrics_thread);
+    metrics_thread = NULL;
+  }
+  mcast_stop();
+  tunnel_stop();
+  capture_stop();
+  trace_stop();
+  route_notify_stop();
+
+  /* Pool occupancy, to help sizing it */
+  if (trace) {
+    set_text_color (3);
+    wprintf (L"Packet pool: %u buffers, %ld in use at most, %ld times exhausted\n"
+    , (unsigned)pool_size, pool_used_max, pool_misses);
+    metrics_shard sum;
+    metrics_sum (&sum);
+    if (filter_path != NULL) {
+      wprintf (L"Filter: %llu packets rejected\n", sum.dropped[DROP_FILTER]);
+    }
+    if (dedup_table != NULL) {
+      wprintf (L"Duplicates: %llu dropped (%u entries, %u ms window)\n"
+      , sum.dropped[DROP_DUPLICATE], (unsigned)dedup_size, (unsigned)dedup_window);
+    }
+    set_text_color (7);
+    beacon_report();
+    rate_report();
+    stage_report();
+  }
 
   /* Cleanup */
+  relay_filter_release (&filter);
+  dedup_release();
+  beacon_release();
+  pool_release();
   CloseHandle (evnt_stop);
   CloseHandle (evnt_read);
-  CloseHandle (evnt_write);
   closesocket (sock_listen);
   WSACleanup();
 }
@@ -724,6 +5012,16 @@ static BOOL is_admin (void)
   return ret;
 }
 
+static BOOL parse_num (const wchar_t* const str, DWORD const min
+, DWORD const max, DWORD* const num)
+{
+  wchar_t* end;
+  unsigned long const val = wcstoul (str, &end, 10);
+  if (end == str || *end != L'\0' || val < min || val > max) return FALSE;
+  *num = val;
+  return TRUE;
+}
+
 /* ========================================================================== */
 
 int wmain (int argc, wchar_t** argv)
@@ -800,16 +5098,195 @@ int wmain (int argc, wchar_t** argv)
       argc--;
       argv++;
 
-      if (argc > 1) {
-        fail = TRUE;
-        goto usage;
-      }
-      if (argc == 1) {
-        trace = _wcsicmp (L"-d", argv[0]) == 0;
-        if (!trace) {
+      /* Relay options */
+      while (argc) {
+        if (_wcsicmp (L"-d", argv[0]) == 0) {
+          trace = TRUE;
+        } else if (_wcsicmp (L"-e", argv[0]) == 0) {
+          use_iocp = FALSE;
+        } else if (_wcsicmp (L"-spin", argv[0]) == 0 && argc > 1) {
+          if (!poll_parse (argv[1])) {
+            fail = TRUE;
+            goto usage;
+          }
+          use_iocp = FALSE;
+          argc--;
+          argv++;
+        } else if (_wcsicmp (L"-r", argv[0]) == 0 && argc > 1) {
+          if (!parse_num (argv[1], 1, IOCP_DEPTH_MAX, &iocp_depth)) {
+            fail = TRUE;
+            goto usage;
+          }
+          argc--;
+          argv++;
+        } else if (_wcsicmp (L"-p", argv[0]) == 0 && argc > 1) {
+          if (!parse_num (argv[1], POOL_SIZE_MIN, POOL_SIZE_MAX, &pool_size)) {
+            fail = TRUE;
+            goto usage;
+          }
+          argc--;
+          argv++;
+        } else if (_wcsicmp (L"-q", argv[0]) == 0 && argc > 1) {
+          if (!parse_num (argv[1], 1, RELAY_QUEUE_MAX, &relay_queue_len)) {
+            fail = TRUE;
+            goto usage;
+          }
+          argc--;
+          argv++;
+        } else if (_wcsicmp (L"-o", argv[0]) == 0 && argc > 1) {
+          if (_wcsicmp (L"oldest", argv[1]) == 0) {
+            relay_queue_policy = RELAY_DROP_OLDEST;
+          } else if (_wcsicmp (L"newest", argv[1]) == 0) {
+            relay_queue_policy = RELAY_DROP_NEWEST;
+          } else if (_wcsicmp (L"block", argv[1]) == 0) {
+            relay_queue_policy = RELAY_BLOCK;
+          } else {
+            fail = TRUE;
+            goto usage;
+          }
+          argc--;
+          argv++;
+        } else if (_wcsicmp (L"-l", argv[0]) == 0 && argc > 2) {
+          rate_level level;
+          if (_wcsicmp (L"source", argv[1]) == 0) level = RATE_SOURCE;
+          else if (_wcsicmp (L"port", argv[1]) == 0) level = RATE_PORT;
+          else if (_wcsicmp (L"iface", argv[1]) == 0) level = RATE_IFACE;
+          else {
+            fail = TRUE;
+            goto usage;
+          }
+          if (!rate_parse (argv[2], &rate_limits[level])) {
+            fail = TRUE;
+            goto usage;
+          }
+          argc -= 2;
+          argv += 2;
+        } else if (_wcsicmp (L"-c", argv[0]) == 0 && argc > 1) {
+          capture_path = argv[1];
+          argc--;
+          argv++;
+        } else if (_wcsicmp (L"-z", argv[0]) == 0 && argc > 2) {
+          if (!parse_num (argv[1], 1, CAPTURE_SIZE_MAX, &capture_size_max)
+          || !parse_num (argv[2], 1, CAPTURE_FILES_MAX, &capture_files_max)) {
+            fail = TRUE;
+            goto usage;
+          }
+          argc -= 2;
+          argv += 2;
+        } else if (_wcsicmp (L"-u", argv[0]) == 0 && argc > 1) {
+          if (!unicast_parse_ports (argv[1])) {
+            fail = TRUE;
+            goto usage;
+          }
+          argc--;
+          argv++;
+        } else if (_wcsicmp (L"-g", argv[0]) == 0 && argc > 1) {
+          if (!unicast_parse_peer (argv[1])) {
+            fail = TRUE;
+            goto usage;
+          }
+          argc--;
+          argv++;
+        } else if (_wcsicmp (L"-a", argv[0]) == 0 && argc > 1) {
+          if (!parse_num (argv[1], 1, UNICAST_AGE_MAX, &unicast_age)) {
+            fail = TRUE;
+            goto usage;
+          }
+          argc--;
+          argv++;
+        } else if (_wcsicmp (L"-hold", argv[0]) == 0 && argc > 2) {
+          if (!beacon_parse (argv[1], argv[2])) {
+            fail = TRUE;
+            goto usage;
+          }
+          argc -= 2;
+          argv += 2;
+        } else if (_wcsicmp (L"-mcast", argv[0]) == 0 && argc > 1) {
+          if (!mcast_parse_group (argv[1])) {
+            fail = TRUE;
+            goto usage;
+          }
+          argc--;
+          argv++;
+        } else if (_wcsicmp (L"-n", argv[0]) == 0 && argc > 1) {
+          if (!tunnel_parse_peer (argv[1])) {
+            fail = TRUE;
+            goto usage;
+          }
+          argc--;
+          argv++;
+        } else if (_wcsicmp (L"-k", argv[0]) == 0 && argc > 1) {
+          if (!parse_num (argv[1], 1, 65535, &tunnel_port)) {
+            fail = TRUE;
+            goto usage;
+          }
+          argc--;
+          argv++;
+        } else if (_wcsicmp (L"-y", argv[0]) == 0 && argc > 1) {
+          if (!parse_num (argv[1], 0, TUNNEL_WINDOW_MAX, &tunnel_window)) {
+            fail = TRUE;
+            goto usage;
+          }
+          argc--;
+          argv++;
+        } else if (_wcsicmp (L"-j", argv[0]) == 0 && argc > 1) {
+          trace = TRUE;
+          trace_path = argv[1];
+          argc--;
+          argv++;
+        } else if (_wcsicmp (L"-v", argv[0]) == 0 && argc > 1) {
+          if (!parse_num (argv[1], 1, METRICS_INTERVAL_MAX, &metrics_interval)) {
+            fail = TRUE;
+            goto usage;
+          }
+          argc--;
+          argv++;
+        } else if (_wcsicmp (L"-f", argv[0]) == 0 && argc > 1) {
+          filter_path = argv[1];
+          argc--;
+          argv++;
+        } else if (_wcsicmp (L"-w", argv[0]) == 0 && argc > 1) {
+          if (!parse_num (argv[1], 0, DEDUP_WINDOW_MAX, &dedup_window)) {
+            fail = TRUE;
+            goto usage;
+          }
+          argc--;
+          argv++;
+        } else if (_wcsicmp (L"-s", argv[0]) == 0 && argc > 1) {
+          if (!parse_num (argv[1], DEDUP_PROBES_MAX, DEDUP_SIZE_MAX, &dedup_size)) {
+            fail = TRUE;
+            goto usage;
+          }
+          argc--;
+          argv++;
+        } else if (_wcsicmp (L"-t", argv[0]) == 0 && argc > 1) {
+          if (!parse_num (argv[1], 1, IOCP_THREADS_MAX, &iocp_threads)) {
+            fail = TRUE;
+            goto usage;
+          }
+          argc--;
+          argv++;
+        } else if (_wcsicmp (L"-workers", argv[0]) == 0 && argc > 1) {
+          if (!parse_num (argv[1], 0, IOCP_THREADS_MAX, &shard_workers_num)) {
+            fail = TRUE;
+            goto usage;
+          }
+          use_shards = TRUE;
+          argc--;
+          argv++;
+        } else {
           fail = TRUE;
           goto usage;
         }
+        argc--;
+        argv++;
+      }
+
+      /* Only one engine can be chosen */
+      if (use_shards && !use_iocp) {
+        msg_error (L"The `-workers` option can't be combined with `-e` or `-spin`.\n");
+        fail = TRUE;
+        goto usage;
       }
 
       broadcast_start();
@@ -836,12 +5313,80 @@ usage:
 "If `-m` option is omitted, all metric changes\n"
 "are reverted to automatic system-managed values.\n"
 "\n"
-"%s -b [-d]:\n"
+"%s -b [-d] [-e] [-spin <us>[:<cpu>]] [-r <receives>] [-t <threads>] [-workers <n>]\n"
+"   [-p <buffers>] [-q <length>] [-o oldest|newest|block] [-w <ms>] [-s <entries>]\n"
+"   [-f <rules>] [-l source|port|iface <rate>[/<burst>]] [-v <seconds>]\n"
+"   [-j <file>] [-c <file>] [-z <MiB> <files>]\n"
+"   [-n <address>[:<port>]] [-k <port>] [-y <ms>]\n"
+"   [-u <port>[-<port>]] [-g <address>] [-a <seconds>]\n"
+"   [-mcast <group>[@<address>]] [-hold <port>[-<port>] <ms>]:\n"
 "\n"
 "Start IPv4 UDP broadcast relaying.\n"
 "\n"
 "The `-d` option enables diagnostic messages to help verify\n"
-"that broadcast is actually working.\n"
+"that broadcast is actually working. The `-j` option writes\n"
+"per packet messages to a file instead of the console.\n"
+"\n"
+"Packets are received and relayed on an I/O completion port\n"
+"by `-t` worker threads (one per processor by default)\n"
+"with `-r` receives kept posted at all times (16 by default).\n"
+"The `-e` option selects the single-threaded event loop instead.\n"
+"With `-spin`, the event loop spins for up to so many microseconds\n"
+"before it blocks, pinned to a processor and at a higher priority.\n"
+"The `-workers` option selects the sharded engine: a dispatcher hands\n"
+"packets over to so many workers (0 for one per processor)\n"
+"by source address and ports, so that every flow stays in order.\n"
+"It can't be combined with `-e` or `-spin`.\n"
+"\n"
+"Packets are received into a pool of `-p` buffers allocated\n"
+"at startup (4 per receive by default). Pool occupancy\n"
+"is reported on exit with `-d`.\n"
+"\n"
+"Every interface has its own queue of `-q` packets (64 by\n"
+"default). When it's full, `-o` drops the oldest (default)\n"
+"or the newest packet, or blocks until there is room.\n"
+"\n"
+"Packets relayed in the last `-w` milliseconds (100 by default,\n"
+"0 to disable) are dropped if seen again. Up to `-s` of them\n"
+"are remembered (4096 by default).\n"
+"\n"
+"The `-hold` option holds down announcements to the given ports:\n"
+"a packet identical to one relayed from the same source less than\n"
+"so many milliseconds ago is not relayed. It can be given once\n"
+"for each port or range of ports.\n"
+"\n"
+"The `-f` option reads filter rules from a file, one per line:\n"
+"`allow|deny port <port>[-<port>]`, `allow|deny from <address>[/<bits>]`\n"
+"or `allow|deny to <address>[/<bits>]`. Later rules win.\n"
+"\n"
+"The `-l` option limits the rate of packets per second\n"
+"from each source address, to each port or to each relay\n"
+"interface, with bursts of up to one second by default.\n"
+"It can be given once for each of them.\n"
+"\n"
+"Relay metrics are served in Prometheus text format\n"
+"on the `\\\\.\\pipe\\BROADcast` named pipe. The `-v` option\n"
+"also prints a summary every so many seconds.\n"
+"\n"
+"The `-c` option captures received and relayed packets\n"
+"to a pcapng file. With `-z`, a new file is started every\n"
+"so many MiB, and only the given number of files is kept.\n"
+"\n"
+"The `-n` option sends relayed packets over UDP to a peer\n"
+"instance, which broadcasts them on its side. It can be given\n"
+"for up to 16 peers, and every peer lists all the others.\n"
+"Peers listen on the `-k` port (45454 by default). Packets\n"
+"within `-y` milliseconds (5 by default) are sent together.\n"
+"\n"
+"Broadcasts to `-u` ports are sent as unicast copies to the hosts\n"
+"seen using those ports on each relay interface (and to `-g`\n"
+"addresses), forgetting hosts silent for `-a` seconds (300 by\n"
+"default). Both can be given more than once.\n"
+"\n"
+"The `-mcast` option relays a multicast group too, but only to\n"
+"interfaces with members, as told by IGMP reports or by\n"
+"the address of an interface after `@`. It can be given\n"
+"for up to 32 groups.\n"
 "\n"
 "Options can be combined into a single command line,\n"
 "but the broadcast (`-b`) option must be specified last,\n"
@@ -0,0 +1,699 @@
+/* =============================================================================
+// BROADcast
+//
+// Force IPv4 UDP broadcast on all network interfaces on Linux.
+//
+// https://buymeacoff.ee/ubihazard
+// -------------------------------------------------------------------------- */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <ifaddrs.h>
+#include <linux/filter.h>
+#include <linux/if_packet.h>
+#include <net/if_arp.h>
+#include <linux/rtnetlink.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "chksum.h"
+#include "relay.h"
+#include "tc_relay.h"
+
+/* -------------------------------------------------------------------------- */
+
+#define APP_TITLE "BROADcast"
+#define APP_VERSION "1.1"
+
+#define numof(a) (sizeof(a) / sizeof((a)[0]))
+
+/* Relay interfaces at most */
+#define RELAY_IFACES_MAX 64
+
+/* Packets are captured into a ring of blocks shared with the kernel,
+// which are handed over whole: one wakeup for many packets */
+#define RING_BLOCK_SIZE (256 * 1024)
+#define RING_BLOCKS 16
+#define RING_FRAME_SIZE 2048
+
+/* Partially filled blocks are handed over after this long (in milliseconds) */
+#define RING_BLOCK_TIMEOUT 1
+
+/* Datagrams sent to an interface with a single `sendmmsg()` */
+#define SEND_BATCH 64
+
+/* -------------------------------------------------------------------------- */
+
+typedef struct relay_iface {
+  uint32_t addr;
+  int sock;
+  int ifindex;
+  char name[IF_NAMESIZE];
+  /* Relayed to by the eBPF program */
+  bool in_kernel;
+  unsigned char mac[6];
+  /* Metrics */
+  uint64_t relayed;
+  uint64_t relayed_bytes;
+  uint64_t send_errors;
+} relay_iface;
+
+/* Datagrams of the current block waiting to be relayed */
+typedef struct relay_batch {
+  relay_hdr hdrs[SEND_BATCH];
+  uint32_t bases[SEND_BATCH];
+  unsigned num;
+  /* Scratch space for the sends */
+  unsigned char headers[SEND_BATCH][UDP_HEADER_SIZE];
+  struct iovec iovs[SEND_BATCH][2];
+  struct mmsghdr msgs[SEND_BATCH];
+} relay_batch;
+
+/* -------------------------------------------------------------------------- */
+
+static bool trace;
+static bool in_kernel;
+static volatile sig_atomic_t stop;
+
+static uint32_t const addr_broadcast = INADDR_BROADCAST;
+static uint32_t addr_route;
+static int route_ifindex;
+static int ring_ifindex;
+
+static relay_iface relay_ifaces[RELAY_IFACES_MAX];
+static unsigned relay_ifaces_num;
+static relay_batch batch;
+
+static int sock_ring = -1;
+static unsigned char* ring_map;
+static unsigned ring_block;
+static int sock_notify = -1;
+
+static uint64_t captured;
+static uint64_t captured_bytes;
+static uint64_t dropped_malformed;
+static uint64_t dropped_ignored;
+
+/* -------------------------------------------------------------------------- */
+
+static void signal_handler (int const signum)
+{
+  (void)signum;
+  stop = 1;
+}
+
+static void print_addr_to (FILE* const out, uint32_t const addr)
+{
+  const unsigned char* const b = (const unsigned char*)&addr;
+  fprintf (out, "%u.%u.%u.%u", b[0], b[1], b[2], b[3]);
+}
+
+static void msg_error (const char* const msg)
+{
+  fprintf (stderr, "%s: %s\n", msg, strerror (errno));
+}
+
+/* -----------------------------------------------------------------------------
+// Relayed datagrams go out through raw sockets, one per interface,
+// so that the source port is kept and the stack builds the IP header
+// with the interface address. Each batch is sent with one system call. */
+static int relay_socket (const relay_iface* const iface)
+{
+  /* A raw socket gets a copy of every UDP datagram received: filter them all out */
+  static struct sock_filter none[] = {
+    BPF_STMT (BPF_RET | BPF_K, 0)
+  };
+  struct sock_fprog const prog = {numof(none), none};
+  int const on = 1, off = 0;
+
+  int const sock = socket (AF_INET, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_UDP);
+  if (sock < 0) return -1;
+
+  struct sockaddr_in sa = {
+    .sin_family = AF_INET,
+    .sin_addr.s_addr = iface->addr
+  };
+
+  if (setsockopt (sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) != 0
+  || setsockopt (sock, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on)) != 0
+  /* Local applications already got the original */
+  || setsockopt (sock, IPPROTO_IP, IP_MULTICAST_LOOP, &off, sizeof(off)) != 0
+  || setsockopt (sock, SOL_SOCKET, SO_BINDTODEVICE, iface->name, strlen (iface->name)) != 0
+  || bind (sock, (struct sockaddr*)&sa, sizeof(sa)) != 0) {
+    close (sock);
+    return -1;
+  }
+
+  return sock;
+}
+
+static void relay_batch_flush (void)
+{
+  static struct sockaddr_in const sa = {
+    .sin_family = AF_INET,
+    .sin_addr.s_addr = INADDR_BROADCAST
+  };
+
+  if (batch.num == 0) return;
+
+  for (unsigned i = 0; i < relay_ifaces_num; ++i) {
+    relay_iface* const iface = &relay_ifaces[i];
+    if (iface->sock < 0) continue;
+
+    /* Source address changes the checksum */
+    for (unsigned j = 0; j < batch.num; ++j) {
+      const relay_hdr* const hdr = &batch.hdrs[j];
+      relay_rewrite (batch.headers[j], hdr->udp, batch.bases[j], iface->addr);
+
+      batch.iovs[j][0].iov_base = batch.headers[j];
+      batch.iovs[j][0].iov_len = UDP_HEADER_SIZE;
+      batch.iovs[j][1].iov_base = (void*)(hdr->udp + UDP_HEADER_SIZE);
+      batch.iovs[j][1].iov_len = hdr->size - UDP_HEADER_SIZE;
+
+      memset (&batch.msgs[j], 0, sizeof(batch.msgs[j]));
+      batch.msgs[j].msg_hdr.msg_name = (void*)&sa;
+      batch.msgs[j].msg_hdr.msg_namelen = sizeof(sa);
+      batch.msgs[j].msg_hdr.msg_iov = batch.iovs[j];
+      batch.msgs[j].msg_hdr.msg_iovlen = 2;
+    }
+
+    unsigned sent = 0;
+
+    while (sent < batch.num) {
+      int const r = sendmmsg (iface->sock, batch.msgs + sent, batch.num - sent, 0);
+
+      if (r < 0) {
+        if (errno == EINTR) continue;
+
+        if (trace) {
+          fprintf (stderr, "Error relaying packet to ");
+          print_addr_to (stderr, iface->addr);
+          fprintf (stderr, ": %s\n", strerror (errno));
+        }
+
+        /* Skip the datagram which failed */
+        iface->send_errors++;
+        sent++;
+        continue;
+      }
+
+      for (int j = 0; j < r; ++j) iface->relayed_bytes += batch.msgs[sent + j].msg_len;
+      iface->relayed += r;
+      sent += r;
+    }
+  }
+
+  batch.num = 0;
+}
+
+/* Datagram as sent by the preferred interface, IP header first */
+static void relay_datagram (const unsigned char* const buf, uint32_t const len)
+{
+  captured++;
+  captured_bytes += len;
+
+  /* No IP options, and whole datagrams only */
+  if (len < IP_HEADER_SIZE || buf[0] != 0x45 || buf[9] != IPPROTO_UDP
+  || (((buf[6] << 8) | buf[7]) & 0x3FFF) != 0) {
+    dropped_malformed++;
+    return;
+  }
+
+  relay_hdr hdr;
+
+  if (!relay_parse (buf, len, &hdr)) {
+    dropped_malformed++;
+    return;
+  }
+
+  if (!relay_wanted (&hdr, addr_route, addr_broadcast)) {
+    dropped_ignored++;
+    return;
+  }
+
+  batch.hdrs[batch.num] = hdr;
+  batch.bases[batch.num] = relay_chksum_base (hdr.udp, hdr.size, hdr.addr_dst);
+  if (++batch.num == SEND_BATCH) relay_batch_flush();
+}
+
+/* -----------------------------------------------------------------------------
+// Broadcast packets sent through the preferred interface are captured
+// into a `TPACKET_V3` ring mapped into our memory. The kernel fills
+// whole blocks of packets and hands them over: everything in a block
+// is relayed before the block is given back, with no copies made and
+// no system calls per packet. Outgoing packets are only seen by sockets
+// listening to all protocols: a socket filter lets only outgoing
+// IPv4 UDP broadcast into the ring. */
+static bool ring_open (void)
+{
+  /* Offsets are from the IP header: the link header is stripped */
+  static struct sock_filter code[] = {
+    /* IPv4 */
+    BPF_STMT (BPF_LD | BPF_H | BPF_ABS, SKF_AD_OFF + SKF_AD_PROTOCOL),
+    BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 0, 7),
+    /* Sent by this host */
+    BPF_STMT (BPF_LD | BPF_H | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE),
+    BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, PACKET_OUTGOING, 0, 5),
+    /* UDP */
+    BPF_STMT (BPF_LD | BPF_B | BPF_ABS, 9),
+    BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 3),
+    /* To 255.255.255.255 */
+    BPF_STMT (BPF_LD | BPF_W | BPF_ABS, IP_ADDR_DST_POS),
+    BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, 0xFFFFFFFF, 0, 1),
+    BPF_STMT (BPF_RET | BPF_K, 0xFFFFFFFF),
+    BPF_STMT (BPF_RET | BPF_K, 0)
+  };
+  struct sock_fprog const prog = {numof(code), code};
+  int const version = TPACKET_V3;
+
+  struct tpacket_req3 req = {
+    .tp_block_size = RING_BLOCK_SIZE,
+    .tp_block_nr = RING_BLOCKS,
+    .tp_frame_size = RING_FRAME_SIZE,
+    .tp_frame_nr = RING_BLOCK_SIZE / RING_FRAME_SIZE * RING_BLOCKS,
+    .tp_retire_blk_tov = RING_BLOCK_TIMEOUT
+  };
+
+  /* Doesn't receive anything until bound to the preferred interface */
+  sock_ring = socket (AF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (sock_ring < 0) {
+    msg_error ("Error creating the capture socket");
+    return false;
+  }
+
+  if (setsockopt (sock_ring, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) != 0
+  || setsockopt (sock_ring, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) != 0
+  || setsockopt (sock_ring, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) != 0) {
+    msg_error ("Error setting up the capture ring");
+    return false;
+  }
+
+  ring_map = mmap (NULL, (size_t)RING_BLOCK_SIZE * RING_BLOCKS
+  , PROT_READ | PROT_WRITE, MAP_SHARED, sock_ring, 0);
+
+  if (ring_map == MAP_FAILED) {
+    ring_map = NULL;
+    msg_error ("Error mapping the capture ring");
+    return false;
+  }
+
+  return true;
+}
+
+static void ring_close (void)
+{
+  if (ring_map != NULL) munmap (ring_map, (size_t)RING_BLOCK_SIZE * RING_BLOCKS);
+  if (sock_ring >= 0) close (sock_ring);
+  ring_map = NULL;
+  sock_ring = -1;
+}
+
+/* Capture on another interface (or none at all) */
+static bool ring_bind (int const ifindex)
+{
+  struct sockaddr_ll sll = {
+    .sll_family = AF_PACKET,
+    .sll_protocol = ifindex != 0 ? htons (ETH_P_ALL) : 0,
+    .sll_ifindex = ifindex
+  };
+
+  if (bind (sock_ring, (struct sockaddr*)&sll, sizeof(sll)) != 0) {
+    msg_error ("Error binding the capture socket");
+    return false;
+  }
+
+  return true;
+}
+
+/* Relay all blocks the kernel is done with */
+static void ring_process (void)
+{
+  while (true) {
+    struct tpacket_block_desc* const block
+    = (struct tpacket_block_desc*)(ring_map + (size_t)ring_block * RING_BLOCK_SIZE);
+
+    if ((__atomic_load_n (&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE)
+    & TP_STATUS_USER) == 0) break;
+
+    const unsigned char* pkt = (const unsigned char*)block
+    + block->hdr.bh1.offset_to_first_pkt;
+
+    for (uint32_t i = 0; i < block->hdr.bh1.num_pkts; ++i) {
+      const struct tpacket3_hdr* const hdr = (const struct tpacket3_hdr*)pkt;
+      relay_datagram (pkt + hdr->tp_net, hdr->tp_snaplen);
+      pkt += hdr->tp_next_offset;
+    }
+
+    /* Datagrams point into the block: send them before giving it back */
+    relay_batch_flush();
+
+    __atomic_store_n (&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+    ring_block = (ring_block + 1) % RING_BLOCKS;
+  }
+}
+
+/* -----------------------------------------------------------------------------
+// The preferred route is whatever source address the stack picks
+// for a broadcast. Every other interface that is up gets relayed to,
+// once, using its first IPv4 address. */
+static uint32_t route_preferred (void)
+{
+  struct sockaddr_in sa = {
+    .sin_family = AF_INET,
+    .sin_port = htons (9),
+    .sin_addr.s_addr = INADDR_BROADCAST
+  };
+  socklen_t sa_len = sizeof(sa);
+  int const on = 1;
+  uint32_t addr = 0;
+
+  int const sock = socket (AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (sock < 0) return 0;
+
+  if (setsockopt (sock, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on)) == 0
+  && connect (sock, (struct sockaddr*)&sa, sizeof(sa)) == 0
+  && getsockname (sock, (struct sockaddr*)&sa, &sa_len) == 0) {
+    addr = sa.sin_addr.s_addr;
+  }
+
+  close (sock);
+  return addr;
+}
+
+static void relay_ifaces_close (void)
+{
+  for (unsigned i = 0; i < relay_ifaces_num; ++i) {
+    if (relay_ifaces[i].sock >= 0) close (relay_ifaces[i].sock);
+  }
+  relay_ifaces_num = 0;
+}
+
+static void relay_ifaces_report (void)
+{
+  for (unsigned i = 0; i < relay_ifaces_num; ++i) {
+    const relay_iface* const iface = &relay_ifaces[i];
+    printf ("Relay interface ");
+    print_addr_to (stdout, iface->addr);
+    if (iface->in_kernel) printf (" (%s): relayed in kernel\n", iface->name);
+    else printf (" (%s): %llu relayed, %llu bytes, %llu errors\n", iface->name
+    , (unsigned long long)iface->relayed, (unsigned long long)iface->relayed_bytes
+    , (unsigned long long)iface->send_errors);
+  }
+
+  if (in_kernel) {
+    tc_relay_counters counters;
+    tc_relay_read (&counters);
+    printf ("In kernel: %llu matched, %llu relayed, %llu errors\n"
+    , (unsigned long long)counters.matched, (unsigned long long)counters.relayed
+    , (unsigned long long)counters.errors);
+  }
+}
+
+/* Ethernet interface and its MAC address */
+static bool iface_ether (const char* const name, unsigned char* const mac)
+{
+  struct ifreq ifr;
+  memset (&ifr, 0, sizeof(ifr));
+  memcpy (ifr.ifr_name, name, strnlen (name, IF_NAMESIZE - 1));
+
+  int const sock = socket (AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  bool const ether = sock >= 0 && ioctl (sock, SIOCGIFHWADDR, &ifr) == 0
+  && ifr.ifr_hwaddr.sa_family == ARPHRD_ETHER;
+
+  if (ether && mac != NULL) memcpy (mac, ifr.ifr_hwaddr.sa_data, 6);
+  if (sock >= 0) close (sock);
+  return ether;
+}
+
+static bool route_refresh (void)
+{
+  struct ifaddrs* addrs;
+  relay_iface ifaces[RELAY_IFACES_MAX];
+  unsigned ifaces_num = 0;
+  int ifindex = 0;
+  char name[IF_NAMESIZE] = "none";
+
+  if (getifaddrs (&addrs) != 0) {
+    msg_error ("Error getting the interface addresses");
+    return false;
+  }
+
+  addr_route = route_preferred();
+
+  for (const struct ifaddrs* a = addrs; a != NULL; a = a->ifa_next) {
+    if (a->ifa_addr == NULL || a->ifa_addr->sa_family != AF_INET) continue;
+    if ((a->ifa_flags & IFF_UP) == 0 || (a->ifa_flags & IFF_LOOPBACK) != 0) continue;
+
+    uint32_t const addr = ((const struct sockaddr_in*)a->ifa_addr)->sin_addr.s_addr;
+
+    if (addr == addr_route) {
+      ifindex = if_nametoindex (a->ifa_name);
+      snprintf (name, sizeof(name), "%s", a->ifa_name);
+      continue;
+    }
+
+    if (!relay_target (INADDR_BROADCAST, UINT32_MAX, addr, true, addr_route)) continue;
+    if (ifaces_num == RELAY_IFACES_MAX) continue;
+
+    /* One address per interface, or every packet goes out several times */
+    unsigned i;
+    for (i = 0; i < ifaces_num; ++i) {
+      if (strcmp (ifaces[i].name, a->ifa_name) == 0) break;
+    }
+    if (i != ifaces_num) continue;
+
+    relay_iface* const iface = &ifaces[ifaces_num++];
+    memset (iface, 0, sizeof(*iface));
+    iface->addr = addr;
+    iface->sock = -1;
+    iface->ifindex = if_nametoindex (a->ifa_name);
+    snprintf (iface->name, sizeof(iface->name), "%s", a->ifa_name);
+  }
+
+  freeifaddrs (addrs);
+
+  /* Keep sockets and counters of interfaces that remain */
+  for (unsigned i = 0; i < ifaces_num; ++i) {
+    for (unsigned j = 0; j < relay_ifaces_num; ++j) {
+      relay_iface* const old = &relay_ifaces[j];
+      if (old->name[0] != '\0' && old->addr == ifaces[i].addr
+      && strcmp (old->name, ifaces[i].name) == 0) {
+        ifaces[i] = *old;
+        ifaces[i].in_kernel = false;
+        old->sock = -1;
+        old->name[0] = '\0';
+        break;
+      }
+    }
+  }
+
+  /* Ethernet to Ethernet is relayed in the kernel */
+  tc_relay_target targets[TC_RELAY_TARGETS_MAX];
+  unsigned targets_num = 0;
+  bool const offload = in_kernel && ifindex != 0 && iface_ether (name, NULL);
+
+  for (unsigned i = 0; i < ifaces_num && offload; ++i) {
+    relay_iface* const iface = &ifaces[i];
+    if (targets_num == TC_RELAY_TARGETS_MAX || !iface_ether (iface->name, iface->mac)) continue;
+    iface->in_kernel = true;
+    targets[targets_num].ifindex = iface->ifindex;
+    targets[targets_num].addr = iface->addr;
+    memcpy (targets[targets_num].mac, iface->mac, sizeof(iface->mac));
+    targets_num++;
+  }
+
+  if (in_kernel && (!tc_relay_update (addr_route, targets, targets_num)
+  || !tc_relay_attach (offload ? ifindex : 0))) {
+    msg_error ("Error attaching the in-kernel relay");
+    tc_relay_attach (0);
+    for (unsigned i = 0; i < ifaces_num; ++i) ifaces[i].in_kernel = false;
+  }
+
+  /* The rest is relayed from the capture ring */
+  bool ring_needed = false;
+
+  for (unsigned i = 0; i < ifaces_num; ++i) {
+    if (ifaces[i].in_kernel) {
+      if (ifaces[i].sock >= 0) close (ifaces[i].sock);
+      ifaces[i].sock = -1;
+      continue;
+    }
+
+    ring_needed = true;
+
+    if (ifaces[i].sock < 0) {
+      ifaces[i].sock = relay_socket (&ifaces[i]);
+      if (ifaces[i].sock < 0 && trace) {
+        fprintf (stderr, "Error opening relay socket for %s: %s\n"
+        , ifaces[i].name, strerror (errno));
+      }
+    }
+  }
+
+  relay_ifaces_close();
+  memcpy (relay_ifaces, ifaces, ifaces_num * sizeof(ifaces[0]));
+  relay_ifaces_num = ifaces_num;
+
+  route_ifindex = ifindex;
+
+  if ((ring_needed ? ifindex : 0) != ring_ifindex) {
+    if (!ring_bind (ring_needed ? ifindex : 0)) return false;
+    ring_ifindex = ring_needed ? ifindex : 0;
+  }
+
+  if (trace) {
+    printf ("Routes refreshed: preferred ");
+    print_addr_to (stdout, addr_route);
+    printf (" (%s), %u relay interface(s), %u in kernel\n", name
+    , relay_ifaces_num, targets_num);
+  }
+
+  return true;
+}
+
+/* Address and route changes only mark the routes stale */
+static bool route_notify_start (void)
+{
+  struct sockaddr_nl sa = {
+    .nl_family = AF_NETLINK,
+    .nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV4_ROUTE
+  };
+
+  sock_notify = socket (AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC
+  , NETLINK_ROUTE);
+
+  if (sock_notify < 0 || bind (sock_notify, (struct sockaddr*)&sa, sizeof(sa)) != 0) {
+    msg_error ("Error subscribing to route changes");
+    return false;
+  }
+
+  return true;
+}
+
+static void route_notify_drain (void)
+{
+  static char buf[16384];
+  /* Overflow (`ENOBUFS`) only means we have to refresh anyway */
+  while (recv (sock_notify, buf, sizeof(buf), 0) > 0 || errno == ENOBUFS);
+}
+
+/* -------------------------------------------------------------------------- */
+
+static void broadcast_loop (void)
+{
+  struct pollfd fds[] = {
+    {.fd = sock_ring, .events = POLLIN},
+    {.fd = sock_notify, .events = POLLIN}
+  };
+
+  while (!stop) {
+    ring_process();
+
+    if (poll (fds, numof(fds), -1) < 0) {
+      if (errno == EINTR) continue;
+      msg_error ("Error waiting for packets");
+      break;
+    }
+
+    if (fds[1].revents != 0) {
+      route_notify_drain();
+      route_refresh();
+    }
+  }
+}
+
+static int broadcast_start (void)
+{
+  struct sigaction act = {.sa_handler = signal_handler};
+  sigaction (SIGINT, &act, NULL);
+  sigaction (SIGTERM, &act, NULL);
+
+  bool ok = ring_open() && (!in_kernel || tc_relay_load())
+  && route_notify_start() && route_refresh();
+
+  if (ok) {
+    if (trace) printf ("Checksum: %s\n", chksum_name());
+    broadcast_loop();
+  }
+
+  if (trace) {
+    printf ("Captured %llu packets (%llu bytes), %llu malformed, %llu ignored\n"
+    , (unsigned long long)captured, (unsigned long long)captured_bytes
+    , (unsigned long long)dropped_malformed, (unsigned long long)dropped_ignored);
+    relay_ifaces_report();
+  }
+
+  if (in_kernel) tc_relay_unload();
+  relay_ifaces_close();
+  if (sock_notify >= 0) close (sock_notify);
+  ring_close();
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int main (int argc, char** argv)
+{
+  bool fail = false;
+
+  argc--;
+  argv++;
+  if (!argc) goto usage;
+
+  if (strcmp ("-b", argv[0]) == 0) {
+    /* Broadcast */
+    argc--;
+    argv++;
+
+    /* Relay options */
+    while (argc) {
+      if (strcmp ("-d", argv[0]) == 0) {
+        trace = true;
+      } else if (strcmp ("-x", argv[0]) == 0) {
+        in_kernel = true;
+      } else {
+        fail = true;
+        goto usage;
+      }
+      argc--;
+      argv++;
+    }
+
+    return broadcast_start();
+  }
+
+  fail = strcmp ("-h", argv[0]) != 0;
+
+usage:
+  puts (APP_TITLE " " APP_VERSION);
+  puts ("https://buymeacoff.ee/ubihazard\n");
+  puts ("Relay global UDP broadcast packets on all interfaces:\n"
+  "   -b [-d] [-x]\n"
+  "\n"
+  "Broadcast packets sent through the interface of the preferred\n"
+  "route are relayed to every other interface that is up.\n"
+  "The `-d` option reports route changes and prints counters on exit.\n"
+  "\n"
+  "The `-x` option relays between Ethernet interfaces in the kernel\n"
+  "with an eBPF program attached to the preferred interface,\n"
+  "which requires `CAP_NET_ADMIN` and `CAP_BPF` as well.\n"
+  "\n"
+  "Requires `CAP_NET_RAW`.");
+  return fail ? EXIT_FAILURE : EXIT_SUCCESS;
+}
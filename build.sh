@@ -0,0 +1,5 @@
+#!/bin/sh
+cd "$(dirname "$0")"
+
+# Build the Linux executable
+cc -O2 -std=gnu11 "$@" broadcast_linux.c chksum.c relay.c tc_relay.c -o broadcast
@@ -0,0 +1,189 @@
+/* =============================================================================
+// BROADcast
+//
+// Internet checksum kernels.
+//
+// https://buymeacoff.ee/ubihazard
+// -------------------------------------------------------------------------- */
+
+#include "chksum.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define CHKSUM_X86 1
+#include <immintrin.h>
+#endif
+
+/* -------------------------------------------------------------------------- */
+
+static inline uint16_t chksum_fold (uint64_t sum)
+{
+  sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+  sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+  sum = (sum & 0xFFFF) + (sum >> 16);
+  sum = (sum & 0xFFFF) + (sum >> 16);
+  sum = (sum & 0xFFFF) + (sum >> 16);
+  return (uint16_t)sum;
+}
+
+/* -----------------------------------------------------------------------------
+// Add 32-bit words into a 64-bit accumulator: carries pile up
+// in the upper half and are folded back at the very end */
+static uint64_t chksum_tail (const unsigned char* p, size_t sz, uint64_t sum)
+{
+  uint32_t w;
+
+  while (sz >= 4 * sizeof(w)) {
+    uint32_t w0, w1, w2, w3;
+    memcpy (&w0, p, sizeof(w0));
+    memcpy (&w1, p + 4, sizeof(w1));
+    memcpy (&w2, p + 8, sizeof(w2));
+    memcpy (&w3, p + 12, sizeof(w3));
+    sum += (uint64_t)w0 + w1 + w2 + w3;
+    p += 4 * sizeof(w);
+    sz -= 4 * sizeof(w);
+  }
+
+  while (sz >= sizeof(w)) {
+    memcpy (&w, p, sizeof(w));
+    sum += w;
+    p += sizeof(w);
+    sz -= sizeof(w);
+  }
+
+  /* Last bytes of data */
+  if (sz != 0) {
+    w = 0;
+    memcpy (&w, p, sz);
+    sum += w;
+  }
+
+  return sum;
+}
+
+uint16_t chksum_scalar (const void* const buf, size_t const sz)
+{
+  return chksum_fold (chksum_tail (buf, sz, 0));
+}
+
+/* -------------------------------------------------------------------------- */
+
+#ifdef CHKSUM_X86
+
+/* 16-bit words are widened to 32-bit lanes, which can take
+// this many additions before they may overflow */
+#define CHKSUM_BLOCK 0x8000
+
+__attribute__((target("sse2")))
+uint16_t chksum_sse2 (const void* const buf, size_t sz)
+{
+  const unsigned char* p = buf;
+  __m128i const zero = _mm_setzero_si128();
+  uint64_t sum = 0;
+
+  while (sz >= sizeof(__m128i)) {
+    __m128i acc = zero;
+    size_t n = sz / sizeof(__m128i);
+    if (n > CHKSUM_BLOCK) n = CHKSUM_BLOCK;
+    sz -= n * sizeof(__m128i);
+
+    while (n--) {
+      __m128i const v = _mm_loadu_si128 ((const __m128i*)p);
+      acc = _mm_add_epi32 (acc, _mm_unpacklo_epi16 (v, zero));
+      acc = _mm_add_epi32 (acc, _mm_unpackhi_epi16 (v, zero));
+      p += sizeof(__m128i);
+    }
+
+    /* Widen to 64 bits */
+    __m128i const acc64 = _mm_add_epi64 (_mm_unpacklo_epi32 (acc, zero)
+    , _mm_unpackhi_epi32 (acc, zero));
+    uint64_t lanes[2];
+    _mm_storeu_si128 ((__m128i*)lanes, acc64);
+    sum += lanes[0] + lanes[1];
+  }
+
+  return chksum_fold (chksum_tail (p, sz, sum));
+}
+
+__attribute__((target("avx2")))
+uint16_t chksum_avx2 (const void* const buf, size_t sz)
+{
+  const unsigned char* p = buf;
+  __m256i const zero = _mm256_setzero_si256();
+  uint64_t sum = 0;
+
+  while (sz >= sizeof(__m256i)) {
+    __m256i acc0 = zero, acc1 = zero;
+    size_t n = sz / sizeof(__m256i);
+    if (n > CHKSUM_BLOCK) n = CHKSUM_BLOCK;
+    sz -= n * sizeof(__m256i);
+
+    /* Two accumulators to hide the addition latency */
+    while (n >= 2) {
+      __m256i const v0 = _mm256_loadu_si256 ((const __m256i*)p);
+      __m256i const v1 = _mm256_loadu_si256 ((const __m256i*)p + 1);
+      acc0 = _mm256_add_epi32 (acc0, _mm256_unpacklo_epi16 (v0, zero));
+      acc0 = _mm256_add_epi32 (acc0, _mm256_unpackhi_epi16 (v0, zero));
+      acc1 = _mm256_add_epi32 (acc1, _mm256_unpacklo_epi16 (v1, zero));
+      acc1 = _mm256_add_epi32 (acc1, _mm256_unpackhi_epi16 (v1, zero));
+      p += 2 * sizeof(__m256i);
+      n -= 2;
+    }
+
+    if (n != 0) {
+      __m256i const v = _mm256_loadu_si256 ((const __m256i*)p);
+      acc0 = _mm256_add_epi32 (acc0, _mm256_unpacklo_epi16 (v, zero));
+      acc0 = _mm256_add_epi32 (acc0, _mm256_unpackhi_epi16 (v, zero));
+      p += sizeof(__m256i);
+    }
+
+    /* Widen to 64 bits */
+    __m256i const acc64 = _mm256_add_epi64 (
+      _mm256_add_epi64 (_mm256_unpacklo_epi32 (acc0, zero)
+      , _mm256_unpackhi_epi32 (acc0, zero))
+    , _mm256_add_epi64 (_mm256_unpacklo_epi32 (acc1, zero)
+      , _mm256_unpackhi_epi32 (acc1, zero)));
+    uint64_t lanes[4];
+    _mm256_storeu_si256 ((__m256i*)lanes, acc64);
+    sum += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  }
+
+  return chksum_fold (chksum_tail (p, sz, sum));
+}
+
+#else
+
+uint16_t chksum_sse2 (const void* const buf, size_t const sz)
+{
+  return chksum_scalar (buf, sz);
+}
+
+uint16_t chksum_avx2 (const void* const buf, size_t const sz)
+{
+  return chksum_scalar (buf, sz);
+}
+
+#endif
+
+/* -----------------------------------------------------------------------------
+// The kernel is picked while the program loads, before any
+// thread exists: the pointer is never written once they do */
+chksum_fn chksum_fast = chksum_scalar;
+
+__attribute__((constructor))
+static void chksum_select (void)
+{
+#ifdef CHKSUM_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports ("avx2")) chksum_fast = chksum_avx2;
+  else if (__builtin_cpu_supports ("sse2")) chksum_fast = chksum_sse2;
+#endif
+}
+
+const char* chksum_name (void)
+{
+  if (chksum_fast == chksum_avx2) return "AVX2";
+  if (chksum_fast == chksum_sse2) return "SSE2";
+  return "scalar";
+}
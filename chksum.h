@@ -0,0 +1,32 @@
+/* =============================================================================
+// BROADcast
+//
+// Internet checksum kernels.
+//
+// https://buymeacoff.ee/ubihazard
+// -------------------------------------------------------------------------- */
+
+#ifndef BROADCAST_CHKSUM_H
+#define BROADCAST_CHKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* -----------------------------------------------------------------------------
+// All kernels return the one's complement sum of the buffer
+// taken as 16-bit words in memory order, folded to 16 bits
+// but not complemented. Odd trailing byte is padded with zero.
+// The buffer doesn't need to be aligned. */
+typedef uint16_t (*chksum_fn) (const void* buf, size_t sz);
+
+uint16_t chksum_scalar (const void* buf, size_t sz);
+uint16_t chksum_sse2 (const void* buf, size_t sz);
+uint16_t chksum_avx2 (const void* buf, size_t sz);
+
+/* Fastest kernel supported by this CPU */
+extern chksum_fn chksum_fast;
+
+/* Kernel name for diagnostics */
+const char* chksum_name (void);
+
+#endif /* BROADCAST_CHKSUM_H */
@@ -0,0 +1,80 @@
+/* =============================================================================
+// BROADcast
+//
+// Epoch-based reclamation of a pointer read without locks.
+//
+// https://buymeacoff.ee/ubihazard
+// -------------------------------------------------------------------------- */
+
+#include <stdlib.h>
+
+#include "epoch.h"
+
+/* -----------------------------------------------------------------------------
+// The reader's epoch is stored before the object is loaded, and the writer
+// swaps the object before it reads the epochs of the readers. Both orders
+// are sequentially consistent, so whichever comes second sees the other. */
+const epoch_node* epoch_enter (epoch_domain* const dom, size_t const reader)
+{
+  uint64_t const epoch = __atomic_load_n (&dom->epoch, __ATOMIC_SEQ_CST);
+  __atomic_store_n (&dom->readers[reader].epoch, epoch, __ATOMIC_SEQ_CST);
+  return __atomic_load_n (&dom->current, __ATOMIC_SEQ_CST);
+}
+
+/* Reads of the object happen before the writer sees the reader gone */
+void epoch_leave (epoch_domain* const dom, size_t const reader)
+{
+  __atomic_store_n (&dom->readers[reader].epoch, 0, __ATOMIC_RELEASE);
+}
+
+const epoch_node* epoch_current (const epoch_domain* const dom)
+{
+  return __atomic_load_n (&dom->current, __ATOMIC_ACQUIRE);
+}
+
+static void epoch_reclaim (epoch_domain* const dom)
+{
+  uint64_t oldest = __atomic_load_n (&dom->epoch, __ATOMIC_SEQ_CST);
+
+  for (size_t i = 0; i < dom->readers_num; ++i) {
+    uint64_t const epoch = __atomic_load_n (&dom->readers[i].epoch, __ATOMIC_SEQ_CST);
+    if (epoch != 0 && epoch < oldest) oldest = epoch;
+  }
+
+  epoch_node** link = &dom->retired;
+
+  while (*link != NULL) {
+    epoch_node* const node = *link;
+    if (node->retired > oldest) {
+      link = &node->next;
+      continue;
+    }
+    *link = node->next;
+    free (node);
+  }
+}
+
+void epoch_publish (epoch_domain* const dom, epoch_node* const node)
+{
+  epoch_node* const prev = __atomic_exchange_n (&dom->current, node, __ATOMIC_SEQ_CST);
+
+  if (prev != dom->empty) {
+    prev->retired = __atomic_add_fetch (&dom->epoch, 1, __ATOMIC_SEQ_CST);
+    prev->next = dom->retired;
+    dom->retired = prev;
+  }
+
+  epoch_reclaim (dom);
+}
+
+void epoch_release (epoch_domain* const dom)
+{
+  if (dom->current != dom->empty) free (dom->current);
+  dom->current = dom->empty;
+
+  while (dom->retired != NULL) {
+    epoch_node* const node = dom->retired;
+    dom->retired = node->next;
+    free (node);
+  }
+}
@@ -0,0 +1,69 @@
+/* =============================================================================
+// BROADcast
+//
+// Epoch-based reclamation of a pointer read without locks.
+//
+// https://buymeacoff.ee/ubihazard
+// -------------------------------------------------------------------------- */
+
+#ifndef BROADCAST_EPOCH_H
+#define BROADCAST_EPOCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define EPOCH_LINE_SIZE 64
+
+/* -----------------------------------------------------------------------------
+// Object published through a domain. It comes first in the object,
+// which is allocated with `malloc()`, and is never changed once published. */
+typedef struct epoch_node {
+  struct epoch_node* next;
+  /* Reader epoch from which on it can't be seen anymore */
+  uint64_t retired;
+} epoch_node;
+
+/* Epoch a reader has entered at (zero between reads),
+// each in its own cache line */
+typedef struct epoch_reader {
+  _Alignas(EPOCH_LINE_SIZE) uint64_t epoch;
+} epoch_reader;
+
+/* The published object is swapped in whole, so the readers never see
+// a half-updated one, and never wait for the writer. A reader announces
+// the epoch it enters at before it picks up the object: an object retired
+// at a later epoch than the oldest one announced may still be in use,
+// older ones are freed. `empty` is published initially and never freed.
+// Writers (`epoch_publish()`, `epoch_release()`) are serialized
+// by the caller. */
+typedef struct epoch_domain {
+  epoch_node* current;
+  epoch_node* empty;
+  epoch_node* retired;
+  uint64_t epoch;
+  epoch_reader* readers;
+  size_t readers_num;
+} epoch_domain;
+
+#define EPOCH_DOMAIN_INIT(empty, readers, readers_num) \
+  {(empty), (empty), NULL, 1, (readers), (readers_num)}
+
+/* -------------------------------------------------------------------------- */
+
+/* Pick up the current object as reader number `reader` */
+const epoch_node* epoch_enter (epoch_domain* dom, size_t reader);
+void epoch_leave (epoch_domain* dom, size_t reader);
+
+/* Current object, without entering. Only for writers, or for threads
+// that hold whatever lock the writers take, so it can't be retired
+// while it's in use. */
+const epoch_node* epoch_current (const epoch_domain* dom);
+
+/* Publish `node`, retire the previous object and free the retired
+// objects nobody can see anymore */
+void epoch_publish (epoch_domain* dom, epoch_node* node);
+
+/* Free everything and publish `empty` again. The readers are gone. */
+void epoch_release (epoch_domain* dom);
+
+#endif /* BROADCAST_EPOCH_H */
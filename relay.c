@@ -0,0 +1,505 @@
+/* =============================================================================
+// BROADcast
+//
+// Platform-independent packet processing core.
+//
+// https://buymeacoff.ee/ubihazard
+// -------------------------------------------------------------------------- */
+
+#include "relay.h"
+#include "chksum.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* -----------------------------------------------------------------------------
+// Headers are read without assuming alignment: datagrams are parsed
+// right where they were received and may be unaligned */
+static inline uint16_t relay_get16 (const unsigned char* const p)
+{
+  return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t relay_get32_raw (const unsigned char* const p)
+{
+  uint32_t v;
+  memcpy (&v, p, sizeof(v));
+  return v;
+}
+
+/* 16-bit value in network byte order, as seen in memory */
+static inline uint16_t relay_net16 (uint16_t const v)
+{
+  const unsigned char b[2] = {(unsigned char)(v >> 8), (unsigned char)v};
+  uint16_t r;
+  memcpy (&r, b, sizeof(r));
+  return r;
+}
+
+/* -------------------------------------------------------------------------- */
+
+uint32_t relay_udp_size (const unsigned char* const buf)
+{
+  return relay_get16 (buf + IP_HEADER_SIZE + UDP_LENGTH_POS);
+}
+
+bool relay_parse (const unsigned char* const buf, size_t const len
+, relay_hdr* const hdr)
+{
+  if (len < IP_HEADER_SIZE + UDP_HEADER_SIZE) return false;
+
+  const unsigned char* const udp = buf + IP_HEADER_SIZE;
+  uint32_t const size = relay_get16 (udp + UDP_LENGTH_POS);
+  if (size < UDP_HEADER_SIZE || IP_HEADER_SIZE + (size_t)size > len) return false;
+
+  hdr->addr_src = relay_get32_raw (buf + IP_ADDR_SRC_POS);
+  hdr->addr_dst = relay_get32_raw (buf + IP_ADDR_DST_POS);
+  hdr->port_src = relay_get16 (udp + UDP_PORT_SRC_POS);
+  hdr->port_dst = relay_get16 (udp + UDP_PORT_DST_POS);
+  hdr->size = size;
+  hdr->udp = udp;
+  return true;
+}
+
+bool relay_wanted (const relay_hdr* const hdr, uint32_t const addr_route
+, uint32_t const addr_broadcast)
+{
+  return hdr->addr_src == addr_route && hdr->addr_dst == addr_broadcast;
+}
+
+/* -----------------------------------------------------------------------------
+// The sum is kept in network byte order, which works
+// because one's complement addition doesn't depend on byte order. */
+uint32_t relay_chksum_base (const unsigned char* const udp, size_t const sz
+, uint32_t const addr_dst)
+{
+  /* Compute data */
+  uint32_t chksum = chksum_fast (udp, sz);
+
+  /* Take away the checksum field itself */
+  uint16_t field;
+  memcpy (&field, udp + UDP_CHECKSUM_POS, sizeof(field));
+  chksum += ~field & 0xFFFF;
+
+  /* Destination address */
+  chksum += addr_dst >> 16;
+  chksum += addr_dst & 0xFFFF;
+
+  /* Protocol and payload size */
+  chksum += relay_net16 (17);
+  chksum += relay_net16 ((uint16_t)sz);
+
+  /* Fold */
+  chksum = (chksum & 0xFFFF) + (chksum >> 16);
+  chksum = (chksum & 0xFFFF) + (chksum >> 16);
+  return chksum;
+}
+
+uint16_t relay_chksum (uint32_t const base, uint32_t const addr_src)
+{
+  uint32_t chksum = base;
+
+  /* Source address */
+  chksum += addr_src >> 16;
+  chksum += addr_src & 0xFFFF;
+
+  /* Fold */
+  chksum = (chksum & 0xFFFF) + (chksum >> 16);
+  chksum = (chksum & 0xFFFF) + (chksum >> 16);
+  chksum = ~chksum & 0xFFFF;
+
+  /* Zero means "no checksum" */
+  return chksum == 0 ? 0xFFFF : (uint16_t)chksum;
+}
+
+uint32_t relay_chksum_redirect (uint32_t const base, uint32_t const addr_from
+, uint32_t const addr_to)
+{
+  uint32_t chksum = base;
+
+  /* Take the old address away and add the new one */
+  chksum += ~addr_from >> 16;
+  chksum += ~addr_from & 0xFFFF;
+  chksum += addr_to >> 16;
+  chksum += addr_to & 0xFFFF;
+
+  /* Fold */
+  chksum = (chksum & 0xFFFF) + (chksum >> 16);
+  chksum = (chksum & 0xFFFF) + (chksum >> 16);
+  return chksum;
+}
+
+void relay_rewrite (unsigned char* const header, const unsigned char* const udp
+, uint32_t const base, uint32_t const addr_src)
+{
+  memcpy (header, udp, UDP_HEADER_SIZE);
+
+  if (header[UDP_CHECKSUM_POS] != 0 || header[UDP_CHECKSUM_POS + 1] != 0) {
+    uint16_t const chksum = relay_chksum (base, addr_src);
+    memcpy (header + UDP_CHECKSUM_POS, &chksum, sizeof(chksum));
+  }
+}
+
+/* -------------------------------------------------------------------------- */
+
+bool relay_target (uint32_t const dest, uint32_t const mask
+, uint32_t const next_hop, bool const direct, uint32_t const addr_route)
+{
+  static const unsigned char loopback[4] = {127, 0, 0, 1};
+
+  /* Only local routes with final destination */
+  if (!direct) return false;
+  /* Netmask must be 255.255.255.255 */
+  if (mask != UINT32_MAX) return false;
+  /* Destination must be 255.255.255.255 */
+  if (dest != UINT32_MAX) return false;
+  /* Local address must not be 0.0.0.0 */
+  if (next_hop == 0) return false;
+  /* Local address must not be 127.0.0.1 */
+  if (next_hop == relay_get32_raw (loopback)) return false;
+  /* Local address must not be preferred route */
+  if (next_hop == addr_route) return false;
+
+  return true;
+}
+
+/* Masks and filter ranges are compared in host byte order */
+static inline uint32_t relay_host32 (uint32_t const v)
+{
+  unsigned char b[4];
+  memcpy (b, &v, sizeof(b));
+  return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3];
+}
+
+unsigned relay_targets (const relay_route* const routes, size_t const routes_num
+, uint32_t const addr_route, relay_allow_fn const allow, void* const ctx
+, uint32_t* const addrs, uint32_t* const nets, uint32_t* const masks, unsigned const max)
+{
+  unsigned num = 0;
+
+  /* Find other network interfaces to relay from */
+  for (size_t i = 0; i < routes_num && num < max; ++i) {
+    const relay_route* const route = &routes[i];
+    if (!relay_target (route->dest, route->mask, route->next_hop
+    , route->direct, addr_route)) continue;
+    if (allow != NULL && !allow (route->next_hop, ctx)) continue;
+
+    nets[num] = masks[num] = 0;
+    addrs[num++] = route->next_hop;
+  }
+
+  /* The subnet of a target is its narrowest other direct route */
+  for (size_t i = 0; i < routes_num; ++i) {
+    const relay_route* const route = &routes[i];
+    if (!route->direct) continue;
+    if (route->mask == 0 || route->mask == UINT32_MAX) continue;
+    /* Not the multicast route */
+    if (relay_multicast (route->dest)) continue;
+
+    for (unsigned j = 0; j < num; ++j) {
+      if (route->next_hop != addrs[j]) continue;
+      if (relay_host32 (route->mask) <= relay_host32 (masks[j])) continue;
+      nets[j] = route->dest & route->mask;
+      masks[j] = route->mask;
+    }
+  }
+
+  return num;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static int relay_filter_cmp (const void* const a, const void* const b)
+{
+  uint32_t const x = *(const uint32_t*)a;
+  uint32_t const y = *(const uint32_t*)b;
+  return (x > y) - (x < y);
+}
+
+/* Cut the address space at every rule boundary and decide
+// once for every piece, then merge equal neighbours */
+static bool relay_filter_table_compile (relay_filter_table* const table
+, const relay_filter_rule* const rules, size_t const rules_num
+, relay_filter_kind const kind)
+{
+  size_t num = 0, first_rule = rules_num;
+
+  for (size_t i = 0; i < rules_num; ++i) {
+    if (rules[i].kind != kind) continue;
+    if (first_rule == rules_num) first_rule = i;
+    num++;
+  }
+
+  /* No rules: everything is allowed */
+  if (num == 0) return true;
+
+  uint32_t* const cuts = malloc ((num * 2 + 1) * sizeof(*cuts));
+  if (cuts == NULL) return false;
+
+  size_t cuts_num = 0;
+  cuts[cuts_num++] = 0;
+
+  for (size_t i = first_rule; i < rules_num; ++i) {
+    if (rules[i].kind != kind) continue;
+    cuts[cuts_num++] = rules[i].first;
+    if (rules[i].last != UINT32_MAX) cuts[cuts_num++] = rules[i].last + 1;
+  }
+
+  qsort (cuts, cuts_num, sizeof(*cuts), relay_filter_cmp);
+
+  table->ranges = malloc (cuts_num * sizeof(*table->ranges));
+  if (table->ranges == NULL) {
+    free (cuts);
+    return false;
+  }
+
+  table->ranges_num = 0;
+
+  for (size_t i = 0; i < cuts_num; ++i) {
+    if (i != 0 && cuts[i] == cuts[i - 1]) continue;
+
+    /* The last matching rule wins */
+    bool allow = !rules[first_rule].allow;
+    for (size_t j = rules_num; j-- > first_rule;) {
+      if (rules[j].kind != kind) continue;
+      if (cuts[i] < rules[j].first || cuts[i] > rules[j].last) continue;
+      allow = rules[j].allow;
+      break;
+    }
+
+    if (table->ranges_num != 0
+    && table->ranges[table->ranges_num - 1].allow == allow) continue;
+
+    table->ranges[table->ranges_num].first = cuts[i];
+    table->ranges[table->ranges_num].allow = allow;
+    table->ranges_num++;
+  }
+
+  free (cuts);
+  return true;
+}
+
+static void relay_filter_ports_compile (relay_filter* const filter
+, const relay_filter_rule* const rules, size_t const rules_num)
+{
+  for (size_t i = 0; i < rules_num; ++i) {
+    if (rules[i].kind != RELAY_FILTER_PORT) continue;
+
+    /* Start from the opposite of the first rule */
+    if (!filter->ports_on) {
+      memset (filter->ports, rules[i].allow ? 0 : 0xFF, sizeof(filter->ports));
+      filter->ports_on = true;
+    }
+
+    for (uint32_t port = rules[i].first; port <= rules[i].last; ++port) {
+      if (rules[i].allow) filter->ports[port >> 3] |= 1u << (port & 7);
+      else filter->ports[port >> 3] &= ~(1u << (port & 7));
+    }
+  }
+}
+
+bool relay_filter_compile (relay_filter* const filter
+, const relay_filter_rule* const rules, size_t const rules_num)
+{
+  relay_filter_ports_compile (filter, rules, rules_num);
+
+  if (!relay_filter_table_compile (&filter->from, rules, rules_num, RELAY_FILTER_FROM)
+  || !relay_filter_table_compile (&filter->to, rules, rules_num, RELAY_FILTER_TO)) {
+    relay_filter_release (filter);
+    return false;
+  }
+
+  return true;
+}
+
+void relay_filter_release (relay_filter* const filter)
+{
+  free (filter->from.ranges);
+  free (filter->to.ranges);
+  memset (filter, 0, sizeof(*filter));
+}
+
+bool relay_filter_port (const relay_filter* const filter, uint16_t const port)
+{
+  return !filter->ports_on || (filter->ports[port >> 3] & (1u << (port & 7)));
+}
+
+/* Binary search for the range the address falls into */
+bool relay_filter_addr (const relay_filter_table* const table, uint32_t const addr)
+{
+  if (table->ranges_num == 0) return true;
+
+  uint32_t const host = relay_host32 (addr);
+  size_t lo = 0, hi = table->ranges_num;
+
+  while (hi - lo > 1) {
+    size_t const mid = (lo + hi) / 2;
+    if (table->ranges[mid].first <= host) lo = mid;
+    else hi = mid;
+  }
+
+  return table->ranges[lo].allow;
+}
+
+/* -------------------------------------------------------------------------- */
+
+#define IGMP_V1_REPORT 0x12
+#define IGMP_V2_REPORT 0x16
+#define IGMP_V2_LEAVE 0x17
+#define IGMP_V3_REPORT 0x22
+#define IGMP_QUERY 0x11
+
+#define IGMP_V3_RECORD_SIZE 8
+
+/* IGMPv3 group record types */
+enum {
+  IGMP_MODE_IS_INCLUDE = 1,
+  IGMP_MODE_IS_EXCLUDE,
+  IGMP_CHANGE_TO_INCLUDE,
+  IGMP_CHANGE_TO_EXCLUDE,
+  IGMP_ALLOW_NEW_SOURCES,
+  IGMP_BLOCK_OLD_SOURCES
+};
+
+bool relay_multicast (uint32_t const addr)
+{
+  /* 224.0.0.0/4 */
+  const unsigned char* const b = (const unsigned char*)&addr;
+  return (b[0] & 0xF0) == 0xE0;
+}
+
+unsigned relay_igmp_parse (const unsigned char* const buf, size_t const len
+, relay_igmp* const records, unsigned const max)
+{
+  /* Reports carry the Router Alert option */
+  if (len < IP_HEADER_SIZE) return 0;
+  size_t const ihl = (size_t)(buf[0] & 0x0F) * 4;
+  if (ihl < IP_HEADER_SIZE || len < ihl + 8) return 0;
+
+  const unsigned char* const igmp = buf + ihl;
+  size_t const sz = len - ihl;
+  if (chksum_scalar (igmp, sz) != 0xFFFF) return 0;
+
+  switch (igmp[0]) {
+  case IGMP_V1_REPORT:
+  case IGMP_V2_REPORT:
+  case IGMP_V2_LEAVE: {
+    uint32_t const group = relay_get32_raw (igmp + 4);
+    if (max == 0 || !relay_multicast (group)) return 0;
+    records[0].group = group;
+    records[0].join = igmp[0] != IGMP_V2_LEAVE;
+    return 1;
+  }
+
+  case IGMP_V3_REPORT: {
+    uint32_t const num = relay_get16 (igmp + 6);
+    size_t pos = 8;
+    unsigned n = 0;
+
+    for (uint32_t i = 0; i < num && n < max; ++i) {
+      if (pos + IGMP_V3_RECORD_SIZE > sz) break;
+
+      const unsigned char* const rec = igmp + pos;
+      uint32_t const sources = relay_get16 (rec + 2);
+      pos += IGMP_V3_RECORD_SIZE + (size_t)rec[1] * 4 + (size_t)sources * 4;
+      if (pos > sz) break;
+
+      uint32_t const group = relay_get32_raw (rec + 4);
+      if (!relay_multicast (group)) continue;
+
+      /* Excluding sources (even none) is a join, and so is including
+      // some; including none is a leave. Blocking sources changes nothing. */
+      switch (rec[0]) {
+      case IGMP_MODE_IS_EXCLUDE:
+      case IGMP_CHANGE_TO_EXCLUDE:
+        records[n].join = true;
+        break;
+      case IGMP_MODE_IS_INCLUDE:
+      case IGMP_CHANGE_TO_INCLUDE:
+      case IGMP_ALLOW_NEW_SOURCES:
+        records[n].join = sources != 0;
+        if (!records[n].join && rec[0] == IGMP_ALLOW_NEW_SOURCES) continue;
+        break;
+      default:
+        continue;
+      }
+
+      records[n++].group = group;
+    }
+
+    return n;
+  }
+
+  default:
+    return 0;
+  }
+}
+
+void relay_igmp_query (unsigned char* const msg, uint32_t const group
+, uint8_t const max_resp)
+{
+  msg[0] = IGMP_QUERY;
+  msg[1] = max_resp;
+  msg[2] = msg[3] = 0;
+  memcpy (msg + 4, &group, sizeof(group));
+
+  uint16_t const chksum = ~chksum_scalar (msg, IGMP_QUERY_SIZE);
+  memcpy (msg + 2, &chksum, sizeof(chksum));
+}
+
+/* -------------------------------------------------------------------------- */
+
+static const unsigned char tunnel_magic[4] = {'B', 'R', 'C', 'T'};
+
+#define TUNNEL_VERSION 1
+#define TUNNEL_VERSION_POS 4
+#define TUNNEL_COUNT_POS 6
+
+size_t relay_tunnel_begin (unsigned char* const buf)
+{
+  memcpy (buf, tunnel_magic, sizeof(tunnel_magic));
+  buf[TUNNEL_VERSION_POS] = TUNNEL_VERSION;
+  buf[TUNNEL_VERSION_POS + 1] = 0;
+  buf[TUNNEL_COUNT_POS] = buf[TUNNEL_COUNT_POS + 1] = 0;
+  return TUNNEL_HEADER_SIZE;
+}
+
+size_t relay_tunnel_add (unsigned char* const buf, size_t const len, size_t const cap
+, const unsigned char* const udp, uint32_t const size)
+{
+  uint32_t const count = relay_get16 (buf + TUNNEL_COUNT_POS);
+  if (count == UINT16_MAX || len + TUNNEL_RECORD_HEADER_SIZE + size > cap) return 0;
+
+  buf[len] = (unsigned char)(size >> 8);
+  buf[len + 1] = (unsigned char)size;
+  memcpy (buf + len + TUNNEL_RECORD_HEADER_SIZE, udp, size);
+
+  buf[TUNNEL_COUNT_POS] = (unsigned char)((count + 1) >> 8);
+  buf[TUNNEL_COUNT_POS + 1] = (unsigned char)(count + 1);
+  return len + TUNNEL_RECORD_HEADER_SIZE + size;
+}
+
+uint32_t relay_tunnel_count (const unsigned char* const buf, size_t const len)
+{
+  if (len < TUNNEL_HEADER_SIZE || memcmp (buf, tunnel_magic, sizeof(tunnel_magic)) != 0
+  || buf[TUNNEL_VERSION_POS] != TUNNEL_VERSION) return 0;
+  return relay_get16 (buf + TUNNEL_COUNT_POS);
+}
+
+bool relay_tunnel_next (const unsigned char* const buf, size_t const len
+, size_t* const pos, const unsigned char** const udp, uint32_t* const size)
+{
+  if (*pos + TUNNEL_RECORD_HEADER_SIZE > len) return false;
+
+  uint32_t const sz = relay_get16 (buf + *pos);
+  const unsigned char* const rec = buf + *pos + TUNNEL_RECORD_HEADER_SIZE;
+
+  /* Whole UDP datagram which agrees on its own size */
+  if (sz < UDP_HEADER_SIZE || *pos + TUNNEL_RECORD_HEADER_SIZE + sz > len
+  || relay_get16 (rec + UDP_LENGTH_POS) != sz) return false;
+
+  *udp = rec;
+  *size = sz;
+  *pos += TUNNEL_RECORD_HEADER_SIZE + sz;
+  return true;
+}
@@ -0,0 +1,196 @@
+/* =============================================================================
+// BROADcast
+//
+// Platform-independent packet processing core.
+//
+// https://buymeacoff.ee/ubihazard
+// -------------------------------------------------------------------------- */
+
+#ifndef BROADCAST_RELAY_H
+#define BROADCAST_RELAY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* -------------------------------------------------------------------------- */
+
+#define IP_HEADER_SIZE 20
+#define IP_ADDR_SRC_POS 12
+#define IP_ADDR_DST_POS 16
+
+#define UDP_HEADER_SIZE 8
+#define UDP_PORT_SRC_POS 0
+#define UDP_PORT_DST_POS 2
+#define UDP_LENGTH_POS 4
+#define UDP_CHECKSUM_POS 6
+
+/* -----------------------------------------------------------------------------
+// Headers of a datagram as delivered by a raw UDP socket
+// (IP header followed by the UDP header and payload).
+// Addresses are kept in network byte order, ports and sizes
+// in host byte order. */
+typedef struct relay_hdr {
+  uint32_t addr_src;
+  uint32_t addr_dst;
+  uint16_t port_src;
+  uint16_t port_dst;
+  /* UDP header and payload */
+  uint32_t size;
+  const unsigned char* udp;
+} relay_hdr;
+
+/* Size of the UDP header and payload, as the UDP header says */
+uint32_t relay_udp_size (const unsigned char* buf);
+
+/* Decode the headers of a complete datagram of `len` bytes.
+// Returns `false` if the datagram is malformed or truncated. */
+bool relay_parse (const unsigned char* buf, size_t len, relay_hdr* hdr);
+
+/* Only broadcast packets sent from the preferred route are relayed */
+bool relay_wanted (const relay_hdr* hdr, uint32_t addr_route, uint32_t addr_broadcast);
+
+/* -----------------------------------------------------------------------------
+// The UDP checksum covers the source address, which changes
+// for every relay interface. The payload and the rest of the pseudo-header
+// are summed once per packet (`relay_chksum_base()`) and each interface's
+// checksum is derived from that partial sum (RFC 1624). */
+uint32_t relay_chksum_base (const unsigned char* udp, size_t sz, uint32_t addr_dst);
+uint16_t relay_chksum (uint32_t base, uint32_t addr_src);
+
+/* Partial sum for another destination address, e.g. to send
+// unicast copies of a broadcast packet */
+uint32_t relay_chksum_redirect (uint32_t base, uint32_t addr_from, uint32_t addr_to);
+
+/* Write the UDP header to send from `addr_src`. A zero checksum
+// means the sender didn't use it, and is kept as is. */
+void relay_rewrite (unsigned char* header, const unsigned char* udp
+, uint32_t base, uint32_t addr_src);
+
+/* -----------------------------------------------------------------------------
+// Relay targets are the local addresses of the direct
+// 255.255.255.255/32 routes, other than the preferred route and loopback */
+bool relay_target (uint32_t dest, uint32_t mask, uint32_t next_hop
+, bool direct, uint32_t addr_route);
+
+/* Route of the forwarding table. Addresses and masks
+// are in network byte order. */
+typedef struct relay_route {
+  uint32_t dest;
+  uint32_t mask;
+  uint32_t next_hop;
+  /* Local route with final destination */
+  bool direct;
+} relay_route;
+
+typedef bool (*relay_allow_fn) (uint32_t addr, void* ctx);
+
+/* Relay targets out of a whole forwarding table, those `allow` (if any)
+// lets through, up to `max` of them. The subnet of each target is its
+// narrowest other direct route (zero if there is none). Returns
+// the number of targets. */
+unsigned relay_targets (const relay_route* routes, size_t routes_num
+, uint32_t addr_route, relay_allow_fn allow, void* ctx
+, uint32_t* addrs, uint32_t* nets, uint32_t* masks, unsigned max);
+
+/* -----------------------------------------------------------------------------
+// Filter rules allow or deny destination ports (`port`), source
+// addresses (`from`) and relay interface addresses (`to`). Later rules
+// take precedence over earlier ones, and if the first rule of a kind
+// allows something, everything else of that kind is denied. Rules are
+// compiled into a port bitmap and sorted address range tables. */
+typedef enum relay_filter_kind {
+  RELAY_FILTER_PORT,
+  RELAY_FILTER_FROM,
+  RELAY_FILTER_TO
+} relay_filter_kind;
+
+/* Rule as written in the rules file (host byte order) */
+typedef struct relay_filter_rule {
+  relay_filter_kind kind;
+  bool allow;
+  uint32_t first;
+  uint32_t last;
+} relay_filter_rule;
+
+/* Compiled address rules: sorted, non-overlapping ranges,
+// each one going up to where the next one starts */
+typedef struct relay_filter_range {
+  uint32_t first;
+  bool allow;
+} relay_filter_range;
+
+typedef struct relay_filter_table {
+  relay_filter_range* ranges;
+  size_t ranges_num;
+} relay_filter_table;
+
+typedef struct relay_filter {
+  /* No port rules: all ports are allowed */
+  bool ports_on;
+  uint8_t ports[65536 / 8];
+  relay_filter_table from;
+  relay_filter_table to;
+} relay_filter;
+
+/* Returns `false` if out of memory, leaving the filter empty
+// (allowing everything). The filter must be empty to begin with. */
+bool relay_filter_compile (relay_filter* filter
+, const relay_filter_rule* rules, size_t rules_num);
+
+void relay_filter_release (relay_filter* filter);
+
+bool relay_filter_port (const relay_filter* filter, uint16_t port);
+
+/* Address in network byte order */
+bool relay_filter_addr (const relay_filter_table* table, uint32_t addr);
+
+/* -----------------------------------------------------------------------------
+// Multicast groups are relayed only to interfaces with members,
+// as told by the IGMP reports of hosts there. Group addresses
+// are in network byte order. */
+#define IGMP_QUERY_SIZE 8
+
+bool relay_multicast (uint32_t addr);
+
+typedef struct relay_igmp {
+  uint32_t group;
+  /* Joined, or left the group */
+  bool join;
+} relay_igmp;
+
+/* Membership changes in an IGMP report (IP header included) of `len`
+// bytes, up to `max` of them. Returns how many there are, zero if it isn't
+// a report (IGMPv1, v2 and v3 are understood). */
+unsigned relay_igmp_parse (const unsigned char* buf, size_t len
+, relay_igmp* records, unsigned max);
+
+/* IGMPv2 query for a group (zero for all of them), asking hosts
+// to report within `max_resp` tenths of a second */
+void relay_igmp_query (unsigned char* msg, uint32_t group, uint8_t max_resp);
+
+/* -----------------------------------------------------------------------------
+// Tunnel datagrams carry a batch of UDP datagrams (header and payload)
+// to a peer: a header with a magic number, version and record count,
+// then each datagram prefixed with its size, in network byte order. */
+#define TUNNEL_HEADER_SIZE 8
+#define TUNNEL_RECORD_HEADER_SIZE 2
+#define TUNNEL_DATAGRAM_MAX 65507
+
+/* Start an empty batch in `buf`, returning its length */
+size_t relay_tunnel_begin (unsigned char* buf);
+
+/* Append a datagram to the batch of `len` bytes. Returns the new length,
+// or zero if it would grow beyond `cap`. */
+size_t relay_tunnel_add (unsigned char* buf, size_t len, size_t cap
+, const unsigned char* udp, uint32_t size);
+
+/* Number of records in a received batch, zero if it isn't one */
+uint32_t relay_tunnel_count (const unsigned char* buf, size_t len);
+
+/* Next record from `*pos` (initially `TUNNEL_HEADER_SIZE`).
+// Returns `false` at the end, or if the record is malformed. */
+bool relay_tunnel_next (const unsigned char* buf, size_t len, size_t* pos
+, const unsigned char** udp, uint32_t* size);
+
+#endif /* BROADCAST_RELAY_H */
@@ -0,0 +1,615 @@
+/* =============================================================================
+// BROADcast
+//
+// In-kernel relay on Linux: eBPF program on the preferred interface.
+//
+// https://buymeacoff.ee/ubihazard
+// -------------------------------------------------------------------------- */
+
+#include "tc_relay.h"
+#include "relay.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/pkt_cls.h>
+#include <linux/pkt_sched.h>
+#include <linux/rtnetlink.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* -------------------------------------------------------------------------- */
+
+#define ETH_HEADER_SIZE 14
+#define ETH_ADDR_SRC_POS 6
+#define ETH_TYPE_POS 12
+
+#define IP_VERSION_POS 0
+#define IP_FRAGMENT_POS 6
+#define IP_PROTOCOL_POS 9
+#define IP_CHECKSUM_POS 10
+
+/* Filter priority, out of the way of the usual ones */
+#define TC_RELAY_PRIO 0xBCA5
+#define TC_RELAY_HANDLE 1
+
+#define TC_PROG_MAX 256
+#define TC_LOG_SIZE (256 * 1024)
+#define TC_CPUS_MAX 4096
+
+/* Per-CPU counters */
+enum {
+  TC_COUNTER_MATCHED,
+  TC_COUNTER_RELAYED,
+  TC_COUNTER_ERRORS,
+  TC_COUNTERS
+};
+
+/* Relay target as the program sees it */
+typedef struct tc_target_value {
+  uint32_t ifindex;
+  uint32_t addr;
+  unsigned char mac[6];
+  unsigned char pad[2];
+} tc_target_value;
+
+/* The preferred route address is kept after the targets */
+#define TC_ROUTE_KEY TC_RELAY_TARGETS_MAX
+
+/* Program stack layout */
+#define STACK_KEY (-4)
+#define STACK_ADDR (-8)
+#define STACK_TARGET (-16)
+#define STACK_MAC (-24)
+#define STACK_SNAPSHOT (-32)
+
+/* -------------------------------------------------------------------------- */
+
+static int map_targets = -1;
+static int map_snapshot = -1;
+static int map_counters = -1;
+static int prog_fd = -1;
+
+static int tc_ifindex;
+static bool tc_clsact_ours;
+
+static struct bpf_insn prog[TC_PROG_MAX];
+static unsigned prog_len;
+
+/* -----------------------------------------------------------------------------
+// The program is assembled here rather than compiled from C:
+// there's nothing to build or ship besides the executable. */
+#define INSN(c, d, s, o, i) ((struct bpf_insn){ \
+  .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i)})
+
+#define MOV64_REG(d, s) INSN (BPF_ALU64 | BPF_MOV | BPF_X, d, s, 0, 0)
+#define MOV64_IMM(d, i) INSN (BPF_ALU64 | BPF_MOV | BPF_K, d, 0, 0, i)
+#define MOV32_IMM(d, i) INSN (BPF_ALU | BPF_MOV | BPF_K, d, 0, 0, i)
+#define ADD64_IMM(d, i) INSN (BPF_ALU64 | BPF_ADD | BPF_K, d, 0, 0, i)
+#define AND64_IMM(d, i) INSN (BPF_ALU64 | BPF_AND | BPF_K, d, 0, 0, i)
+#define LDX_MEM(sz, d, s, o) INSN (BPF_LDX | BPF_MEM | (sz), d, s, o, 0)
+#define STX_MEM(sz, d, s, o) INSN (BPF_STX | BPF_MEM | (sz), d, s, o, 0)
+#define ST_MEM(sz, d, o, i) INSN (BPF_ST | BPF_MEM | (sz), d, 0, o, i)
+#define JMP_IMM(op, d, i) INSN (BPF_JMP | (op) | BPF_K, d, 0, 0, i)
+#define JMP_REG(op, d, s) INSN (BPF_JMP | (op) | BPF_X, d, s, 0, 0)
+#define JMP_A() INSN (BPF_JMP | BPF_JA, 0, 0, 0, 0)
+#define CALL(f) INSN (BPF_JMP | BPF_CALL, 0, 0, 0, f)
+#define EXIT() INSN (BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+static unsigned emit (struct bpf_insn const insn)
+{
+  prog[prog_len] = insn;
+  return prog_len++;
+}
+
+/* Point the jump at `at` to the next instruction */
+static void land (unsigned const at)
+{
+  prog[at].off = (int16_t)(prog_len - at - 1);
+}
+
+/* Point the jump at `at` back to `to` */
+static void land_back (unsigned const at, unsigned const to)
+{
+  prog[at].off = (int16_t)((int)to - (int)at - 1);
+}
+
+static void emit_map (int const reg, int const fd)
+{
+  emit (INSN (BPF_LD | BPF_DW | BPF_IMM, reg, BPF_PSEUDO_MAP_FD, 0, fd));
+  emit (INSN (0, 0, 0, 0, 0));
+}
+
+/* Look up the key on the stack in the map `r1` points to:
+// value (or null) in `r0` */
+static void emit_lookup_in (void)
+{
+  emit (MOV64_REG (BPF_REG_2, BPF_REG_10));
+  emit (ADD64_IMM (BPF_REG_2, STACK_KEY));
+  emit (CALL (BPF_FUNC_map_lookup_elem));
+}
+
+/* Look up the key on the stack: value (or null) in `r0` */
+static void emit_lookup (int const fd)
+{
+  emit_map (BPF_REG_1, fd);
+  emit (MOV64_REG (BPF_REG_2, BPF_REG_10));
+  emit (ADD64_IMM (BPF_REG_2, STACK_KEY));
+  emit (CALL (BPF_FUNC_map_lookup_elem));
+}
+
+static void emit_count (int const counter)
+{
+  emit (ST_MEM (BPF_W, BPF_REG_10, STACK_KEY, counter));
+  emit_lookup (map_counters);
+  unsigned const skip = emit (JMP_IMM (BPF_JEQ, BPF_REG_0, 0));
+  emit (LDX_MEM (BPF_DW, BPF_REG_1, BPF_REG_0, 0));
+  emit (ADD64_IMM (BPF_REG_1, 1));
+  emit (STX_MEM (BPF_DW, BPF_REG_0, BPF_REG_1, 0));
+  land (skip);
+}
+
+/* Change the source address from `r9` to the one on the stack,
+// patching both checksums (RFC 1624), and keep it in `r9`.
+// A zero UDP checksum stays zero. */
+static void emit_readdress (void)
+{
+  emit (MOV64_REG (BPF_REG_1, BPF_REG_6));
+  emit (MOV64_IMM (BPF_REG_2, ETH_HEADER_SIZE + IP_CHECKSUM_POS));
+  emit (MOV64_REG (BPF_REG_3, BPF_REG_9));
+  emit (LDX_MEM (BPF_W, BPF_REG_4, BPF_REG_10, STACK_ADDR));
+  emit (MOV64_IMM (BPF_REG_5, 4));
+  emit (CALL (BPF_FUNC_l3_csum_replace));
+
+  emit (MOV64_REG (BPF_REG_1, BPF_REG_6));
+  emit (MOV64_IMM (BPF_REG_2, ETH_HEADER_SIZE + IP_HEADER_SIZE + UDP_CHECKSUM_POS));
+  emit (MOV64_REG (BPF_REG_3, BPF_REG_9));
+  emit (LDX_MEM (BPF_W, BPF_REG_4, BPF_REG_10, STACK_ADDR));
+  emit (MOV64_IMM (BPF_REG_5, BPF_F_PSEUDO_HDR | BPF_F_MARK_MANGLED_0 | 4));
+  emit (CALL (BPF_FUNC_l4_csum_replace));
+
+  emit (MOV64_REG (BPF_REG_1, BPF_REG_6));
+  emit (MOV64_IMM (BPF_REG_2, ETH_HEADER_SIZE + IP_ADDR_SRC_POS));
+  emit (MOV64_REG (BPF_REG_3, BPF_REG_10));
+  emit (ADD64_IMM (BPF_REG_3, STACK_ADDR));
+  emit (MOV64_IMM (BPF_REG_4, 4));
+  emit (MOV64_IMM (BPF_REG_5, 0));
+  emit (CALL (BPF_FUNC_skb_store_bytes));
+
+  emit (LDX_MEM (BPF_W, BPF_REG_9, BPF_REG_10, STACK_ADDR));
+}
+
+/* Source MAC address from memory `r3` points to */
+static void emit_store_mac (void)
+{
+  emit (MOV64_REG (BPF_REG_1, BPF_REG_6));
+  emit (MOV64_IMM (BPF_REG_2, ETH_ADDR_SRC_POS));
+  emit (MOV64_IMM (BPF_REG_4, 6));
+  emit (MOV64_IMM (BPF_REG_5, 0));
+  emit (CALL (BPF_FUNC_skb_store_bytes));
+}
+
+/* -----------------------------------------------------------------------------
+// `r6` holds the packet, `r7` its original source address,
+// `r8` the target index and `r9` the current source address.
+// Every target gets a clone of the packet as rewritten for it,
+// then the original is restored and let through. The targets and
+// the preferred route come from the current snapshot map, which
+// is looked up once per packet and kept on the stack. */
+static void tc_prog_build (void)
+{
+  unsigned outs[16], outs_num = 0;
+  unsigned restores[4], restores_num = 0;
+
+  prog_len = 0;
+  emit (MOV64_REG (BPF_REG_6, BPF_REG_1));
+  emit (LDX_MEM (BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct __sk_buff, data)));
+  emit (LDX_MEM (BPF_W, BPF_REG_3, BPF_REG_6, offsetof(struct __sk_buff, data_end)));
+
+  /* Ethernet, IP and UDP headers are there */
+  emit (MOV64_REG (BPF_REG_4, BPF_REG_2));
+  emit (ADD64_IMM (BPF_REG_4, ETH_HEADER_SIZE + IP_HEADER_SIZE + UDP_HEADER_SIZE));
+  outs[outs_num++] = emit (JMP_REG (BPF_JGT, BPF_REG_4, BPF_REG_3));
+
+  /* IPv4 without options */
+  emit (LDX_MEM (BPF_H, BPF_REG_4, BPF_REG_2, ETH_TYPE_POS));
+  outs[outs_num++] = emit (JMP_IMM (BPF_JNE, BPF_REG_4, htons (ETH_P_IP)));
+  emit (LDX_MEM (BPF_B, BPF_REG_4, BPF_REG_2, ETH_HEADER_SIZE + IP_VERSION_POS));
+  outs[outs_num++] = emit (JMP_IMM (BPF_JNE, BPF_REG_4, 0x45));
+
+  /* UDP, and not a fragment */
+  emit (LDX_MEM (BPF_B, BPF_REG_4, BPF_REG_2, ETH_HEADER_SIZE + IP_PROTOCOL_POS));
+  outs[outs_num++] = emit (JMP_IMM (BPF_JNE, BPF_REG_4, IPPROTO_UDP));
+  emit (LDX_MEM (BPF_H, BPF_REG_4, BPF_REG_2, ETH_HEADER_SIZE + IP_FRAGMENT_POS));
+  emit (AND64_IMM (BPF_REG_4, htons (0x3FFF)));
+  outs[outs_num++] = emit (JMP_IMM (BPF_JNE, BPF_REG_4, 0));
+
+  /* To 255.255.255.255 */
+  emit (LDX_MEM (BPF_W, BPF_REG_4, BPF_REG_2, ETH_HEADER_SIZE + IP_ADDR_DST_POS));
+  emit (MOV32_IMM (BPF_REG_5, -1));
+  outs[outs_num++] = emit (JMP_REG (BPF_JNE, BPF_REG_4, BPF_REG_5));
+
+  /* Keep the original addresses */
+  emit (LDX_MEM (BPF_W, BPF_REG_7, BPF_REG_2, ETH_HEADER_SIZE + IP_ADDR_SRC_POS));
+  emit (LDX_MEM (BPF_W, BPF_REG_4, BPF_REG_2, ETH_ADDR_SRC_POS));
+  emit (STX_MEM (BPF_W, BPF_REG_10, BPF_REG_4, STACK_MAC));
+  emit (LDX_MEM (BPF_H, BPF_REG_4, BPF_REG_2, ETH_ADDR_SRC_POS + 4));
+  emit (STX_MEM (BPF_H, BPF_REG_10, BPF_REG_4, STACK_MAC + 4));
+
+  /* Current snapshot */
+  emit (ST_MEM (BPF_W, BPF_REG_10, STACK_KEY, 0));
+  emit_lookup (map_targets);
+  outs[outs_num++] = emit (JMP_IMM (BPF_JEQ, BPF_REG_0, 0));
+  emit (STX_MEM (BPF_DW, BPF_REG_10, BPF_REG_0, STACK_SNAPSHOT));
+
+  /* From the preferred route */
+  emit (MOV64_REG (BPF_REG_1, BPF_REG_0));
+  emit (ST_MEM (BPF_W, BPF_REG_10, STACK_KEY, TC_ROUTE_KEY));
+  emit_lookup_in();
+  outs[outs_num++] = emit (JMP_IMM (BPF_JEQ, BPF_REG_0, 0));
+  emit (LDX_MEM (BPF_W, BPF_REG_1, BPF_REG_0, offsetof(tc_target_value, addr)));
+  outs[outs_num++] = emit (JMP_REG (BPF_JNE, BPF_REG_1, BPF_REG_7));
+
+  emit_count (TC_COUNTER_MATCHED);
+  emit (MOV64_IMM (BPF_REG_8, 0));
+  emit (MOV64_REG (BPF_REG_9, BPF_REG_7));
+
+  /* Next target, up to the first empty one */
+  unsigned const loop = prog_len;
+  restores[restores_num++] = emit (JMP_IMM (BPF_JGE, BPF_REG_8, TC_RELAY_TARGETS_MAX));
+  emit (STX_MEM (BPF_W, BPF_REG_10, BPF_REG_8, STACK_KEY));
+  emit (LDX_MEM (BPF_DW, BPF_REG_1, BPF_REG_10, STACK_SNAPSHOT));
+  emit_lookup_in();
+  restores[restores_num++] = emit (JMP_IMM (BPF_JEQ, BPF_REG_0, 0));
+  emit (LDX_MEM (BPF_W, BPF_REG_1, BPF_REG_0, offsetof(tc_target_value, ifindex)));
+  restores[restores_num++] = emit (JMP_IMM (BPF_JEQ, BPF_REG_1, 0));
+  emit (STX_MEM (BPF_DW, BPF_REG_10, BPF_REG_0, STACK_TARGET));
+  emit (LDX_MEM (BPF_W, BPF_REG_1, BPF_REG_0, offsetof(tc_target_value, addr)));
+  emit (STX_MEM (BPF_W, BPF_REG_10, BPF_REG_1, STACK_ADDR));
+
+  emit_readdress();
+  emit (LDX_MEM (BPF_DW, BPF_REG_3, BPF_REG_10, STACK_TARGET));
+  emit (ADD64_IMM (BPF_REG_3, offsetof(tc_target_value, mac)));
+  emit_store_mac();
+
+  /* Send a copy out of the target interface */
+  emit (LDX_MEM (BPF_DW, BPF_REG_0, BPF_REG_10, STACK_TARGET));
+  emit (LDX_MEM (BPF_W, BPF_REG_2, BPF_REG_0, offsetof(tc_target_value, ifindex)));
+  emit (MOV64_REG (BPF_REG_1, BPF_REG_6));
+  emit (MOV64_IMM (BPF_REG_3, 0));
+  emit (CALL (BPF_FUNC_clone_redirect));
+  unsigned const failed = emit (JMP_IMM (BPF_JNE, BPF_REG_0, 0));
+  emit_count (TC_COUNTER_RELAYED);
+  unsigned const next = emit (JMP_A());
+  land (failed);
+  emit_count (TC_COUNTER_ERRORS);
+  land (next);
+  emit (ADD64_IMM (BPF_REG_8, 1));
+  land_back (emit (JMP_A()), loop);
+
+  /* Put the original back */
+  for (unsigned i = 0; i < restores_num; ++i) land (restores[i]);
+  outs[outs_num++] = emit (JMP_REG (BPF_JEQ, BPF_REG_9, BPF_REG_7));
+  emit (STX_MEM (BPF_W, BPF_REG_10, BPF_REG_7, STACK_ADDR));
+  emit_readdress();
+  emit (MOV64_REG (BPF_REG_3, BPF_REG_10));
+  emit (ADD64_IMM (BPF_REG_3, STACK_MAC));
+  emit_store_mac();
+
+  for (unsigned i = 0; i < outs_num; ++i) land (outs[i]);
+  emit (MOV64_IMM (BPF_REG_0, TC_ACT_OK));
+  emit (EXIT());
+}
+
+/* -------------------------------------------------------------------------- */
+
+static int tc_bpf (int const cmd, union bpf_attr* const attr)
+{
+  return (int)syscall (__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int tc_map_create (uint32_t const type, uint32_t const value_size
+, uint32_t const entries, int const inner_fd)
+{
+  union bpf_attr attr;
+  memset (&attr, 0, sizeof(attr));
+  attr.map_type = type;
+  attr.key_size = sizeof(uint32_t);
+  attr.value_size = value_size;
+  attr.max_entries = entries;
+  if (inner_fd >= 0) attr.inner_map_fd = (uint32_t)inner_fd;
+  return tc_bpf (BPF_MAP_CREATE, &attr);
+}
+
+/* Targets and the preferred route, zeroed */
+static int tc_snapshot_create (void)
+{
+  return tc_map_create (BPF_MAP_TYPE_ARRAY, sizeof(tc_target_value)
+  , TC_RELAY_TARGETS_MAX + 1, -1);
+}
+
+static bool tc_map_update (int const fd, uint32_t const key, const void* const value)
+{
+  union bpf_attr attr;
+  memset (&attr, 0, sizeof(attr));
+  attr.map_fd = fd;
+  attr.key = (uintptr_t)&key;
+  attr.value = (uintptr_t)value;
+  attr.flags = BPF_ANY;
+  return tc_bpf (BPF_MAP_UPDATE_ELEM, &attr) == 0;
+}
+
+/* Possible CPUs, which is what per-CPU maps are sized for */
+static unsigned tc_cpus (void)
+{
+  unsigned first, last = 0;
+  FILE* const f = fopen ("/sys/devices/system/cpu/possible", "r");
+
+  if (f != NULL) {
+    int const n = fscanf (f, "%u-%u", &first, &last);
+    if (n == 1) last = first;
+    fclose (f);
+  }
+
+  return last + 1 < TC_CPUS_MAX ? last + 1 : TC_CPUS_MAX;
+}
+
+/* -----------------------------------------------------------------------------
+// The program is attached as a direct action classifier on egress
+// of the `clsact` queueing discipline, which is created if missing
+// and removed again only if it was ours. */
+typedef struct tc_request {
+  struct nlmsghdr nh;
+  struct tcmsg tc;
+  char attrs[256];
+} tc_request;
+
+static void tc_request_init (tc_request* const req, uint16_t const type
+, uint16_t const flags, int const ifindex, uint32_t const parent)
+{
+  memset (req, 0, sizeof(*req));
+  req->nh.nlmsg_len = NLMSG_LENGTH (sizeof(req->tc));
+  req->nh.nlmsg_type = type;
+  req->nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+  req->tc.tcm_family = AF_UNSPEC;
+  req->tc.tcm_ifindex = ifindex;
+  req->tc.tcm_parent = parent;
+}
+
+static struct rtattr* tc_attr (tc_request* const req, uint16_t const type
+, const void* const data, size_t const len)
+{
+  struct rtattr* const rta = (struct rtattr*)((char*)req + NLMSG_ALIGN (req->nh.nlmsg_len));
+  rta->rta_type = type;
+  rta->rta_len = RTA_LENGTH (len);
+  if (len != 0) memcpy (RTA_DATA (rta), data, len);
+  req->nh.nlmsg_len = NLMSG_ALIGN (req->nh.nlmsg_len) + RTA_ALIGN (rta->rta_len);
+  return rta;
+}
+
+/* Attribute nested under `rta` ends here */
+static void tc_attr_end (tc_request* const req, struct rtattr* const rta)
+{
+  rta->rta_len = (unsigned short)((char*)req + req->nh.nlmsg_len - (char*)rta);
+}
+
+/* Send the request and wait for the acknowledgement: zero or `-errno` */
+static int tc_netlink (tc_request* const req)
+{
+  struct sockaddr_nl sa = {.nl_family = AF_NETLINK};
+  char buf[4096];
+  int err = -EIO;
+
+  int const sock = socket (AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+  if (sock < 0) return -errno;
+
+  if (sendto (sock, req, req->nh.nlmsg_len, 0, (struct sockaddr*)&sa, sizeof(sa)) >= 0) {
+    ssize_t const len = recv (sock, buf, sizeof(buf), 0);
+    const struct nlmsghdr* const nh = (const struct nlmsghdr*)buf;
+
+    if (len >= (ssize_t)NLMSG_LENGTH (sizeof(struct nlmsgerr))
+    && nh->nlmsg_type == NLMSG_ERROR) {
+      err = ((const struct nlmsgerr*)NLMSG_DATA (nh))->error;
+    }
+  } else err = -errno;
+
+  close (sock);
+  return err;
+}
+
+static void tc_detach (void)
+{
+  tc_request req;
+
+  if (tc_ifindex == 0) return;
+
+  if (tc_clsact_ours) {
+    /* Takes the filter along */
+    tc_request_init (&req, RTM_DELQDISC, 0, tc_ifindex, TC_H_CLSACT);
+    req.tc.tcm_handle = TC_H_MAKE (TC_H_CLSACT, 0);
+    tc_attr (&req, TCA_KIND, "clsact", sizeof("clsact"));
+  } else {
+    tc_request_init (&req, RTM_DELTFILTER, 0, tc_ifindex
+    , TC_H_MAKE (TC_H_CLSACT, TC_H_MIN_EGRESS));
+    req.tc.tcm_handle = TC_RELAY_HANDLE;
+    req.tc.tcm_info = TC_H_MAKE (TC_RELAY_PRIO << 16, htons (ETH_P_ALL));
+    tc_attr (&req, TCA_KIND, "bpf", sizeof("bpf"));
+  }
+
+  tc_netlink (&req);
+  tc_ifindex = 0;
+  tc_clsact_ours = false;
+}
+
+bool tc_relay_attach (int const ifindex)
+{
+  tc_request req;
+  uint32_t const fd = (uint32_t)prog_fd;
+  uint32_t const flags = TCA_BPF_FLAG_ACT_DIRECT;
+
+  if (ifindex == tc_ifindex) return true;
+  tc_detach();
+  if (ifindex == 0) return true;
+
+  tc_request_init (&req, RTM_NEWQDISC, NLM_F_CREATE | NLM_F_EXCL, ifindex, TC_H_CLSACT);
+  req.tc.tcm_handle = TC_H_MAKE (TC_H_CLSACT, 0);
+  tc_attr (&req, TCA_KIND, "clsact", sizeof("clsact"));
+
+  int err = tc_netlink (&req);
+  if (err != 0 && err != -EEXIST) {
+    errno = -err;
+    return false;
+  }
+
+  tc_ifindex = ifindex;
+  tc_clsact_ours = err == 0;
+
+  /* Replaces whatever a previous run left behind */
+  tc_request_init (&req, RTM_NEWTFILTER, NLM_F_CREATE | NLM_F_REPLACE, ifindex
+  , TC_H_MAKE (TC_H_CLSACT, TC_H_MIN_EGRESS));
+  req.tc.tcm_handle = TC_RELAY_HANDLE;
+  req.tc.tcm_info = TC_H_MAKE (TC_RELAY_PRIO << 16, htons (ETH_P_ALL));
+  tc_attr (&req, TCA_KIND, "bpf", sizeof("bpf"));
+  struct rtattr* const opts = tc_attr (&req, TCA_OPTIONS, NULL, 0);
+  tc_attr (&req, TCA_BPF_FD, &fd, sizeof(fd));
+  tc_attr (&req, TCA_BPF_NAME, "broadcast", sizeof("broadcast"));
+  tc_attr (&req, TCA_BPF_FLAGS, &flags, sizeof(flags));
+  tc_attr_end (&req, opts);
+
+  err = tc_netlink (&req);
+  if (err != 0) {
+    tc_detach();
+    errno = -err;
+    return false;
+  }
+
+  return true;
+}
+
+/* -----------------------------------------------------------------------------
+// Array map elements are updated in place, so a packet being
+// relayed could see a half written target. Every update fills
+// a new snapshot map instead (the zeroed entry after the last target
+// ends the list) and swaps it into the map of maps: the kernel
+// waits for the programs still running with the old snapshot
+// before it returns, so the old one can't be in use anymore. */
+bool tc_relay_update (uint32_t const addr_route, const tc_relay_target* const targets
+, unsigned const num)
+{
+  tc_target_value value;
+
+  int const snapshot = tc_snapshot_create();
+  if (snapshot < 0) return false;
+
+  for (unsigned i = 0; i < num && i < TC_RELAY_TARGETS_MAX; ++i) {
+    memset (&value, 0, sizeof(value));
+    value.ifindex = targets[i].ifindex;
+    value.addr = targets[i].addr;
+    memcpy (value.mac, targets[i].mac, sizeof(value.mac));
+    if (!tc_map_update (snapshot, i, &value)) goto fail;
+  }
+
+  memset (&value, 0, sizeof(value));
+  value.addr = addr_route;
+  if (!tc_map_update (snapshot, TC_ROUTE_KEY, &value)) goto fail;
+
+  uint32_t const fd = (uint32_t)snapshot;
+  if (!tc_map_update (map_targets, 0, &fd)) goto fail;
+
+  close (map_snapshot);
+  map_snapshot = snapshot;
+  return true;
+
+fail:
+  close (snapshot);
+  return false;
+}
+
+void tc_relay_read (tc_relay_counters* const counters)
+{
+  static uint64_t values[TC_CPUS_MAX];
+  uint64_t sums[TC_COUNTERS] = {0};
+  unsigned const cpus = tc_cpus();
+
+  for (uint32_t key = 0; key < TC_COUNTERS; ++key) {
+    union bpf_attr attr;
+    memset (&attr, 0, sizeof(attr));
+    attr.map_fd = map_counters;
+    attr.key = (uintptr_t)&key;
+    attr.value = (uintptr_t)values;
+    if (tc_bpf (BPF_MAP_LOOKUP_ELEM, &attr) != 0) continue;
+    for (unsigned i = 0; i < cpus; ++i) sums[key] += values[i];
+  }
+
+  counters->matched = sums[TC_COUNTER_MATCHED];
+  counters->relayed = sums[TC_COUNTER_RELAYED];
+  counters->errors = sums[TC_COUNTER_ERRORS];
+}
+
+/* -------------------------------------------------------------------------- */
+
+bool tc_relay_load (void)
+{
+  static char log[TC_LOG_SIZE];
+  union bpf_attr attr;
+
+  /* Starts out with an empty snapshot, which is also
+  // the template for the ones to come */
+  map_snapshot = tc_snapshot_create();
+  if (map_snapshot >= 0) {
+    map_targets = tc_map_create (BPF_MAP_TYPE_ARRAY_OF_MAPS, sizeof(uint32_t), 1, map_snapshot);
+  }
+  if (map_targets >= 0) {
+    uint32_t const fd = (uint32_t)map_snapshot;
+    if (!tc_map_update (map_targets, 0, &fd)) {
+      close (map_targets);
+      map_targets = -1;
+    }
+  }
+  map_counters = tc_map_create (BPF_MAP_TYPE_PERCPU_ARRAY, sizeof(uint64_t), TC_COUNTERS, -1);
+
+  if (map_targets < 0 || map_counters < 0) {
+    perror ("Error creating BPF maps");
+    tc_relay_unload();
+    return false;
+  }
+
+  tc_prog_build();
+
+  memset (&attr, 0, sizeof(attr));
+  attr.prog_type = BPF_PROG_TYPE_SCHED_CLS;
+  attr.insns = (uintptr_t)prog;
+  attr.insn_cnt = prog_len;
+  attr.license = (uintptr_t)"FGPL";
+  snprintf (attr.prog_name, sizeof(attr.prog_name), "broadcast");
+  prog_fd = tc_bpf (BPF_PROG_LOAD, &attr);
+
+  if (prog_fd < 0) {
+    /* Load it again for the verifier's opinion */
+    attr.log_buf = (uintptr_t)log;
+    attr.log_size = sizeof(log);
+    attr.log_level = 1;
+    tc_bpf (BPF_PROG_LOAD, &attr);
+    perror ("Error loading the BPF program");
+    fputs (log, stderr);
+    tc_relay_unload();
+    return false;
+  }
+
+  return true;
+}
+
+void tc_relay_unload (void)
+{
+  tc_detach();
+  if (prog_fd >= 0) close (prog_fd);
+  if (map_counters >= 0) close (map_counters);
+  if (map_snapshot >= 0) close (map_snapshot);
+  if (map_targets >= 0) close (map_targets);
+  prog_fd = map_counters = map_snapshot = map_targets = -1;
+}
@@ -0,0 +1,53 @@
+/* =============================================================================
+// BROADcast
+//
+// In-kernel relay on Linux: eBPF program on the preferred interface.
+//
+// https://buymeacoff.ee/ubihazard
+// -------------------------------------------------------------------------- */
+
+#ifndef BROADCAST_TC_RELAY_H
+#define BROADCAST_TC_RELAY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* -------------------------------------------------------------------------- */
+
+/* Relay targets the program can hold */
+#define TC_RELAY_TARGETS_MAX 64
+
+/* Ethernet interface to clone broadcast packets to.
+// Address is in network byte order. */
+typedef struct tc_relay_target {
+  uint32_t ifindex;
+  uint32_t addr;
+  unsigned char mac[6];
+} tc_relay_target;
+
+typedef struct tc_relay_counters {
+  /* Broadcast packets sent from the preferred route */
+  uint64_t matched;
+  /* Copies handed to relay interfaces */
+  uint64_t relayed;
+  uint64_t errors;
+} tc_relay_counters;
+
+/* -----------------------------------------------------------------------------
+// Egress traffic of the preferred interface goes through a classifier
+// that rewrites the source address and checksums of every broadcast
+// packet for each target in turn, and clones it there. Userspace
+// only keeps the targets in sync with routes and reads counters.
+// Both the preferred interface and the targets must be Ethernet. */
+bool tc_relay_load (void);
+void tc_relay_unload (void);
+
+/* Move the program to another interface (zero detaches it) */
+bool tc_relay_attach (int ifindex);
+
+bool tc_relay_update (uint32_t addr_route, const tc_relay_target* targets, unsigned num);
+
+/* Per-CPU counters added up */
+void tc_relay_read (tc_relay_counters* counters);
+
+#endif /* BROADCAST_TC_RELAY_H */
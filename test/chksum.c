@@ -0,0 +1,111 @@
+/* =============================================================================
+// BROADcast
+//
+// Vector checksum kernels against the scalar one.
+//
+// https://buymeacoff.ee/ubihazard
+// -------------------------------------------------------------------------- */
+
+#include "../chksum.h"
+#include "test.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+/* -------------------------------------------------------------------------- */
+
+/* One 16-bit word at a time */
+static uint16_t reference (const unsigned char* const p, size_t const sz)
+{
+  uint64_t sum = 0;
+  uint16_t w;
+
+  for (size_t i = 0; i + 1 < sz; i += 2) {
+    memcpy (&w, p + i, sizeof(w));
+    sum += w;
+  }
+
+  if (sz % 2 != 0) {
+    w = 0;
+    memcpy (&w, p + sz - 1, 1);
+    sum += w;
+  }
+
+  while (sum > 0xFFFF) sum = (sum & 0xFFFF) + (sum >> 16);
+  return (uint16_t)sum;
+}
+
+static const struct {
+  const char* name;
+  chksum_fn fn;
+  const char* feature;
+} kernels[] = {
+  {"scalar", chksum_scalar, NULL}
+, {"SSE2", chksum_sse2, "sse2"}
+, {"AVX2", chksum_avx2, "avx2"}
+};
+
+static bool supported (const char* const feature)
+{
+  if (feature == NULL) return true;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (strcmp (feature, "sse2") == 0) return __builtin_cpu_supports ("sse2");
+  if (strcmp (feature, "avx2") == 0) return __builtin_cpu_supports ("avx2");
+#endif
+  return true;
+}
+
+/* Every kernel at every alignment */
+static void check (const unsigned char* const buf, size_t const sz)
+{
+  for (size_t k = 0; k < sizeof(kernels) / sizeof(*kernels); ++k) {
+    if (!supported (kernels[k].feature)) continue;
+    for (size_t align = 0; align < 32; ++align) {
+      uint16_t const want = reference (buf + align, sz);
+      uint16_t const got = kernels[k].fn (buf + align, sz);
+      if (got != want) {
+        fprintf (stderr, "%s: %zu bytes at +%zu: %04X, expected %04X\n"
+        , kernels[k].name, sz, align, got, want);
+        ++test_failures;
+        return;
+      }
+    }
+  }
+}
+
+int main (void)
+{
+  /* Past the point where the vector lanes have to be
+  // flushed into the 64-bit sum (1 MiB for AVX2) */
+  size_t const big = (3 << 20) + 17;
+  unsigned char* const buf = malloc (big + 32);
+  expect (buf != NULL);
+  if (buf == NULL) return test_done ("chksum");
+  srand (1);
+
+  /* Random data, all sizes around the vector widths */
+  for (size_t i = 0; i < big + 32; ++i) buf[i] = (unsigned char)rand();
+  for (size_t sz = 0; sz <= 1024; ++sz) check (buf, sz);
+  check (buf, 65535);
+  check (buf, 65536);
+
+  /* All ones: the worst case for carries */
+  memset (buf, 0xFF, big + 32);
+  for (size_t sz = 0; sz <= 256; ++sz) check (buf, sz);
+  check (buf, 65536);
+  check (buf, big);
+
+  /* A sum that folds to 0xFFFF rather than to zero */
+  memset (buf, 0, 64);
+  buf[0] = 0xFF;
+  buf[2] = 0x00; buf[3] = 0xFF;
+  check (buf, 64);
+
+  /* Whatever was picked for this CPU */
+  expect (chksum_fast (buf, 64) == reference (buf, 64));
+  printf ("chksum: using %s\n", chksum_name());
+
+  free (buf);
+  return test_done ("chksum");
+}
@@ -0,0 +1,116 @@
+/* =============================================================================
+// BROADcast
+//
+// Readers picking up objects while a writer publishes and reclaims them.
+// Built with a sanitizer, which reports any read of a freed object.
+//
+// https://buymeacoff.ee/ubihazard
+// -------------------------------------------------------------------------- */
+
+#include "../epoch.h"
+#include "test.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+/* -------------------------------------------------------------------------- */
+
+#define READERS 6
+#define PUBLISHES 20000
+#define WORDS 16
+
+typedef struct object {
+  epoch_node node;
+  uint64_t version;
+  uint64_t words[WORDS];
+} object;
+
+static object empty;
+static epoch_reader readers[READERS];
+static epoch_domain dom = EPOCH_DOMAIN_INIT (&empty.node, readers, READERS);
+static bool done;
+static unsigned long failures;
+
+static uint64_t word (uint64_t const version, unsigned const i)
+{
+  return version * 0x9E3779B97F4A7C15u + i;
+}
+
+static void* reader (void* const arg)
+{
+  size_t const id = (size_t)arg;
+  uint64_t seen = 0;
+  unsigned long reads = 0, bad = 0;
+
+  while (!__atomic_load_n (&done, __ATOMIC_ACQUIRE)) {
+    const object* const obj = (const object*)epoch_enter (&dom, id);
+
+    /* Never goes back to an older version, and never sees it half-written */
+    if (obj->version < seen) bad++;
+    seen = obj->version;
+    for (unsigned i = 0; i < WORDS; ++i) {
+      if (obj->version != 0 && obj->words[i] != word (obj->version, i)) bad++;
+    }
+
+    epoch_leave (&dom, id);
+    reads++;
+  }
+
+  __atomic_add_fetch (&failures, bad, __ATOMIC_RELAXED);
+  return (void*)reads;
+}
+
+static size_t retired (void)
+{
+  size_t num = 0;
+  for (const epoch_node* node = dom.retired; node != NULL; node = node->next) num++;
+  return num;
+}
+
+int main (void)
+{
+  pthread_t threads[READERS];
+
+  for (size_t i = 0; i < READERS; ++i) {
+    expect (pthread_create (&threads[i], NULL, reader, (void*)i) == 0);
+  }
+
+  size_t retired_max = 0;
+
+  for (uint64_t version = 1; version <= PUBLISHES; ++version) {
+    object* const obj = malloc (sizeof(object));
+    if (obj == NULL) abort();
+    obj->version = version;
+    for (unsigned i = 0; i < WORDS; ++i) obj->words[i] = word (version, i);
+    epoch_publish (&dom, &obj->node);
+
+    size_t const num = retired();
+    if (num > retired_max) retired_max = num;
+  }
+
+  __atomic_store_n (&done, true, __ATOMIC_RELEASE);
+
+  unsigned long reads = 0;
+  for (size_t i = 0; i < READERS; ++i) {
+    void* r;
+    pthread_join (threads[i], &r);
+    reads += (unsigned long)r;
+  }
+
+  expect (failures == 0);
+
+  /* With the readers gone, the next publish frees everything retired */
+  object* const last = calloc (1, sizeof(object));
+  if (last == NULL) abort();
+  last->version = PUBLISHES + 1;
+  epoch_publish (&dom, &last->node);
+  expect (epoch_current (&dom) == &last->node);
+  expect (dom.retired == NULL);
+
+  epoch_release (&dom);
+  expect (epoch_current (&dom) == &empty.node);
+
+  printf ("epoch: %lu reads, at most %zu objects retired\n", reads, retired_max);
+  return test_done ("epoch");
+}
@@ -0,0 +1,154 @@
+/* =============================================================================
+// BROADcast
+//
+// Compiled filter rules against evaluating the rules one by one.
+//
+// https://buymeacoff.ee/ubihazard
+// -------------------------------------------------------------------------- */
+
+#include "../relay.h"
+#include "test.h"
+
+#include <stdlib.h>
+
+/* -------------------------------------------------------------------------- */
+
+static uint32_t host (unsigned a, unsigned b, unsigned c, unsigned d)
+{
+  return (a << 24) | (b << 16) | (c << 8) | d;
+}
+
+static relay_filter_rule rule (relay_filter_kind const kind, bool const allow
+, uint32_t const first, uint32_t const last)
+{
+  relay_filter_rule const r = {kind, allow, first, last};
+  return r;
+}
+
+/* The last matching rule wins, and the first rule of a kind
+// decides what the rest is (host byte order) */
+static bool naive (const relay_filter_rule* const rules, size_t const rules_num
+, relay_filter_kind const kind, uint32_t const value)
+{
+  size_t first = rules_num;
+
+  for (size_t i = 0; i < rules_num; ++i) {
+    if (rules[i].kind != kind) continue;
+    if (first == rules_num) first = i;
+  }
+
+  if (first == rules_num) return true;
+
+  for (size_t i = rules_num; i-- > first;) {
+    if (rules[i].kind != kind) continue;
+    if (value >= rules[i].first && value <= rules[i].last) return rules[i].allow;
+  }
+
+  return !rules[first].allow;
+}
+
+static uint32_t net (uint32_t const h)
+{
+  return test_addr (h >> 24, (h >> 16) & 0xFF, (h >> 8) & 0xFF, h & 0xFF);
+}
+
+static uint32_t random32 (void)
+{
+  return ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+}
+
+int main (void)
+{
+  relay_filter filter;
+  memset (&filter, 0, sizeof(filter));
+
+  /* No rules: everything goes */
+  expect (relay_filter_compile (&filter, NULL, 0));
+  expect (relay_filter_port (&filter, 0) && relay_filter_port (&filter, 65535));
+  expect (relay_filter_addr (&filter.from, test_addr (10, 0, 0, 1)));
+  expect (relay_filter_addr (&filter.to, test_addr (255, 255, 255, 255)));
+  relay_filter_release (&filter);
+
+  /* Ports: the first rule allows, so everything else is denied */
+  const relay_filter_rule ports[] = {
+    rule (RELAY_FILTER_PORT, true, 5000, 5010)
+  , rule (RELAY_FILTER_PORT, false, 5005, 5005)
+  , rule (RELAY_FILTER_PORT, true, 65535, 65535)
+  };
+
+  expect (relay_filter_compile (&filter, ports, 3));
+  expect (!relay_filter_port (&filter, 4999));
+  expect (relay_filter_port (&filter, 5000));
+  expect (!relay_filter_port (&filter, 5005));
+  expect (relay_filter_port (&filter, 5010));
+  expect (!relay_filter_port (&filter, 5011));
+  expect (relay_filter_port (&filter, 65535));
+  expect (!relay_filter_port (&filter, 0));
+  /* Addresses have no rules */
+  expect (relay_filter_addr (&filter.from, test_addr (1, 2, 3, 4)));
+  relay_filter_release (&filter);
+
+  /* Addresses: the first rule denies, so everything else is allowed */
+  const relay_filter_rule addrs[] = {
+    rule (RELAY_FILTER_FROM, false, host (10, 0, 0, 0), host (10, 255, 255, 255))
+  , rule (RELAY_FILTER_FROM, true, host (10, 1, 2, 0), host (10, 1, 2, 255))
+  , rule (RELAY_FILTER_TO, true, host (192, 168, 0, 0), host (192, 168, 255, 255))
+  , rule (RELAY_FILTER_FROM, false, host (255, 255, 255, 255), UINT32_MAX)
+  };
+
+  expect (relay_filter_compile (&filter, addrs, 4));
+  expect (!filter.ports_on);
+  expect (relay_filter_addr (&filter.from, test_addr (0, 0, 0, 0)));
+  expect (relay_filter_addr (&filter.from, test_addr (9, 255, 255, 255)));
+  expect (!relay_filter_addr (&filter.from, test_addr (10, 0, 0, 0)));
+  expect (relay_filter_addr (&filter.from, test_addr (10, 1, 2, 3)));
+  expect (!relay_filter_addr (&filter.from, test_addr (10, 1, 3, 0)));
+  expect (relay_filter_addr (&filter.from, test_addr (11, 0, 0, 0)));
+  expect (!relay_filter_addr (&filter.from, test_addr (255, 255, 255, 255)));
+  expect (relay_filter_addr (&filter.to, test_addr (192, 168, 1, 1)));
+  expect (!relay_filter_addr (&filter.to, test_addr (10, 1, 2, 3)));
+  relay_filter_release (&filter);
+  expect (filter.from.ranges == NULL && filter.from.ranges_num == 0);
+
+  /* Random rule sets */
+  srand (1);
+
+  for (int round = 0; round < 200; ++round) {
+    relay_filter_rule rules[64];
+    size_t const rules_num = 1 + rand() % 64;
+
+    for (size_t i = 0; i < rules_num; ++i) {
+      relay_filter_kind const kind = (relay_filter_kind)(rand() % 3);
+      bool const allow = rand() % 2;
+
+      if (kind == RELAY_FILTER_PORT) {
+        uint32_t const first = rand() % 65536;
+        rules[i] = rule (kind, allow, first, first + rand() % (65536 - first));
+      } else {
+        unsigned const bits = rand() % 33;
+        uint32_t const mask = bits == 0 ? 0 : UINT32_MAX << (32 - bits);
+        uint32_t const first = random32() & mask;
+        rules[i] = rule (kind, allow, first, first | ~mask);
+      }
+    }
+
+    expect (relay_filter_compile (&filter, rules, rules_num));
+
+    for (uint32_t port = 0; port < 65536; port += 1 + rand() % 64) {
+      expect (relay_filter_port (&filter, (uint16_t)port)
+      == naive (rules, rules_num, RELAY_FILTER_PORT, port));
+    }
+
+    for (int i = 0; i < 1000; ++i) {
+      /* Right at a rule boundary, or anywhere */
+      const relay_filter_rule* const r = &rules[rand() % rules_num];
+      uint32_t const h = rand() % 2 ? random32() : rand() % 2 ? r->first : r->last + 1;
+      expect (relay_filter_addr (&filter.from, net (h)) == naive (rules, rules_num, RELAY_FILTER_FROM, h));
+      expect (relay_filter_addr (&filter.to, net (h)) == naive (rules, rules_num, RELAY_FILTER_TO, h));
+    }
+
+    relay_filter_release (&filter);
+  }
+
+  return test_done ("filter");
+}
@@ -0,0 +1,232 @@
+/* =============================================================================
+// BROADcast
+//
+// IGMP reports parsed into membership changes, and queries built.
+//
+// https://buymeacoff.ee/ubihazard
+// -------------------------------------------------------------------------- */
+
+#include "../relay.h"
+#include "test.h"
+
+#include <stdbool.h>
+
+/* -------------------------------------------------------------------------- */
+
+/* RFC 2236 and RFC 3376 */
+#define V1_REPORT 0x12
+#define V2_REPORT 0x16
+#define V2_LEAVE 0x17
+#define V3_REPORT 0x22
+#define QUERY 0x11
+
+#define MODE_IS_INCLUDE 1
+#define MODE_IS_EXCLUDE 2
+#define CHANGE_TO_INCLUDE 3
+#define CHANGE_TO_EXCLUDE 4
+#define ALLOW_NEW_SOURCES 5
+#define BLOCK_OLD_SOURCES 6
+
+/* Internet checksum the long way, as big-endian words */
+static uint16_t reference (const unsigned char* const buf, size_t const sz)
+{
+  uint32_t sum = 0;
+  for (size_t i = 0; i < sz; i += 2) {
+    sum += buf[i] << 8;
+    if (i + 1 < sz) sum += buf[i + 1];
+  }
+  while (sum > 0xFFFF) sum = (sum & 0xFFFF) + (sum >> 16);
+  return (uint16_t)~sum;
+}
+
+typedef struct packet {
+  unsigned char buf[512];
+  size_t ihl;
+  size_t len;
+} packet;
+
+/* IP header with the Router Alert option, as hosts send reports */
+static void packet_begin (packet* const p)
+{
+  memset (p, 0, sizeof(*p));
+  p->ihl = IP_HEADER_SIZE + 4;
+  p->buf[0] = 0x40 | (unsigned char)(p->ihl / 4);
+  p->buf[9] = 2;
+  p->buf[IP_HEADER_SIZE] = 0x94;
+  p->buf[IP_HEADER_SIZE + 1] = 4;
+  p->len = p->ihl;
+}
+
+static void put8 (packet* const p, unsigned const v)
+{
+  p->buf[p->len++] = (unsigned char)v;
+}
+
+static void put16 (packet* const p, unsigned const v)
+{
+  put8 (p, v >> 8);
+  put8 (p, v & 0xFF);
+}
+
+static void put_addr (packet* const p, uint32_t const addr)
+{
+  memcpy (p->buf + p->len, &addr, 4);
+  p->len += 4;
+}
+
+static void packet_end (packet* const p)
+{
+  unsigned char* const igmp = p->buf + p->ihl;
+  igmp[2] = igmp[3] = 0;
+  uint16_t const chksum = reference (igmp, p->len - p->ihl);
+  igmp[2] = (unsigned char)(chksum >> 8);
+  igmp[3] = (unsigned char)chksum;
+}
+
+/* IGMPv1/v2 message */
+static void simple (packet* const p, unsigned const type, uint32_t const group)
+{
+  packet_begin (p);
+  put8 (p, type);
+  put8 (p, 0);
+  put16 (p, 0);
+  put_addr (p, group);
+  packet_end (p);
+}
+
+static void v3_begin (packet* const p, unsigned const records)
+{
+  packet_begin (p);
+  put8 (p, V3_REPORT);
+  put8 (p, 0);
+  put16 (p, 0);
+  put16 (p, 0);
+  put16 (p, records);
+}
+
+/* Group record with `aux` words of auxiliary data */
+static void v3_record (packet* const p, unsigned const type, uint32_t const group
+, unsigned const sources, unsigned const aux)
+{
+  put8 (p, type);
+  put8 (p, aux);
+  put16 (p, sources);
+  put_addr (p, group);
+  for (unsigned i = 0; i < sources; ++i) put_addr (p, test_addr (10, 0, 0, 1 + i));
+  for (unsigned i = 0; i < aux * 4; ++i) put8 (p, 0xA5);
+}
+
+static unsigned parse (const packet* const p, relay_igmp* const records, unsigned const max)
+{
+  return relay_igmp_parse (p->buf, p->len, records, max);
+}
+
+int main (void)
+{
+  uint32_t const g1 = test_addr (239, 1, 2, 3);
+  uint32_t const g2 = test_addr (224, 0, 0, 251);
+  uint32_t const g3 = test_addr (239, 255, 255, 250);
+  uint32_t const g4 = test_addr (232, 4, 5, 6);
+  relay_igmp records[8];
+  packet p;
+
+  expect (relay_multicast (g1) && relay_multicast (g2));
+  expect (!relay_multicast (test_addr (223, 255, 255, 255)));
+  expect (!relay_multicast (test_addr (240, 0, 0, 0)));
+
+  /* v1/v2 reports join, v2 leaves leave */
+  simple (&p, V1_REPORT, g1);
+  expect (parse (&p, records, 8) == 1 && records[0].group == g1 && records[0].join);
+  simple (&p, V2_REPORT, g2);
+  expect (parse (&p, records, 8) == 1 && records[0].group == g2 && records[0].join);
+  simple (&p, V2_LEAVE, g1);
+  expect (parse (&p, records, 8) == 1 && records[0].group == g1 && !records[0].join);
+  expect (parse (&p, records, 0) == 0);
+
+  /* Without the Router Alert option too */
+  memmove (p.buf + IP_HEADER_SIZE, p.buf + p.ihl, p.len - p.ihl);
+  p.buf[0] = 0x45;
+  p.len -= p.ihl - IP_HEADER_SIZE;
+  expect (parse (&p, records, 8) == 1 && records[0].group == g1 && !records[0].join);
+
+  /* Not reports */
+  simple (&p, QUERY, g1);
+  expect (parse (&p, records, 8) == 0);
+  simple (&p, V2_REPORT, test_addr (192, 168, 1, 255));
+  expect (parse (&p, records, 8) == 0);
+
+  /* Bad checksum, and any single bit flipped */
+  simple (&p, V2_REPORT, g1);
+  p.buf[p.ihl + 2] ^= 0x01;
+  expect (parse (&p, records, 8) == 0);
+  p.buf[p.ihl + 2] ^= 0x01;
+  for (size_t i = p.ihl * 8; i < p.len * 8; ++i) {
+    p.buf[i / 8] ^= (unsigned char)(1 << (i % 8));
+    expect (parse (&p, records, 8) == 0);
+    p.buf[i / 8] ^= (unsigned char)(1 << (i % 8));
+  }
+
+  /* Too short for a message, or for its IP header */
+  expect (relay_igmp_parse (p.buf, p.len - 1, records, 8) == 0);
+  expect (relay_igmp_parse (p.buf, IP_HEADER_SIZE - 1, records, 8) == 0);
+  p.buf[0] = 0x44;
+  expect (parse (&p, records, 8) == 0);
+
+  /* v3: sources and aux data are skipped, and the mode decides */
+  v3_begin (&p, 7);
+  v3_record (&p, MODE_IS_EXCLUDE, g1, 0, 0);
+  v3_record (&p, CHANGE_TO_INCLUDE, g2, 0, 2);
+  v3_record (&p, MODE_IS_INCLUDE, g3, 3, 1);
+  v3_record (&p, BLOCK_OLD_SOURCES, g4, 2, 0);
+  v3_record (&p, ALLOW_NEW_SOURCES, g4, 1, 3);
+  v3_record (&p, CHANGE_TO_EXCLUDE, test_addr (10, 1, 1, 1), 1, 0);
+  v3_record (&p, ALLOW_NEW_SOURCES, g1, 0, 0);
+  packet_end (&p);
+
+  expect (parse (&p, records, 8) == 4);
+  expect (records[0].group == g1 && records[0].join);
+  expect (records[1].group == g2 && !records[1].join);
+  expect (records[2].group == g3 && records[2].join);
+  expect (records[3].group == g4 && records[3].join);
+
+  /* Up to `max` of them */
+  expect (parse (&p, records, 2) == 2 && records[1].group == g2);
+
+  /* Truncated record list: what came before the cut is kept,
+  // whether the cut is in a record or in its sources */
+  v3_begin (&p, 3);
+  v3_record (&p, MODE_IS_EXCLUDE, g1, 0, 1);
+  size_t const whole = p.len;
+  v3_record (&p, MODE_IS_INCLUDE, g2, 4, 0);
+  p.len -= 4;
+  packet_end (&p);
+  expect (parse (&p, records, 8) == 1 && records[0].group == g1);
+
+  p.len = whole + 4;
+  packet_end (&p);
+  expect (parse (&p, records, 8) == 1 && records[0].group == g1);
+
+  /* More records claimed than there are */
+  p.len = whole;
+  packet_end (&p);
+  expect (parse (&p, records, 8) == 1 && records[0].group == g1);
+
+  /* A source count running past the end */
+  v3_begin (&p, 1);
+  v3_record (&p, MODE_IS_INCLUDE, g1, 1, 0);
+  p.buf[p.len - 4 - 6] = 0xFF;
+  packet_end (&p);
+  expect (parse (&p, records, 8) == 0);
+
+  /* Queries check out with the same checksum */
+  unsigned char query[IGMP_QUERY_SIZE];
+  relay_igmp_query (query, g3, 100);
+  expect (query[0] == QUERY && query[1] == 100);
+  expect (memcmp (query + 4, &g3, 4) == 0);
+  expect (reference (query, sizeof(query)) == 0);
+  relay_igmp_query (query, 0, 10);
+  expect (query[1] == 10 && query[4] == 0 && query[7] == 0);
+  expect (reference (query, sizeof(query)) == 0);
+
+  return test_done ("igmp");
+}
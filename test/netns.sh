@@ -0,0 +1,86 @@
+#!/bin/sh
+# Relay broadcast packets between veth pairs in network namespaces,
+# once from userspace (TPACKET_V3 ring) and once in the kernel (eBPF),
+# checking what arrives on the other interfaces and comparing packet
+# rates. Needs root. Usage: test/netns.sh [packets for the rate test]
+cd "$(dirname "$0")/.."
+
+count=${1:-1000000}
+port=47000
+ns=bctest
+status=0
+
+cleanup () {
+  [ -n "$relay" ] && kill "$relay" 2> /dev/null && wait "$relay"
+  for n in relay a b c; do ip netns del "$ns-$n" 2> /dev/null; done
+}
+
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+mkdir -p test/bin
+cc -O2 -std=gnu11 broadcast_linux.c chksum.c relay.c tc_relay.c -o test/bin/broadcast \
+&& cc -O2 -std=gnu11 -Wall -Wextra test/udp_peer.c -o test/bin/udp_peer || exit 1
+
+# The relay has the preferred route through `va0` and relays to `vb0` and `vc0`,
+# each of which is wired to an interface in a namespace of its own
+cleanup
+ip netns add "$ns-relay" || exit 1
+for n in a b c; do
+  ip netns add "$ns-$n"
+  ip -n "$ns-relay" link add "v${n}0" type veth peer name "v${n}1" netns "$ns-$n"
+  ip -n "$ns-$n" link set lo up
+  ip -n "$ns-$n" link set "v${n}1" up
+  ip -n "$ns-relay" link set "v${n}0" up
+done
+ip -n "$ns-relay" link set lo up
+ip -n "$ns-relay" addr add 10.0.0.1/24 dev va0
+ip -n "$ns-relay" addr add 192.168.1.1/24 dev vb0
+ip -n "$ns-relay" addr add 172.16.0.1/24 dev vc0
+ip -n "$ns-a" addr add 10.0.0.2/24 dev va1
+ip -n "$ns-b" addr add 192.168.1.2/24 dev vb1
+ip -n "$ns-c" addr add 172.16.0.2/24 dev vc1
+ip -n "$ns-relay" route add default via 10.0.0.2 dev va0
+
+# Send from the relay namespace, and receive on `vb1` and `vc1`
+# what the relay sent from its addresses there
+run () {
+  packets=$1
+  size=$2
+  out=$(mktemp -d)
+
+  ip netns exec "$ns-b" test/bin/udp_peer recv $port "$packets" 192.168.1.1 > "$out/b" &
+  recv_b=$!
+  ip netns exec "$ns-c" test/bin/udp_peer recv $port "$packets" 172.16.0.1 > "$out/c" &
+  recv_c=$!
+  until grep -q listening "$out/b" && grep -q listening "$out/c"; do sleep 0.1; done
+
+  ip netns exec "$ns-relay" test/bin/udp_peer send $port "$packets" "$size" | sed 's/^/  /'
+  wait $recv_b || status=1
+  wait $recv_c || status=1
+  grep -v listening "$out/b" | sed 's/^/  vb1: /'
+  grep -v listening "$out/c" | sed 's/^/  vc1: /'
+  rm -rf "$out"
+}
+
+for mode in userspace kernel; do
+  echo "== Relaying from $mode"
+  opts=-d
+  [ $mode = kernel ] && opts="-d -x"
+  ip netns exec "$ns-relay" test/bin/broadcast -b $opts > test/bin/netns-$mode.log 2>&1 &
+  relay=$!
+  sleep 1
+
+  echo "Every packet, odd sizes:"
+  run 1000 333
+  echo "Rate, 64-byte packets:"
+  run "$count" 64
+
+  kill -INT $relay
+  wait $relay
+  relay=
+  sed 's/^/  /' test/bin/netns-$mode.log | tail -n 8
+done
+
+[ $status = 0 ] && echo "netns: ok" || echo "netns: FAILED"
+exit $status
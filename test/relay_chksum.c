@@ -0,0 +1,121 @@
+/* =============================================================================
+// BROADcast
+//
+// UDP checksums derived per relay interface against a full recomputation.
+//
+// https://buymeacoff.ee/ubihazard
+// -------------------------------------------------------------------------- */
+
+#include "../relay.h"
+#include "test.h"
+
+#include <stdlib.h>
+
+/* -------------------------------------------------------------------------- */
+
+/* RFC 768, the long way: pseudo-header and datagram
+// summed as big-endian words with the checksum field cleared */
+static uint16_t reference (const unsigned char* const udp, size_t const sz
+, uint32_t const addr_src, uint32_t const addr_dst)
+{
+  unsigned char pseudo[12];
+  uint32_t sum = 0;
+
+  memcpy (pseudo, &addr_src, 4);
+  memcpy (pseudo + 4, &addr_dst, 4);
+  pseudo[8] = 0;
+  pseudo[9] = 17;
+  pseudo[10] = (unsigned char)(sz >> 8);
+  pseudo[11] = (unsigned char)sz;
+
+  for (size_t i = 0; i < sizeof(pseudo); i += 2) sum += (pseudo[i] << 8) | pseudo[i + 1];
+
+  for (size_t i = 0; i < sz; i += 2) {
+    if (i == UDP_CHECKSUM_POS) continue;
+    sum += udp[i] << 8;
+    if (i + 1 < sz) sum += udp[i + 1];
+  }
+
+  while (sum > 0xFFFF) sum = (sum & 0xFFFF) + (sum >> 16);
+  uint16_t const chksum = (uint16_t)~sum;
+  return chksum == 0 ? 0xFFFF : chksum;
+}
+
+/* Checksum in a rewritten header, in host byte order */
+static uint16_t rewritten (const unsigned char* const udp, size_t const sz
+, uint32_t const addr_src, uint32_t const addr_dst)
+{
+  unsigned char header[UDP_HEADER_SIZE];
+  relay_rewrite (header, udp, relay_chksum_base (udp, sz, addr_dst), addr_src);
+  expect (memcmp (header, udp, UDP_CHECKSUM_POS) == 0);
+  return (uint16_t)((header[UDP_CHECKSUM_POS] << 8) | header[UDP_CHECKSUM_POS + 1]);
+}
+
+static void datagram (unsigned char* const udp, size_t const sz)
+{
+  for (size_t i = 0; i < sz; ++i) udp[i] = (unsigned char)rand();
+  udp[UDP_LENGTH_POS] = (unsigned char)(sz >> 8);
+  udp[UDP_LENGTH_POS + 1] = (unsigned char)sz;
+  /* Whatever the sender had, as long as it isn't zero */
+  if (udp[UDP_CHECKSUM_POS] == 0 && udp[UDP_CHECKSUM_POS + 1] == 0) udp[UDP_CHECKSUM_POS] = 1;
+}
+
+static uint32_t random_addr (void)
+{
+  static const uint32_t edges[] = {0, UINT32_MAX, 0xFFFF, 0xFFFF0000};
+  if (rand() % 8 == 0) return edges[rand() % 4];
+  return ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+}
+
+int main (void)
+{
+  static unsigned char udp[2048];
+  srand (1);
+
+  /* Every length, odd ones included, from different senders and interfaces */
+  for (size_t sz = UDP_HEADER_SIZE; sz <= 1500; ++sz) {
+    for (int round = 0; round < 8; ++round) {
+      datagram (udp, sz);
+      uint32_t const addr_src = random_addr();
+      uint32_t const addr_dst = random_addr();
+      expect (rewritten (udp, sz, addr_src, addr_dst) == reference (udp, sz, addr_src, addr_dst));
+    }
+  }
+
+  /* A zero checksum means the sender didn't use it: it stays zero */
+  for (size_t sz = UDP_HEADER_SIZE; sz < 64; ++sz) {
+    datagram (udp, sz);
+    udp[UDP_CHECKSUM_POS] = udp[UDP_CHECKSUM_POS + 1] = 0;
+    expect (rewritten (udp, sz, random_addr(), random_addr()) == 0);
+  }
+
+  /* Payloads summing up so that the checksum comes out as zero,
+  // which is sent as 0xFFFF instead */
+  for (size_t sz = UDP_HEADER_SIZE + 2; sz <= 1500; sz += 7) {
+    datagram (udp, sz);
+    uint32_t const addr_src = random_addr();
+    uint32_t const addr_dst = random_addr();
+    udp[UDP_HEADER_SIZE] = udp[UDP_HEADER_SIZE + 1] = 0;
+    uint16_t const chksum = reference (udp, sz, addr_src, addr_dst);
+    udp[UDP_HEADER_SIZE] = (unsigned char)(chksum >> 8);
+    udp[UDP_HEADER_SIZE + 1] = (unsigned char)chksum;
+    expect (reference (udp, sz, addr_src, addr_dst) == 0xFFFF);
+    expect (rewritten (udp, sz, addr_src, addr_dst) == 0xFFFF);
+  }
+
+  /* Unicast copies: the partial sum is moved to another destination */
+  for (int round = 0; round < 10000; ++round) {
+    size_t const sz = UDP_HEADER_SIZE + rand() % 600;
+    datagram (udp, sz);
+    uint32_t const addr_src = random_addr();
+    uint32_t const addr_dst = random_addr();
+    uint32_t const addr_peer = random_addr();
+    uint32_t const base = relay_chksum_redirect (relay_chksum_base (udp, sz, addr_dst)
+    , addr_dst, addr_peer);
+    uint16_t const chksum = relay_chksum (base, addr_src);
+    expect ((uint16_t)((((const unsigned char*)&chksum)[0] << 8) | ((const unsigned char*)&chksum)[1])
+    == reference (udp, sz, addr_src, addr_peer));
+  }
+
+  return test_done ("relay_chksum");
+}
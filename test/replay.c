@@ -0,0 +1,485 @@
+/* =============================================================================
+// BROADcast
+//
+// Offline replay of captured packets through the packet processing core.
+//
+// https://buymeacoff.ee/ubihazard
+// -------------------------------------------------------------------------- */
+
+#include "../chksum.h"
+#include "../relay.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* -----------------------------------------------------------------------------
+// Usage: replay <routes> <capture> [-w <output>] [-g <golden>] [-n <passes>]
+//
+// Packets are read from a pcap or pcapng capture (Ethernet or raw IPv4)
+// and run through `relay_parse()`, `relay_wanted()` and `relay_rewrite()`
+// for the relay targets `relay_targets()` finds in a made-up forwarding
+// table. What would be sent to each target is written as a raw IPv4 pcap,
+// with the IP header made up the way the capture of the Windows build
+// does it (the stack builds the real one), and/or compared byte for byte
+// with a golden one. The routes file has the preferred route address
+// and the forwarding table, one route per line:
+//
+//   route <address>
+//   <destination> <mask> <next hop> direct|indirect
+//
+// The whole capture is then replayed `passes` more times (from memory,
+// recording nothing) to measure packets per second. */
+
+#define PCAP_MAGIC 0xA1B2C3D4
+#define PCAP_MAGIC_NS 0xA1B23C4D
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 1
+#define PCAPNG_EPB 6
+#define PCAPNG_BYTE_ORDER 0x1A2B3C4D
+
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_IPV4 228
+
+#define ETHER_HEADER_SIZE 14
+#define ROUTES_MAX 256
+#define IFACES_MAX 64
+#define TARGETS_MAX 64
+
+typedef struct packet {
+  const unsigned char* data;
+  uint32_t len;
+  uint32_t ts_sec;
+  uint32_t ts_usec;
+} packet;
+
+typedef struct replay_stats {
+  unsigned long relayed;
+  unsigned long ignored;
+  unsigned long malformed;
+} replay_stats;
+
+typedef struct output {
+  unsigned char* data;
+  size_t len;
+  size_t cap;
+} output;
+
+/* -------------------------------------------------------------------------- */
+
+static uint32_t get32 (const unsigned char* const p, int const swap)
+{
+  uint32_t v;
+  memcpy (&v, p, sizeof(v));
+  return swap ? __builtin_bswap32 (v) : v;
+}
+
+static uint16_t get16 (const unsigned char* const p, int const swap)
+{
+  uint16_t v;
+  memcpy (&v, p, sizeof(v));
+  return swap ? __builtin_bswap16 (v) : v;
+}
+
+static unsigned char* load (const char* const path, size_t* const len)
+{
+  FILE* const file = fopen (path, "rb");
+  if (file == NULL) return NULL;
+
+  unsigned char* data = NULL;
+  size_t cap = 0;
+  *len = 0;
+
+  for (;;) {
+    if (*len == cap) {
+      cap = cap != 0 ? cap * 2 : 1 << 16;
+      unsigned char* const data_new = realloc (data, cap);
+      if (data_new == NULL) break;
+      data = data_new;
+    }
+    size_t const got = fread (data + *len, 1, cap - *len, file);
+    if (got == 0) break;
+    *len += got;
+  }
+
+  int const err = ferror (file);
+  fclose (file);
+  if (err) {
+    free (data);
+    return NULL;
+  }
+  return data;
+}
+
+/* IPv4 packet in a link-layer frame, if it is one */
+static int unframe (unsigned const linktype, const unsigned char* data, uint32_t len
+, packet* const pkt)
+{
+  if (linktype == LINKTYPE_ETHERNET) {
+    if (len < ETHER_HEADER_SIZE || data[12] != 0x08 || data[13] != 0x00) return 0;
+    data += ETHER_HEADER_SIZE;
+    len -= ETHER_HEADER_SIZE;
+  } else if (linktype != LINKTYPE_RAW && linktype != LINKTYPE_IPV4) return 0;
+
+  pkt->data = data;
+  pkt->len = len;
+  return 1;
+}
+
+/* Packets of a pcap or pcapng capture, pointing into `data`.
+// Returns the number of packets, or -1 if it can't be read. */
+static long capture_read (const unsigned char* const data, size_t const len
+, packet** const pkts)
+{
+  size_t num = 0, cap = 0;
+  *pkts = NULL;
+
+  if (len < 24) return -1;
+  uint32_t const magic = get32 (data, 0);
+
+  if (magic == PCAPNG_SHB) {
+    unsigned linktypes[IFACES_MAX];
+    unsigned ifaces_num = 0;
+    int swap = 0;
+
+    for (size_t pos = 0; pos + 12 <= len;) {
+      uint32_t const type = get32 (data + pos, swap);
+      if (type == PCAPNG_SHB) {
+        swap = get32 (data + pos + 8, 0) != PCAPNG_BYTE_ORDER;
+        ifaces_num = 0;
+      }
+      uint32_t const block_len = get32 (data + pos + 4, swap);
+      if (block_len < 12 || block_len % 4 != 0 || block_len > len - pos) return -1;
+      const unsigned char* const block = data + pos;
+      pos += block_len;
+
+      if (type == PCAPNG_IDB && ifaces_num < IFACES_MAX) {
+        linktypes[ifaces_num++] = get16 (block + 8, swap);
+      } else if (type == PCAPNG_EPB && block_len >= 32) {
+        uint32_t const iface = get32 (block + 8, swap);
+        uint32_t const caplen = get32 (block + 20, swap);
+        if (iface >= ifaces_num || caplen > block_len - 32) return -1;
+
+        if (num == cap) {
+          cap = cap != 0 ? cap * 2 : 1024;
+          packet* const pkts_new = realloc (*pkts, cap * sizeof(**pkts));
+          if (pkts_new == NULL) return -1;
+          *pkts = pkts_new;
+        }
+
+        /* Microseconds, as the Windows build writes them */
+        uint64_t const ts = ((uint64_t)get32 (block + 12, swap) << 32) | get32 (block + 16, swap);
+        packet* const pkt = &(*pkts)[num];
+        pkt->ts_sec = (uint32_t)(ts / 1000000);
+        pkt->ts_usec = (uint32_t)(ts % 1000000);
+        if (unframe (linktypes[iface], block + 28, caplen, pkt)) num++;
+      }
+    }
+
+    return (long)num;
+  }
+
+  int swap;
+  if (magic == PCAP_MAGIC || magic == PCAP_MAGIC_NS) swap = 0;
+  else if (magic == __builtin_bswap32 (PCAP_MAGIC) || magic == __builtin_bswap32 (PCAP_MAGIC_NS)) swap = 1;
+  else return -1;
+
+  unsigned const linktype = get32 (data + 20, swap) & 0xFFFF;
+
+  for (size_t pos = 24; pos + 16 <= len;) {
+    uint32_t const caplen = get32 (data + pos + 8, swap);
+    if (caplen > len - pos - 16) return -1;
+
+    if (num == cap) {
+      cap = cap != 0 ? cap * 2 : 1024;
+      packet* const pkts_new = realloc (*pkts, cap * sizeof(**pkts));
+      if (pkts_new == NULL) return -1;
+      *pkts = pkts_new;
+    }
+
+    packet* const pkt = &(*pkts)[num];
+    pkt->ts_sec = get32 (data + pos, swap);
+    pkt->ts_usec = get32 (data + pos + 4, swap);
+    if (magic != PCAP_MAGIC && magic != __builtin_bswap32 (PCAP_MAGIC)) pkt->ts_usec /= 1000;
+    if (unframe (linktype, data + pos + 16, caplen, pkt)) num++;
+    pos += 16 + caplen;
+  }
+
+  return (long)num;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static int parse_addr (const char* const str, uint32_t* const addr)
+{
+  unsigned a, b, c, d;
+  char tail;
+
+  if (sscanf (str, "%u.%u.%u.%u%c", &a, &b, &c, &d, &tail) != 4) return 0;
+  if (a > 255 || b > 255 || c > 255 || d > 255) return 0;
+
+  const unsigned char bytes[4] = {(unsigned char)a, (unsigned char)b
+  , (unsigned char)c, (unsigned char)d};
+  memcpy (addr, bytes, sizeof(*addr));
+  return 1;
+}
+
+static int routes_read (const char* const path, uint32_t* const addr_route
+, relay_route* const routes, size_t* const routes_num)
+{
+  FILE* const file = fopen (path, "r");
+  if (file == NULL) return 0;
+
+  char line[256];
+  unsigned line_num = 0;
+  int ok = 1;
+  *routes_num = 0;
+  *addr_route = 0;
+
+  while (ok && fgets (line, sizeof(line), file) != NULL) {
+    char f[4][64];
+    line_num++;
+
+    int const num = sscanf (line, "%63s %63s %63s %63s", f[0], f[1], f[2], f[3]);
+    if (num <= 0 || f[0][0] == '#') continue;
+
+    if (num == 2 && strcmp (f[0], "route") == 0) {
+      ok = parse_addr (f[1], addr_route);
+    } else if (num == 4 && *routes_num < ROUTES_MAX) {
+      relay_route* const route = &routes[(*routes_num)++];
+      ok = parse_addr (f[0], &route->dest) && parse_addr (f[1], &route->mask)
+      && parse_addr (f[2], &route->next_hop)
+      && (strcmp (f[3], "direct") == 0 || strcmp (f[3], "indirect") == 0);
+      route->direct = strcmp (f[3], "direct") == 0;
+    } else ok = 0;
+
+    if (!ok) fprintf (stderr, "%s:%u: invalid route\n", path, line_num);
+  }
+
+  fclose (file);
+  return ok;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static int output_put (output* const out, const void* const data, size_t const len)
+{
+  if (out->cap - out->len < len) {
+    size_t cap = out->cap != 0 ? out->cap : 1 << 16;
+    while (cap - out->len < len) cap *= 2;
+    unsigned char* const data_new = realloc (out->data, cap);
+    if (data_new == NULL) return 0;
+    out->data = data_new;
+    out->cap = cap;
+  }
+
+  memcpy (out->data + out->len, data, len);
+  out->len += len;
+  return 1;
+}
+
+static int output_put32 (output* const out, uint32_t const v)
+{
+  return output_put (out, &v, sizeof(v));
+}
+
+static int output_header (output* const out)
+{
+  return output_put32 (out, PCAP_MAGIC) && output_put32 (out, 2 | (4 << 16))
+  && output_put32 (out, 0) && output_put32 (out, 0)
+  && output_put32 (out, 65535) && output_put32 (out, LINKTYPE_RAW);
+}
+
+/* Datagram relayed to one target, with a made-up IP header */
+static int output_packet (output* const out, const packet* const pkt
+, const unsigned char* const udp_header, const relay_hdr* const hdr, uint32_t const addr_src)
+{
+  unsigned char head[IP_HEADER_SIZE] = {0};
+  uint32_t const total = IP_HEADER_SIZE + hdr->size;
+
+  head[0] = 0x45;
+  head[2] = (unsigned char)(total >> 8);
+  head[3] = (unsigned char)total;
+  head[8] = 64;
+  head[9] = 17;
+  memcpy (head + IP_ADDR_SRC_POS, &addr_src, sizeof(addr_src));
+  memcpy (head + IP_ADDR_DST_POS, &hdr->addr_dst, sizeof(hdr->addr_dst));
+  uint16_t const chksum = ~chksum_scalar (head, IP_HEADER_SIZE);
+  memcpy (head + 10, &chksum, sizeof(chksum));
+
+  return output_put32 (out, pkt->ts_sec) && output_put32 (out, pkt->ts_usec)
+  && output_put32 (out, total) && output_put32 (out, total)
+  && output_put (out, head, sizeof(head))
+  && output_put (out, udp_header, UDP_HEADER_SIZE)
+  && output_put (out, hdr->udp + UDP_HEADER_SIZE, hdr->size - UDP_HEADER_SIZE);
+}
+
+/* What the core does with every packet: relay copies are recorded in `out`,
+// if given. Returns 0 if out of memory. */
+static int replay (const packet* const pkts, size_t const pkts_num
+, uint32_t const addr_route, const uint32_t* const targets, unsigned const targets_num
+, output* const out, replay_stats* const stats)
+{
+  uint32_t const addr_broadcast = UINT32_MAX;
+
+  for (size_t i = 0; i < pkts_num; ++i) {
+    const packet* const pkt = &pkts[i];
+    relay_hdr hdr;
+
+    if (!relay_parse (pkt->data, pkt->len, &hdr)) {
+      stats->malformed++;
+      continue;
+    }
+
+    if (!relay_wanted (&hdr, addr_route, addr_broadcast)) {
+      stats->ignored++;
+      continue;
+    }
+
+    uint32_t const base = relay_chksum_base (hdr.udp, hdr.size, hdr.addr_dst);
+
+    for (unsigned j = 0; j < targets_num; ++j) {
+      unsigned char udp_header[UDP_HEADER_SIZE];
+      relay_rewrite (udp_header, hdr.udp, base, targets[j]);
+      stats->relayed++;
+      if (out != NULL && !output_packet (out, pkt, udp_header, &hdr, targets[j])) return 0;
+    }
+  }
+
+  return 1;
+}
+
+/* Index of the first packet where two pcap images differ */
+static size_t first_difference (const unsigned char* const a, size_t const a_len
+, const unsigned char* const b, size_t const b_len)
+{
+  size_t pos = 24, index = 0;
+
+  while (pos + 16 <= a_len && pos + 16 <= b_len) {
+    uint32_t const len = get32 (a + pos + 8, 0);
+    if (pos + 16 + len > a_len || pos + 16 + len > b_len
+    || memcmp (a + pos, b + pos, 16 + len) != 0) break;
+    pos += 16 + len;
+    index++;
+  }
+
+  return index;
+}
+
+static double now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int main (int const argc, char** const argv)
+{
+  const char* path_out = NULL;
+  const char* path_golden = NULL;
+  long passes = 1;
+
+  if (argc < 3) {
+    fprintf (stderr, "Usage: %s <routes> <capture> [-w <output>] [-g <golden>] [-n <passes>]\n"
+    , argv[0]);
+    return 2;
+  }
+
+  for (int i = 3; i < argc; ++i) {
+    if (i + 1 < argc && strcmp (argv[i], "-w") == 0) path_out = argv[++i];
+    else if (i + 1 < argc && strcmp (argv[i], "-g") == 0) path_golden = argv[++i];
+    else if (i + 1 < argc && strcmp (argv[i], "-n") == 0) passes = strtol (argv[++i], NULL, 10);
+    else {
+      fprintf (stderr, "Unknown option: %s\n", argv[i]);
+      return 2;
+    }
+  }
+
+  if (passes < 1) passes = 1;
+
+  /* Made-up forwarding table */
+  static relay_route routes[ROUTES_MAX];
+  size_t routes_num;
+  uint32_t addr_route;
+
+  if (!routes_read (argv[1], &addr_route, routes, &routes_num)) {
+    fprintf (stderr, "Couldn't read the routes from %s\n", argv[1]);
+    return 2;
+  }
+
+  uint32_t targets[TARGETS_MAX], nets[TARGETS_MAX], masks[TARGETS_MAX];
+  unsigned const targets_num = relay_targets (routes, routes_num, addr_route
+  , NULL, NULL, targets, nets, masks, TARGETS_MAX);
+
+  /* Captured packets */
+  size_t capture_len;
+  unsigned char* const capture = load (argv[2], &capture_len);
+  packet* pkts = NULL;
+  long const pkts_num = capture != NULL ? capture_read (capture, capture_len, &pkts) : -1;
+
+  if (pkts_num < 0) {
+    fprintf (stderr, "Couldn't read the capture from %s\n", argv[2]);
+    return 2;
+  }
+
+  /* One pass to record what is relayed, then the timed ones */
+  replay_stats stats = {0};
+  output out = {0};
+  int const ok = output_header (&out) && replay (pkts, (size_t)pkts_num, addr_route
+  , targets, targets_num, &out, &stats);
+
+  if (!ok) {
+    fprintf (stderr, "Out of memory\n");
+    return 2;
+  }
+
+  replay_stats scratch = {0};
+  double const start = now();
+  for (long pass = 0; pass < passes; ++pass) {
+    replay (pkts, (size_t)pkts_num, addr_route, targets, targets_num, NULL, &scratch);
+  }
+  double const elapsed = now() - start;
+
+  printf ("%ld packets: %lu relayed to %u targets, %lu ignored, %lu malformed\n"
+  , pkts_num, stats.relayed, targets_num, stats.ignored, stats.malformed);
+  if (pkts_num != 0) {
+    printf ("Replayed %ld times: %.0f packets/s, %.1f ns/packet\n", passes
+    , pkts_num * passes / elapsed, elapsed * 1e9 / (pkts_num * passes));
+  }
+
+  int status = 0;
+
+  if (path_out != NULL) {
+    FILE* const file = fopen (path_out, "wb");
+    if (file == NULL || fwrite (out.data, 1, out.len, file) != out.len) {
+      fprintf (stderr, "Couldn't write %s\n", path_out);
+      status = 2;
+    }
+    if (file != NULL && fclose (file) != 0) status = 2;
+  }
+
+  if (path_golden != NULL) {
+    size_t golden_len;
+    unsigned char* const golden = load (path_golden, &golden_len);
+
+    if (golden == NULL) {
+      fprintf (stderr, "Couldn't read %s\n", path_golden);
+      status = 2;
+    } else if (golden_len != out.len || memcmp (golden, out.data, out.len) != 0) {
+      fprintf (stderr, "Output differs from %s from packet %zu on\n", path_golden
+      , first_difference (out.data, out.len, golden, golden_len));
+      status = 1;
+    } else printf ("Output matches %s\n", path_golden);
+
+    free (golden);
+  }
+
+  free (out.data);
+  free (pkts);
+  free (capture);
+  return status;
+}
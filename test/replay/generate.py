@@ -0,0 +1,157 @@
+#!/usr/bin/env python3
+# =============================================================================
+# BROADcast
+#
+# Makes the captures `test/replay.c` is checked against, computing
+# what should be relayed independently of the C code.
+#
+# https://buymeacoff.ee/ubihazard
+# -----------------------------------------------------------------------------
+
+import os
+import random
+import struct
+
+HERE = os.path.dirname (os.path.abspath (__file__))
+
+ROUTE = "192.168.1.10"
+TARGETS = ["10.0.0.5", "172.16.3.1"]
+
+ROUTES = """\
+# Preferred route to 255.255.255.255
+route 192.168.1.10
+# Destination, mask, next hop, direct or indirect
+0.0.0.0 0.0.0.0 192.168.1.1 indirect
+192.168.1.0 255.255.255.0 192.168.1.10 direct
+255.255.255.255 255.255.255.255 192.168.1.10 direct
+10.0.0.0 255.255.255.0 10.0.0.5 direct
+255.255.255.255 255.255.255.255 10.0.0.5 direct
+255.255.255.255 255.255.255.255 127.0.0.1 direct
+255.255.255.255 255.255.255.255 10.9.9.9 indirect
+172.16.0.0 255.255.0.0 172.16.3.1 direct
+255.255.255.255 255.255.255.255 172.16.3.1 direct
+"""
+
+def addr (s):
+  return bytes (int (x) for x in s.split ("."))
+
+def fold (s):
+  while s > 0xFFFF:
+    s = (s & 0xFFFF) + (s >> 16)
+  return s
+
+def sum16 (data):
+  if len (data) % 2:
+    data += b"\0"
+  return sum (struct.unpack ("!%dH" % (len (data) // 2), data))
+
+# RFC 768 checksum, zero sent as 0xFFFF
+def udp_chksum (src, dst, udp):
+  udp = udp[:6] + b"\0\0" + udp[8:]
+  pseudo = src + dst + struct.pack ("!BBH", 0, 17, len (udp))
+  c = ~fold (sum16 (pseudo) + sum16 (udp)) & 0xFFFF
+  return c or 0xFFFF
+
+def ip_header (src, dst, payload_len, ttl = 64):
+  h = struct.pack ("!BBHHHBBH4s4s", 0x45, 0, 20 + payload_len, 0, 0, ttl, 17, 0, src, dst)
+  c = ~fold (sum16 (h)) & 0xFFFF
+  return h[:10] + struct.pack ("!H", c) + h[12:]
+
+def udp (sport, dport, payload, src, dst, chksum = True):
+  u = struct.pack ("!HHHH", sport, dport, 8 + len (payload), 0) + payload
+  if chksum:
+    u = u[:6] + struct.pack ("!H", udp_chksum (src, dst, u)) + u[8:]
+  return u
+
+def pcap (linktype, records):
+  out = struct.pack ("<IHHiIII", 0xA1B2C3D4, 2, 4, 0, 0, 65535, linktype)
+  for sec, usec, data in records:
+    out += struct.pack ("<IIII", sec, usec, len (data), len (data)) + data
+  return out
+
+def pcapng (records):
+  def block (t, body):
+    body += b"\0" * (-len (body) % 4)
+    n = 12 + len (body)
+    return struct.pack ("<II", t, n) + body + struct.pack ("<I", n)
+  out = block (0x0A0D0D0A, struct.pack ("<IHHq", 0x1A2B3C4D, 1, 0, -1))
+  out += block (1, struct.pack ("<HHI", 101, 0, 0))
+  for sec, usec, data in records:
+    ts = sec * 1000000 + usec
+    out += block (6, struct.pack ("<IIIII", 0, ts >> 32, ts & 0xFFFFFFFF, len (data), len (data)) + data)
+  return out
+
+def main ():
+  rnd = random.Random (1)
+  src = addr (ROUTE)
+  bcast = addr ("255.255.255.255")
+  inputs = []
+
+  def wanted (payload, sport, dport, chksum = True):
+    inputs.append (ip_header (src, bcast, 8 + len (payload)) + udp (sport, dport, payload, src, bcast, chksum))
+
+  # Every payload size up to a couple of vector widths, odd ones included
+  for n in range (0, 80):
+    wanted (bytes (rnd.randrange (256) for _ in range (n)), 40000 + n, 6112)
+  # Full-size datagrams
+  for n in (1471, 1472):
+    wanted (bytes (rnd.randrange (256) for _ in range (n)), 1234, 27015)
+  # No checksum: stays that way
+  for n in (0, 1, 17, 300):
+    wanted (bytes (rnd.randrange (256) for _ in range (n)), 5353, 5353, chksum = False)
+  # Checksum that comes out as zero for the first target: sent as 0xFFFF
+  payload = bytearray (rnd.randrange (256) for _ in range (40))
+  payload[0:2] = b"\0\0"
+  c = udp_chksum (addr (TARGETS[0]), bcast, udp (7777, 7777, bytes (payload), src, bcast, False))
+  payload[0:2] = struct.pack ("!H", c)
+  assert udp_chksum (addr (TARGETS[0]), bcast, udp (7777, 7777, bytes (payload), src, bcast, False)) == 0xFFFF
+  wanted (bytes (payload), 7777, 7777)
+
+  # Not from the preferred route, or not a broadcast
+  other = addr ("10.0.0.5")
+  inputs.append (ip_header (other, bcast, 12) + udp (1, 2, b"abcd", other, bcast))
+  inputs.append (ip_header (src, addr ("192.168.1.255"), 12) + udp (1, 2, b"abcd", src, addr ("192.168.1.255")))
+  inputs.append (ip_header (src, addr ("192.168.1.1"), 12) + udp (1, 2, b"abcd", src, addr ("192.168.1.1")))
+  # Malformed: too short for the UDP header, UDP length past the end, below 8
+  inputs.append (ip_header (src, bcast, 4) + b"\0\1\0\2")
+  bad = udp (1, 2, b"abcdef", src, bcast)
+  inputs.append (ip_header (src, bcast, len (bad)) + bad[:4] + struct.pack ("!H", 100) + bad[6:])
+  inputs.append (ip_header (src, bcast, len (bad)) + bad[:4] + struct.pack ("!H", 4) + bad[6:])
+
+  records = [(1700000000 + i // 10, (i % 10) * 100000, p) for i, p in enumerate (inputs)]
+
+  # As seen on an Ethernet link, with some ARP in between
+  arp = b"\xff" * 6 + b"\x02\0\0\0\0\1" + b"\x08\x06" + bytes (28)
+  ether = []
+  for sec, usec, p in records:
+    ether.append ((sec, usec, b"\xff" * 6 + b"\x02\0\0\0\0\1" + b"\x08\x00" + p))
+    if usec == 0:
+      ether.append ((sec, usec, arp))
+
+  # What should go out to each target
+  golden = []
+  for sec, usec, p in records:
+    u = p[20:]
+    if p[12:16] != src or p[16:20] != bcast or len (u) < 8:
+      continue
+    size = struct.unpack ("!H", u[4:6])[0]
+    if size < 8 or size > len (u):
+      continue
+    u = u[:size]
+    for t in TARGETS:
+      tu = u
+      if u[6:8] != b"\0\0":
+        tu = u[:6] + struct.pack ("!H", udp_chksum (addr (t), bcast, u)) + u[8:]
+      golden.append ((sec, usec, ip_header (addr (t), bcast, len (tu)) + tu))
+
+  files = {
+    "routes.txt": ROUTES.encode(),
+    "input.pcap": pcap (1, ether),
+    "input.pcapng": pcapng (records),
+    "golden.pcap": pcap (101, golden),
+  }
+  for name, data in files.items():
+    with open (os.path.join (HERE, name), "wb") as f:
+      f.write (data)
+
+main()
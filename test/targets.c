@@ -0,0 +1,87 @@
+/* =============================================================================
+// BROADcast
+//
+// Relay target selection out of a forwarding table.
+//
+// https://buymeacoff.ee/ubihazard
+// -------------------------------------------------------------------------- */
+
+#include "../relay.h"
+#include "test.h"
+
+/* -------------------------------------------------------------------------- */
+
+#define ADDR_ROUTE test_addr (192, 168, 1, 10)
+
+static bool deny_second_lan (uint32_t const addr, void* const ctx)
+{
+  (*(unsigned*)ctx)++;
+  return addr != test_addr (10, 2, 0, 1);
+}
+
+int main (void)
+{
+  uint32_t const all = UINT32_MAX;
+  relay_route const routes[] = {
+    /* Preferred route */
+    {all, all, ADDR_ROUTE, true},
+    /* LAN with two direct subnet routes: the narrowest one wins */
+    {all, all, test_addr (10, 0, 0, 5), true},
+    {test_addr (10, 0, 0, 0), test_addr (255, 255, 0, 0), test_addr (10, 0, 0, 5), true},
+    {test_addr (10, 0, 0, 0), test_addr (255, 255, 255, 0), test_addr (10, 0, 0, 5), true},
+    {test_addr (10, 0, 0, 0), test_addr (255, 255, 240, 0), test_addr (10, 0, 0, 5), true},
+    /* Host route of the interface itself doesn't make a subnet */
+    {test_addr (10, 0, 0, 5), all, test_addr (10, 0, 0, 5), true},
+    /* Only the multicast route besides the broadcast one */
+    {all, all, test_addr (10, 1, 0, 1), true},
+    {test_addr (224, 0, 0, 0), test_addr (240, 0, 0, 0), test_addr (10, 1, 0, 1), true},
+    /* Rejected by the filter */
+    {all, all, test_addr (10, 2, 0, 1), true},
+    /* Not direct, loopback, no address, not the broadcast route */
+    {all, all, test_addr (172, 16, 0, 1), false},
+    {all, all, test_addr (127, 0, 0, 1), true},
+    {all, all, 0, true},
+    {test_addr (10, 3, 0, 255), all, test_addr (10, 3, 0, 1), true},
+    {all, test_addr (255, 255, 255, 0), test_addr (10, 4, 0, 1), true},
+    /* Indirect routes don't make a subnet either */
+    {test_addr (10, 1, 0, 0), test_addr (255, 255, 0, 0), test_addr (10, 1, 0, 1), false},
+  };
+  size_t const routes_num = sizeof(routes) / sizeof(*routes);
+
+  uint32_t addrs[8], nets[8], masks[8];
+  unsigned asked = 0;
+
+  unsigned num = relay_targets (routes, routes_num, ADDR_ROUTE, deny_second_lan, &asked
+  , addrs, nets, masks, 8);
+
+  expect (num == 2);
+  expect (asked == 3);
+  expect (addrs[0] == test_addr (10, 0, 0, 5));
+  expect (nets[0] == test_addr (10, 0, 0, 0));
+  expect (masks[0] == test_addr (255, 255, 255, 0));
+  expect (addrs[1] == test_addr (10, 1, 0, 1));
+  expect (nets[1] == 0 && masks[1] == 0);
+
+  /* Without a filter */
+  num = relay_targets (routes, routes_num, ADDR_ROUTE, NULL, NULL, addrs, nets, masks, 8);
+  expect (num == 3);
+  expect (addrs[2] == test_addr (10, 2, 0, 1));
+
+  /* The preferred route is only left out while it is preferred */
+  num = relay_targets (routes, routes_num, test_addr (10, 0, 0, 5), NULL, NULL
+  , addrs, nets, masks, 8);
+  expect (num == 3);
+  expect (addrs[0] == ADDR_ROUTE);
+  expect (masks[0] == 0);
+
+  /* Room for fewer */
+  num = relay_targets (routes, routes_num, ADDR_ROUTE, NULL, NULL, addrs, nets, masks, 1);
+  expect (num == 1);
+  expect (addrs[0] == test_addr (10, 0, 0, 5));
+  expect (masks[0] == test_addr (255, 255, 255, 0));
+
+  /* Empty table */
+  expect (relay_targets (NULL, 0, ADDR_ROUTE, NULL, NULL, addrs, nets, masks, 8) == 0);
+
+  return test_done ("targets");
+}
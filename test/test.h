@@ -0,0 +1,40 @@
+/* =============================================================================
+// BROADcast
+//
+// Minimal test helpers for the portable code.
+//
+// https://buymeacoff.ee/ubihazard
+// -------------------------------------------------------------------------- */
+
+#ifndef BROADCAST_TEST_H
+#define BROADCAST_TEST_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/* -------------------------------------------------------------------------- */
+
+static int test_failures;
+
+#define expect(cond) ((cond) ? (void)0 \
+: (void)(fprintf (stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, #cond), ++test_failures))
+
+/* IPv4 address in network byte order */
+static inline uint32_t test_addr (unsigned a, unsigned b, unsigned c, unsigned d)
+{
+  const unsigned char bytes[4] = {(unsigned char)a, (unsigned char)b
+  , (unsigned char)c, (unsigned char)d};
+  uint32_t addr;
+  memcpy (&addr, bytes, sizeof(addr));
+  return addr;
+}
+
+static inline int test_done (const char* const name)
+{
+  if (test_failures != 0) fprintf (stderr, "%s: %d failure(s)\n", name, test_failures);
+  else printf ("%s: ok\n", name);
+  return test_failures != 0;
+}
+
+#endif /* BROADCAST_TEST_H */
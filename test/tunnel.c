@@ -0,0 +1,118 @@
+/* =============================================================================
+// BROADcast
+//
+// Tunnel batches packed and unpacked, and malformed ones rejected.
+//
+// https://buymeacoff.ee/ubihazard
+// -------------------------------------------------------------------------- */
+
+#include "../relay.h"
+#include "test.h"
+
+#include <stdlib.h>
+
+/* -------------------------------------------------------------------------- */
+
+static void datagram (unsigned char* const udp, uint32_t const sz)
+{
+  for (uint32_t i = 0; i < sz; ++i) udp[i] = (unsigned char)rand();
+  udp[UDP_LENGTH_POS] = (unsigned char)(sz >> 8);
+  udp[UDP_LENGTH_POS + 1] = (unsigned char)sz;
+}
+
+/* Batch of a single record of `sz` bytes claiming `rec_sz` bytes */
+static size_t single (unsigned char* const buf, uint32_t const sz, uint32_t const rec_sz)
+{
+  size_t const len = relay_tunnel_begin (buf);
+  buf[len] = (unsigned char)(rec_sz >> 8);
+  buf[len + 1] = (unsigned char)rec_sz;
+  datagram (buf + len + TUNNEL_RECORD_HEADER_SIZE, sz);
+  buf[TUNNEL_HEADER_SIZE - 1] = 1;
+  return len + TUNNEL_RECORD_HEADER_SIZE + sz;
+}
+
+static bool next_fails (const unsigned char* const buf, size_t const len)
+{
+  size_t pos = TUNNEL_HEADER_SIZE;
+  const unsigned char* udp;
+  uint32_t size;
+  return !relay_tunnel_next (buf, len, &pos, &udp, &size);
+}
+
+int main (void)
+{
+  static unsigned char buf[TUNNEL_DATAGRAM_MAX];
+  static unsigned char udps[64][1500];
+  static const uint32_t sizes[] = {UDP_HEADER_SIZE, 9, 64, 333, 1472, 1500};
+  uint32_t udps_sz[64];
+  srand (1);
+
+  /* Round trip */
+  size_t len = relay_tunnel_begin (buf);
+  expect (len == TUNNEL_HEADER_SIZE);
+  expect (relay_tunnel_count (buf, len) == 0);
+
+  for (unsigned i = 0; i < 64; ++i) {
+    udps_sz[i] = sizes[i % (sizeof(sizes) / sizeof(sizes[0]))];
+    datagram (udps[i], udps_sz[i]);
+    size_t const len_new = relay_tunnel_add (buf, len, sizeof(buf), udps[i], udps_sz[i]);
+    expect (len_new == len + TUNNEL_RECORD_HEADER_SIZE + udps_sz[i]);
+    len = len_new;
+  }
+
+  expect (relay_tunnel_count (buf, len) == 64);
+
+  size_t pos = TUNNEL_HEADER_SIZE;
+  const unsigned char* udp;
+  uint32_t size;
+
+  for (unsigned i = 0; i < 64; ++i) {
+    expect (relay_tunnel_next (buf, len, &pos, &udp, &size));
+    expect (size == udps_sz[i] && memcmp (udp, udps[i], size) == 0);
+  }
+
+  expect (pos == len);
+  expect (!relay_tunnel_next (buf, len, &pos, &udp, &size));
+
+  /* Capacity: a record that would go past `cap` is refused
+  // and leaves the batch as it was */
+  size_t const cap = TUNNEL_HEADER_SIZE + 2 * (TUNNEL_RECORD_HEADER_SIZE + 64);
+  len = relay_tunnel_begin (buf);
+  len = relay_tunnel_add (buf, len, cap, udps[2], 64);
+  len = relay_tunnel_add (buf, len, cap, udps[2], 64);
+  expect (len == cap);
+  expect (relay_tunnel_add (buf, len, cap, udps[0], UDP_HEADER_SIZE) == 0);
+  expect (relay_tunnel_count (buf, len) == 2);
+  /* One byte short for the first record */
+  len = relay_tunnel_begin (buf);
+  expect (relay_tunnel_add (buf, len, TUNNEL_HEADER_SIZE + TUNNEL_RECORD_HEADER_SIZE + 63
+  , udps[2], 64) == 0);
+  expect (relay_tunnel_count (buf, len) == 0);
+
+  /* Not a batch: bad magic, bad version, too short */
+  len = single (buf, 64, 64);
+  expect (relay_tunnel_count (buf, len) == 1);
+  buf[0] ^= 1;
+  expect (relay_tunnel_count (buf, len) == 0);
+  buf[0] ^= 1;
+  buf[4]++;
+  expect (relay_tunnel_count (buf, len) == 0);
+  buf[4]--;
+  expect (relay_tunnel_count (buf, TUNNEL_HEADER_SIZE - 1) == 0);
+
+  /* Malformed records */
+  len = single (buf, 64, 64);
+  expect (!next_fails (buf, len));
+  /* Cut short, in the record or in its size */
+  expect (next_fails (buf, len - 1));
+  expect (next_fails (buf, TUNNEL_HEADER_SIZE + 1));
+  /* UDP length disagreeing with the record size */
+  buf[TUNNEL_HEADER_SIZE + TUNNEL_RECORD_HEADER_SIZE + UDP_LENGTH_POS + 1] = 63;
+  expect (next_fails (buf, len));
+  /* Shorter than a UDP header, even if it agrees with itself */
+  len = single (buf, UDP_HEADER_SIZE, UDP_HEADER_SIZE - 1);
+  buf[TUNNEL_HEADER_SIZE + TUNNEL_RECORD_HEADER_SIZE + UDP_LENGTH_POS + 1] = UDP_HEADER_SIZE - 1;
+  expect (next_fails (buf, len));
+
+  return test_done ("tunnel");
+}
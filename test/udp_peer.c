@@ -0,0 +1,219 @@
+/* =============================================================================
+// BROADcast
+//
+// Broadcast sender and receiver for the network namespace test.
+//
+// https://buymeacoff.ee/ubihazard
+// -------------------------------------------------------------------------- */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/* -----------------------------------------------------------------------------
+// Usage: udp_peer send <port> <count> <size>
+//        udp_peer recv <port> <count> <source address>
+//
+// The sender sends `count` datagrams of `size` bytes to 255.255.255.255
+// as fast as it can. Each one starts with its sequence number, followed
+// by a pattern. The receiver waits for `count` datagrams, or until none
+// came for a second. It checks that they came from the source address,
+// were not changed and were not duplicated, then prints how many arrived
+// and at what rate. It fails if any was wrong or, with `count`
+// below 10000, missing. */
+
+#define BATCH 64
+#define SIZE_MAX_ 1472
+#define IDLE_MS 1000
+
+static double now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static unsigned char pattern (unsigned const i)
+{
+  return (unsigned char)(i * 7 + 3);
+}
+
+static int peer_send (int const sock, unsigned short const port
+, unsigned long const count, size_t const size)
+{
+  static unsigned char bufs[BATCH][SIZE_MAX_];
+  struct iovec iovs[BATCH];
+  struct mmsghdr msgs[BATCH];
+  struct sockaddr_in const sa = {
+    .sin_family = AF_INET,
+    .sin_port = htons (port),
+    .sin_addr.s_addr = INADDR_BROADCAST
+  };
+  int const on = 1;
+
+  if (setsockopt (sock, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on)) != 0) {
+    perror ("SO_BROADCAST");
+    return 1;
+  }
+
+  for (unsigned i = 0; i < BATCH; ++i) {
+    for (size_t j = 4; j < size; ++j) bufs[i][j] = pattern ((unsigned)j);
+    iovs[i].iov_base = bufs[i];
+    iovs[i].iov_len = size;
+    memset (&msgs[i], 0, sizeof(msgs[i]));
+    msgs[i].msg_hdr.msg_name = (void*)&sa;
+    msgs[i].msg_hdr.msg_namelen = sizeof(sa);
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  double const start = now();
+  unsigned long sent = 0;
+
+  while (sent < count) {
+    unsigned const num = count - sent < BATCH ? (unsigned)(count - sent) : BATCH;
+    for (unsigned i = 0; i < num; ++i) {
+      uint32_t const seq = htonl ((uint32_t)(sent + i));
+      memcpy (bufs[i], &seq, sizeof(seq));
+    }
+    int const r = sendmmsg (sock, msgs, num, 0);
+    if (r < 0) {
+      perror ("sendmmsg");
+      return 1;
+    }
+    sent += (unsigned)r;
+  }
+
+  double const elapsed = now() - start;
+  printf ("sent %lu in %.3f s (%.0f packets/s)\n", sent, elapsed, sent / elapsed);
+  return 0;
+}
+
+static int peer_recv (int const sock, unsigned short const port
+, unsigned long const count, const char* const source)
+{
+  static unsigned char bufs[BATCH][SIZE_MAX_ + 1];
+  struct iovec iovs[BATCH];
+  struct mmsghdr msgs[BATCH];
+  struct sockaddr_in addrs[BATCH];
+  struct sockaddr_in sa = {
+    .sin_family = AF_INET,
+    .sin_port = htons (port),
+    .sin_addr.s_addr = INADDR_ANY
+  };
+  struct in_addr src;
+  int const rcvbuf = 64 << 20;
+
+  if (inet_pton (AF_INET, source, &src) != 1) {
+    fprintf (stderr, "Invalid address: %s\n", source);
+    return 2;
+  }
+
+  unsigned char* const seen = calloc (count, 1);
+  if (seen == NULL) return 2;
+
+  setsockopt (sock, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf));
+  if (bind (sock, (struct sockaddr*)&sa, sizeof(sa)) != 0) {
+    perror ("bind");
+    return 2;
+  }
+
+  /* Ready: the script starts sending once this is out */
+  printf ("listening\n");
+  fflush (stdout);
+
+  unsigned long received = 0, bad = 0, dups = 0;
+  double first = 0, last = 0;
+  struct pollfd pfd = {.fd = sock, .events = POLLIN};
+
+  while (received < count) {
+    int const r = poll (&pfd, 1, received == 0 ? 10 * IDLE_MS : IDLE_MS);
+    if (r <= 0) break;
+
+    for (unsigned i = 0; i < BATCH; ++i) {
+      iovs[i].iov_base = bufs[i];
+      iovs[i].iov_len = sizeof(bufs[i]);
+      memset (&msgs[i], 0, sizeof(msgs[i]));
+      msgs[i].msg_hdr.msg_name = &addrs[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int const num = recvmmsg (sock, msgs, BATCH, MSG_DONTWAIT, NULL);
+    if (num <= 0) continue;
+
+    last = now();
+    if (received == 0) first = last;
+
+    for (int i = 0; i < num; ++i) {
+      size_t const len = msgs[i].msg_len;
+      uint32_t seq;
+      int ok = len >= 4 && addrs[i].sin_addr.s_addr == src.s_addr;
+
+      if (ok) {
+        memcpy (&seq, bufs[i], sizeof(seq));
+        seq = ntohl (seq);
+        ok = seq < count;
+        for (size_t j = 4; ok && j < len; ++j) ok = bufs[i][j] == pattern ((unsigned)j);
+      }
+
+      if (!ok) bad++;
+      else if (seen[seq]) dups++;
+      else {
+        seen[seq] = 1;
+        received++;
+      }
+    }
+  }
+
+  double const elapsed = last - first;
+  printf ("received %lu of %lu (%lu wrong, %lu duplicates)", received, count, bad, dups);
+  if (elapsed > 0) printf (" in %.3f s (%.0f packets/s)", elapsed, received / elapsed);
+  printf ("\n");
+
+  free (seen);
+  return bad != 0 || dups != 0 || (count < 10000 && received != count);
+}
+
+int main (int const argc, char** const argv)
+{
+  if (argc != 5) {
+    fprintf (stderr, "Usage: %s send <port> <count> <size>\n"
+    "       %s recv <port> <count> <source address>\n", argv[0], argv[0]);
+    return 2;
+  }
+
+  unsigned short const port = (unsigned short)atoi (argv[2]);
+  unsigned long const count = strtoul (argv[3], NULL, 10);
+
+  int const sock = socket (AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0) {
+    perror ("socket");
+    return 2;
+  }
+
+  if (strcmp (argv[1], "send") == 0) {
+    size_t const size = strtoul (argv[4], NULL, 10);
+    if (size < 4 || size > SIZE_MAX_) {
+      fprintf (stderr, "Size must be 4 to %d bytes\n", SIZE_MAX_);
+      return 2;
+    }
+    return peer_send (sock, port, count, size);
+  }
+
+  if (strcmp (argv[1], "recv") == 0) return peer_recv (sock, port, count, argv[4]);
+
+  fprintf (stderr, "Unknown mode: %s\n", argv[1]);
+  return 2;
+}